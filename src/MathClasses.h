@@ -3,9 +3,24 @@
 #define MATHCLASSES_H
 
 #include <cstdint>
+#include <cstdlib>
 #include <math.h>
 #include <algorithm>
+#if defined(_MSC_VER)
 #include <intrin.h>
+#else
+// gcc and clang need -msse4.1 for _mm_blend_ps, the avx2 functions are
+// enabled per function and only called when the processor supports them
+#include <immintrin.h>
+#endif
+
+// fused multiply-add is only used when the whole build targets avx2, the
+// vector helpers are too small to dispatch at runtime
+#if defined(__FMA__) || defined(__AVX2__)
+#define USE_FMA() 1
+#else
+#define USE_FMA() 0
+#endif
 
 typedef float real32;
 
@@ -55,6 +70,51 @@ namespace NMath
       return delta < scaledEpsilon;
    }
 
+   // true when the processor and the operating system support avx2 and fma
+   inline bool HasAvx2()
+   {
+#if defined(_MSC_VER)
+      int info[4];
+      __cpuid(info, 1);
+      bool const hasFma = (info[2] & (1 << 12)) != 0;
+      bool const hasAvx = (info[2] & (1 << 28)) != 0;
+      // xgetbv can only be used when the os has turned on osxsave, and the os
+      // has to save the sse and avx registers on a task switch
+      bool const savesYmm = (info[2] & (1 << 27)) != 0 && (_xgetbv(0) & 6) == 6;
+      __cpuidex(info, 7, 0);
+      bool const hasAvx2 = (info[1] & (1 << 5)) != 0;
+      return hasFma && hasAvx && savesYmm && hasAvx2;
+#else
+      __builtin_cpu_init();
+      return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#endif
+   }
+
+#if USE_INTRINSICS()
+   // x * x' + y * y' + z * z' in the first float, the fourth float is ignored
+   inline __m128 DotProduct3(__m128 const lhs, __m128 const rhs)
+   {
+#if USE_FMA()
+      __m128 const result = _mm_mul_ss(lhs, rhs);
+      __m128 const lhsY = _mm_shuffle_ps(lhs, lhs, _MM_SHUFFLE(1, 1, 1, 1));
+      __m128 const rhsY = _mm_shuffle_ps(rhs, rhs, _MM_SHUFFLE(1, 1, 1, 1));
+      return _mm_fmadd_ss(_mm_movehl_ps(lhs, lhs), _mm_movehl_ps(rhs, rhs), _mm_fmadd_ss(lhsY, rhsY, result));
+#else
+      __m128 const product = _mm_mul_ps(lhs, rhs);
+      __m128 const productY = _mm_shuffle_ps(product, product, _MM_SHUFFLE(1, 1, 1, 1));
+      return _mm_add_ss(_mm_add_ss(product, productY), _mm_movehl_ps(product, product));
+#endif
+   }
+
+   // the three rows of a 3x4 transform times < x, y, z, w >
+   inline __m128 TransformRows(__m128 const row0, __m128 const row1, __m128 const row2, __m128 const vector)
+   {
+      __m128 const row01 = _mm_hadd_ps(_mm_mul_ps(row0, vector), _mm_mul_ps(row1, vector));
+      __m128 const row22 = _mm_hadd_ps(_mm_mul_ps(row2, vector), _mm_mul_ps(row2, vector));
+      return _mm_hadd_ps(row01, row22);
+   }
+#endif
+
    inline uint32_t const NextPowerOfTwo(uint32_t const value)
    {
       for (uint32_t i = 0; i < 32; ++i)
@@ -71,11 +131,22 @@ namespace NMath
 
 //-------------------------------------------------------------------------
 
-class CVector3f
+// padded to a full 16 byte register so it can be loaded without reading past the end
+class alignas(16) CVector3f
 {
 public:
    CVector3f(real32 const x, real32 const y, real32 const z)
-      : mX(x), mY(y), mZ(z) { }
+      : mX(x), mY(y), mZ(z), mW(0.f) { }
+#if USE_INTRINSICS()
+   // The whole register is stored over the object with the fourth float cleared,
+   // so the padding is always zero. Pulling the three floats out one at a time is
+   // slower in the benchmark.
+   explicit CVector3f(__m128 const value)
+   {
+      _mm_store_ps(reinterpret_cast<real32*>(this), _mm_blend_ps(value, _mm_setzero_ps(), 0x8));
+   }
+   __m128 AsRegister() const { return _mm_load_ps(&mX); }
+#endif
    CVector3f const operator-() const { return CVector3f(-mX, -mY, -mZ); }
    CVector3f const operator+(CVector3f const& rhs) const { return CVector3f(mX + rhs.mX, mY + rhs.mY, mZ + rhs.mZ); }
    CVector3f const operator-(CVector3f const& rhs) const { return CVector3f(mX - rhs.mX, mY - rhs.mY, mZ - rhs.mZ); }
@@ -90,18 +161,7 @@ public:
 #if USE_INTRINSICS()
    real32 const DotProductWith( CVector3f const& rhs ) const
    {
-      // load the values
-      __m128 const value0 = _mm_loadu_ps( &mX );
-      __m128 const value1 = _mm_loadu_ps( &rhs.mX );
-
-      uint32_t const skUpperMask = 0x70; // calculate off of the first three floats
-      uint32_t const skLowerMask = 0x01; // the result goes into r0 
-
-      // dot product
-      __m128 const dotProduct = _mm_dp_ps( value0, value1, skUpperMask | skLowerMask );
-
-      // get the results
-      return _mm_cvtss_f32( dotProduct );
+      return _mm_cvtss_f32( NMath::DotProduct3( AsRegister(), rhs.AsRegister() ) );
    }
 #else
    real32 const DotProductWith(CVector3f const& rhs) const { return mX * rhs.mX + mY * rhs.mY + mZ * rhs.mZ; }
@@ -122,13 +182,8 @@ public:
    real32 const MagnitudeSquared() const { return DotProductWith(*this); }
    real32 const Magnitude() const { 
 #if USE_INTRINSICS()
-      __m128 const value = _mm_loadu_ps( &mX );
-
-      // dot product
-      uint32_t constexpr skUpperMask = 0x70; // calculate off of the first three floats
-      uint32_t constexpr skLowerMask = 0x01; // the result goes into r0 
-
-      __m128 const dotProduct = _mm_dp_ps( value, value, skUpperMask | skLowerMask );
+      __m128 const value = AsRegister();
+      __m128 const dotProduct = NMath::DotProduct3( value, value );
 
       // calculate the square root
       return  _mm_cvtss_f32( _mm_sqrt_ss( dotProduct ) );
@@ -139,13 +194,8 @@ public:
    CVector3f const AsNormalized() const 
    { 
 #if USE_INTRINSICS()
-      __m128 const value = _mm_loadu_ps(&mX);
-
-      // dot product
-      uint32_t const skUpperMask = 0x70; // calculate off of the first three floats
-      uint32_t const skLowerMask = 0x01; // the result goes into r0 
-
-      __m128 const dotProduct = _mm_dp_ps(value, value, skUpperMask | skLowerMask);
+      __m128 const value = AsRegister();
+      __m128 const dotProduct = NMath::DotProduct3(value, value);
 
       // approximate reciprocal square root
       real32 inverseMagnitude = _mm_cvtss_f32(_mm_rsqrt_ss(dotProduct));
@@ -156,7 +206,7 @@ public:
       real32 const halfVal = 0.5f * magSquared;
       inverseMagnitude = inverseMagnitude * (1.5f - inverseMagnitude * inverseMagnitude * halfVal);
 
-      return CVector3f(mX * inverseMagnitude, mY * inverseMagnitude, mZ * inverseMagnitude);
+      return CVector3f(_mm_mul_ps(value, _mm_set1_ps(inverseMagnitude)));
 #else
       return *this / Magnitude(); 
 #endif
@@ -190,6 +240,7 @@ public:
       real32 mZ;
       real32 z;
    };
+   real32 mW;
 };
 
 //-------------------------------------------------------------------------
@@ -249,7 +300,8 @@ inline CRelAngle const& CRelAngle::operator/=(real32 const rhs)
 
 //-------------------------------------------------------------------------
 
-class CTransform4f
+// each row is 16 byte aligned so the rows can be loaded straight into registers
+class alignas(16) CTransform4f
 {
 public:
    explicit CTransform4f(real32 const a00, real32 const a01, real32 const a02, real32 const a03,
@@ -428,21 +480,10 @@ public:
    {
 #if USE_INTRINSICS()
 
-      __m128 const vector = _mm_set_ps(1.f, rhs.GetZ(), rhs.GetY(), rhs.GetX());
-
-      __m128 const row0 = _mm_loadu_ps(&m00);
-      __m128 const row1 = _mm_loadu_ps(&m10);
-      __m128 const row2 = _mm_loadu_ps(&m20);
-
-
-      uint32_t const skUpperMask = 0xF0;
-      uint32_t const skLowerMask = 0x01;
-
-      __m128 resultX = _mm_dp_ps(vector, row0, skUpperMask | skLowerMask);
-      __m128 resultY = _mm_dp_ps(vector, row1, skUpperMask | skLowerMask);
-      __m128 resultZ = _mm_dp_ps(vector, row2, skUpperMask | skLowerMask);
+      // < x, y, z, 1 >
+      __m128 const vector = _mm_blend_ps(rhs.AsRegister(), _mm_set1_ps(1.f), 0x8);
 
-      return CVector3f(_mm_cvtss_f32(resultX), _mm_cvtss_f32(resultY), _mm_cvtss_f32(resultZ));
+      return CVector3f(NMath::TransformRows(_mm_load_ps(&m00), _mm_load_ps(&m10), _mm_load_ps(&m20), vector));
 #else
       return CVector3f(
          m00 * rhs.GetX() + m01 * rhs.GetY() + m02 * rhs.GetZ() + m03,
@@ -463,10 +504,17 @@ public:
 
    CVector3f const Rotate(CVector3f const & rhs) const
    {
+#if USE_INTRINSICS()
+      // < x, y, z, 0 > leaves out the translation
+      __m128 const vector = _mm_blend_ps(rhs.AsRegister(), _mm_setzero_ps(), 0x8);
+
+      return CVector3f(NMath::TransformRows(_mm_load_ps(&m00), _mm_load_ps(&m10), _mm_load_ps(&m20), vector));
+#else
       return CVector3f(
          m00 * rhs.GetX() + m01 * rhs.GetY() + m02 * rhs.GetZ(),
          m10 * rhs.GetX() + m11 * rhs.GetY() + m12 * rhs.GetZ(),
          m20 * rhs.GetX() + m21 * rhs.GetY() + m22 * rhs.GetZ());
+#endif
    }
 
    CVector3f const TransposeRotate(CVector3f const & rhs) const
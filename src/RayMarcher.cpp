@@ -4,16 +4,44 @@
 // Lot's stuff taken from
 // https://www.iquilezles.org/www/index.htm
 // http://blog.hvidtfeldts.net/index.php/2011/06/distance-estimated-3d-fractals-part-i/
+//
+// On platforms other than Windows this builds as a command line renderer that
+// writes the frames to disk, for example:
+// g++ -std=c++20 -O2 -msse4.1 -pthread RayMarcher.cpp -o RayMarcher
 //-----------------------------------------------------------------------------
 
+#if defined(_WIN32)
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
-
 #include <tchar.h>
+#else
+#define UNREFERENCED_PARAMETER(P) (void)(P)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <bit>
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <string>
 #include <memory>
+#include <new>
 #include <vector>
 #include <functional>
+#include <type_traits>
 #include <atomic>
+#include <deque>
 #include <condition_variable>
 #include <mutex>
 #include <thread>
@@ -23,6 +51,15 @@
 //===================================================================================
 // Options that you can enable or disable
 
+// Render frames to image files from the command line instead of opening a window.
+// This is always the case on platforms other than Windows. On Windows the project
+// has to be switched to the console subsystem to use this.
+#if defined(_WIN32)
+#define HEADLESS_RENDER() 0
+#else
+#define HEADLESS_RENDER() 1
+#endif
+
 // Allow the window to be resized
 #define CAN_BE_RESIZED() 1
 
@@ -35,6 +72,46 @@
 // draw an outline between objects and infinite space
 #define DRAW_OBJECT_OUTLINE() 0
 
+// count rays and distance evaluations for each worker thread
+#define COLLECT_RENDER_STATS() 1
+
+// evaluate distances with the flattened instruction list of the scene instead
+// of walking the tree of render objects
+#define USE_COMPILED_SDF() 1
+
+// march the primary rays of neighbouring pixels together and evaluate their
+// distances with simd instructions, this needs USE_COMPILED_SDF()
+#define USE_RAY_PACKETS() 1
+
+// skip the exact distance of objects when a point is far from their bounds
+#define USE_BOUNDING_VOLUMES() 1
+
+// calculate normals from the gradient of the object that was hit instead of
+// sampling the distance of the whole scene around the point
+#define USE_ANALYTIC_NORMALS() 1
+
+// march one cone for every block of pixels before the frame is rendered, the
+// primary rays of the block start where the cone first got close to a surface
+#define USE_CONE_PREPASS() 1
+
+// start the primary rays at the depth of the last frame when the part of the
+// ray in front of it can be shown to be empty, see ValidateStartTime. With the
+// cone prepass the rays already start close to the surfaces, so this only helps
+// without it.
+#define USE_TEMPORAL_REPROJECTION() 0
+
+// give every tile of the screen a list of the objects whose bounds it overlaps
+// on the screen, its primary rays only look at those. See CRenderScene::BuildTiles
+#define USE_TILE_CULLING() 1
+
+// give every tile of the screen a copy of the scene without the objects and csg
+// children that its primary rays can't hit, this needs USE_COMPILED_SDF()
+#define USE_TILE_PRUNING() 1
+
+// render the frame in big blocks first and then refine them in passes, this
+// only helps when the frame is shown while it is being rendered
+#define PROGRESSIVE_RENDER() (!HEADLESS_RENDER())
+
 namespace
 {
    // default settings that you can change
@@ -54,12 +131,71 @@ namespace
    // the surfaces less accurate
    real32 constexpr skMinLength = 0.0001f;
 
-   // how far off the surface to start a shadow or reflection ray
-   real32 constexpr skSecondaryRayOffset = skMinLength * 10.f;
-
-
-   // larger values will decrease render time, but make blocker
+   // A ray hits a surface when it is closer than this fraction of the width of a
+   // pixel at the distance it has travelled from the camera, or skMinLength when
+   // that is bigger. Far surfaces don't need to be found more exactly than a pixel.
+   real32 constexpr skPixelFootprint = 0.25f;
+
+   // The hit distance never gets bigger than this. Reflection rays and low resolutions
+   // would otherwise grow it without a limit. It has to stay below skBoundsMargin so a
+   // ray can't stop on a bounding sphere, and below the surface offset.
+   real32 constexpr skMaxHitDistance = 0.025f;
+
+   // How far off the surface shadow and reflection rays start, times the hit distance.
+   // A hit point can be up to a hit distance inside or outside of the surface, the
+   // rays need to get clear of that before they look for a hit of their own.
+   real32 constexpr skSurfaceOffset = 10.f;
+
+   // The surface offset never gets bigger than this, so a shadow ray can't start on
+   // the other side of a thin object
+   real32 constexpr skMaxSurfaceOffset = 0.1f;
+   static_assert(skMaxSurfaceOffset >= skMaxHitDistance * 2.f, "a ray could start within the hit distance of its surface");
+
+   // How far apart the distance is sampled to estimate a normal, times the hit distance,
+   // and at most skMaxNormalEpsilon so the samples stay close to small details
+   real32 constexpr skNormalEpsilon = 10.f;
+   real32 constexpr skMaxNormalEpsilon = 0.01f;
+
+   // a ray that has taken more steps than this is treated as a hit
+   int32_t constexpr skMaxMarchSteps = 200;
+
+   // number of bounces for a primary ray, including the primary ray
+   int32_t constexpr skPrimaryRayDepth = 4;
+
+   // The exact distance of an object is only evaluated once a point is closer
+   // than this to its bounding sphere, before that the distance to the sphere
+   // is used. Smaller values skip more work but take more steps.
+   real32 constexpr skBoundsMargin = 1.f;
+   static_assert(skMaxHitDistance < skBoundsMargin, "a ray could stop on a bounding sphere");
+
+   // Primary and reflection rays step this many times the distance while the
+   // steps stay safe, 1 is plain sphere tracing. Values between 1.2 and 1.8
+   // take fewer steps on surfaces that the rays graze.
+   real32 constexpr skDefaultRelaxation = 1.f;
+
+   // the width and height in pixels of the blocks that share one cone in the
+   // prepass. Bigger blocks march fewer cones, but they stop further from the surfaces.
+   uint32_t constexpr skConeBlockSize = 8;
+
+   // A depth from the last frame is moved this fraction of the way towards the
+   // camera, so the surface is still in front of the ray when it moved a little.
+   real32 constexpr skReprojectionMargin = 0.005f;
+
+   // The width and height in pixels of the tiles that the scene is culled and pruned for, and
+   // how many slices the view frustum of a tile is cut into along the rays. Thinner
+   // slices give tighter bounds but take longer to prune.
+   uint32_t constexpr skTileSize = 32;
+   uint32_t constexpr skTileSlices = 16;
+   static_assert( skTileSize % skConeBlockSize == 0, "a cone block has to be inside of one tile" );
+
+   // The block size of the first pass when rendering progressively, every pass
+   // after that halves the block size until single pixels are rendered.
+   // Larger values will show a picture sooner, but make it blockier.
+#if PROGRESSIVE_RENDER()
+   uint32_t constexpr skInitialStepSize = 8;
+#else
    uint32_t constexpr skInitialStepSize = 1;
+#endif
 
    // Setting this number higher will make the UI more responsive for larger scenes
    // number of jobs to generate per core
@@ -69,6 +205,10 @@ namespace
    uint32_t constexpr skJobCoreMultiplier = 50;
 #endif
 
+   // a work area is only split up for an idle thread when it has at least
+   // twice this many rows left
+   uint32_t constexpr skMinSplitRows = 4;
+
    // this is the color that will be used when missing the target
    CColor4f const skBackgroundColor( 0.2f, 0.3f, 0.4f );
 }
@@ -81,6 +221,209 @@ namespace
    real32 constexpr skSmallNumber = 1e-5f;
 }
 
+//===================================================================================
+// Counters for measuring the renderer, every worker thread has its own copy
+
+struct alignas(64) SRenderStats
+{
+   uint64_t mPrimaryRays{ 0 };
+   uint64_t mReflectionRays{ 0 };
+   uint64_t mShadowRays{ 0 };
+   uint64_t mDistanceEvaluations{ 0 };
+
+   // march steps taken by each kind of ray
+   uint64_t mPrimarySteps{ 0 };
+   uint64_t mReflectionSteps{ 0 };
+   uint64_t mShadowSteps{ 0 };
+
+   // relaxed steps that went too far and were taken again
+   uint64_t mRelaxationFallbacks{ 0 };
+
+   // march steps of the cones in the prepass
+   uint64_t mConeSteps{ 0 };
+
+   // primary rays that started at the depth of the last frame, and the ones
+   // where it couldn't be shown that nothing was in front of that depth
+   uint64_t mReprojectedRays{ 0 };
+   uint64_t mReprojectionFailures{ 0 };
+
+   SRenderStats& operator+=( SRenderStats const& rhs )
+   {
+      mPrimaryRays += rhs.mPrimaryRays;
+      mReflectionRays += rhs.mReflectionRays;
+      mShadowRays += rhs.mShadowRays;
+      mDistanceEvaluations += rhs.mDistanceEvaluations;
+      mPrimarySteps += rhs.mPrimarySteps;
+      mReflectionSteps += rhs.mReflectionSteps;
+      mShadowSteps += rhs.mShadowSteps;
+      mRelaxationFallbacks += rhs.mRelaxationFallbacks;
+      mConeSteps += rhs.mConeSteps;
+      mReprojectedRays += rhs.mReprojectedRays;
+      mReprojectionFailures += rhs.mReprojectionFailures;
+      return *this;
+   }
+};
+
+#if COLLECT_RENDER_STATS()
+namespace
+{
+   // the stats of the worker thread that is running, null on all other threads
+   thread_local SRenderStats* tlpRenderStats = nullptr;
+}
+#define RENDER_STAT_ADD( counter, value ) (tlpRenderStats != nullptr ? (void)(tlpRenderStats->counter += (value)) : (void)0)
+#else
+#define RENDER_STAT_ADD( counter, value ) ((void)0)
+#endif
+
+//===================================================================================
+// A scene can be made of a great many small objects, and all of them are built again
+// whenever its file is loaded again. Instead of going to the heap for every one of
+// them they come from an arena that hands out memory from big blocks, so the
+// objects of a scene are next to each other. The
+// memory isn't given back one object at a time, all of it is reused at once when
+// the arena is reset after the objects have been released.
+
+class CSceneArena
+{
+public:
+   static size_t constexpr skBlockSize = 64 * 1024;
+   static size_t constexpr skBlockAlignment = 64;
+
+   CSceneArena() = default;
+   CSceneArena( CSceneArena const& ) = delete;
+   CSceneArena& operator=( CSceneArena const& ) = delete;
+
+   ~CSceneArena()
+   {
+      for (uint8_t* const pBlock : mBlocks)
+      {
+         ::operator delete( pBlock, std::align_val_t( skBlockAlignment ) );
+      }
+   }
+
+   // bigger allocations don't come from the arena
+   static bool Fits( size_t const size )
+   {
+      return size <= skBlockSize / 4;
+   }
+
+   void* Allocate( size_t const size, size_t const alignment )
+   {
+      mLiveAllocations.fetch_add( 1, std::memory_order_relaxed );
+      for (;;)
+      {
+         if (mBlock < mBlocks.size())
+         {
+            size_t const offset = (mOffset + alignment - 1) & ~(alignment - 1);
+            if (offset + size <= skBlockSize)
+            {
+               mOffset = offset + size;
+               return mBlocks[mBlock] + offset;
+            }
+            ++mBlock;
+            mOffset = 0;
+         }
+         else
+         {
+            mBlocks.push_back( static_cast<uint8_t*>(::operator new( skBlockSize, std::align_val_t( skBlockAlignment ) )) );
+         }
+      }
+   }
+
+   // the last reference to an object can be dropped on any thread
+   void Release()
+   {
+      mLiveAllocations.fetch_sub( 1, std::memory_order_release );
+   }
+
+   // Starts handing out the blocks from the beginning again, the blocks are kept.
+   // Nothing is reused while an allocation is still alive, then it returns false
+   // and new allocations keep adding blocks.
+   bool Reset()
+   {
+      if (mLiveAllocations.load( std::memory_order_acquire ) != 0)
+      {
+         return false;
+      }
+      mBlock = 0;
+      mOffset = 0;
+      return true;
+   }
+
+private:
+   std::vector< uint8_t* > mBlocks;
+   size_t mBlock{ 0 };
+   size_t mOffset{ 0 };
+   std::atomic<uint32_t> mLiveAllocations{ 0 };
+};
+
+namespace
+{
+   // the arena of the scene that is being built on this thread, see NScene::BuildScene
+   thread_local CSceneArena* tlpSceneArena = nullptr;
+}
+
+// Allocates from an arena, or from the heap when there is no arena
+template<class T>
+class TArenaAllocator
+{
+public:
+   using value_type = T;
+
+   explicit TArenaAllocator( CSceneArena* const pArena )
+      : mpArena( pArena )
+   {
+   }
+
+   template<class U>
+   TArenaAllocator( TArenaAllocator<U> const& other )
+      : mpArena( other.GetArena() )
+   {
+   }
+
+   T* allocate( size_t const count )
+   {
+      static_assert( alignof(T) <= CSceneArena::skBlockAlignment, "the arena blocks aren't aligned enough" );
+      size_t const size = sizeof( T ) * count;
+      if (mpArena == nullptr || !CSceneArena::Fits( size ))
+      {
+         return static_cast<T*>(::operator new( size, std::align_val_t( alignof(T) ) ));
+      }
+      return static_cast<T*>(mpArena->Allocate( size, alignof(T) ));
+   }
+
+   void deallocate( T* const pValues, size_t const count )
+   {
+      if (mpArena == nullptr || !CSceneArena::Fits( sizeof( T ) * count ))
+      {
+         ::operator delete( pValues, std::align_val_t( alignof(T) ) );
+         return;
+      }
+      mpArena->Release();
+   }
+
+   CSceneArena* GetArena() const
+   {
+      return mpArena;
+   }
+
+   template<class U>
+   bool operator==( TArenaAllocator<U> const& rhs ) const { return mpArena == rhs.GetArena(); }
+   template<class U>
+   bool operator!=( TArenaAllocator<U> const& rhs ) const { return mpArena != rhs.GetArena(); }
+
+private:
+   CSceneArena* mpArena;
+};
+
+// creates an object of the scene that is being built, the object and its
+// reference count are allocated together from the arena of the scene
+template<class T, class... TArgs>
+std::shared_ptr<T> MakeSceneObject( TArgs&&... args )
+{
+   return std::allocate_shared<T>( TArenaAllocator<T>( tlpSceneArena ), std::forward<TArgs>( args )... );
+}
+
 //===================================================================================
 
 class SSurfaceInfo
@@ -91,6 +434,53 @@ public:
    real32 dielectric{ 0.f };
 };
 
+//-------------------------------------------------------------------------
+// The records of a compiled scene, see NCompiledScene. They only hold plain
+// values so they can be used straight from the file.
+
+enum class ECompiledType : uint32_t
+{
+   // objects
+   Sphere,              // params: center, radius
+   Plane,               // params: normal, height
+   Cube,                // params: size
+   Union,
+   Intersection,
+   Difference,
+   SmoothUnion,         // params: k
+   Blend,               // params: blend factor
+   // materials
+   Color,
+   Checker,
+   Gradient,
+   // lights
+   AmbientLight,
+   DirectionalLight,
+   PointLight,
+   SpotLight,
+};
+
+// the children of an object are the next mChildCount objects and their children
+struct SCompiledObject
+{
+   static uint32_t constexpr skNoMaterial = ~0u;
+
+   CTransform4f mTransform;
+   real32 mParams[4];
+   SSurfaceInfo mSurfaceInfo;
+   ECompiledType mType;
+   uint32_t mChildCount;
+   uint32_t mMaterial;
+};
+
+struct SCompiledMaterial
+{
+   CTransform4f mTransform;
+   CColor4f mColor0;
+   CColor4f mColor1;
+   ECompiledType mType;
+};
+
 //-------------------------------------------------------------------------
 // The texture objects
 
@@ -100,7 +490,7 @@ public:
    using TPtr = std::shared_ptr<CMaterialObject>;
    using TConstPtr = std::shared_ptr<CMaterialObject const>;
 
-   virtual ~CMaterialObject() = 0 { }
+   virtual ~CMaterialObject() { }
 
    void SetTransform( CTransform4f const& transform )
    {
@@ -113,6 +503,11 @@ public:
       return mTransform;
    }
 
+   CTransform4f const& GetInverseTransform() const
+   {
+      return mInverseTransform;
+   }
+
    CColor4f GetTransformedColorAtPoint( CVector3f const& point ) const
    {
       return GetColorAtPoint( mInverseTransform * point );
@@ -120,6 +515,12 @@ public:
 
    virtual CColor4f const GetColorAtPoint( CVector3f const& point ) const = 0;
 
+   // fills in the type and colors of the record, custom materials can't be compiled
+   virtual bool WriteCompiled( SCompiledMaterial& /*record*/ ) const
+   {
+      return false;
+   }
+
 private:
    CTransform4f mTransform{ CTransform4f::Identity() };
    CTransform4f mInverseTransform{ CTransform4f::Identity() };
@@ -133,6 +534,11 @@ public:
    {
    }
 
+   explicit CMaterialContainer( CMaterialObject::TPtr const& pMaterialObject )
+      : mMaterialObject( pMaterialObject )
+   {
+   }
+
    CMaterialObject::TConstPtr GetMaterial() const
    {
       return mMaterialObject;
@@ -161,6 +567,13 @@ public:
       return mColor;
    }
 
+   virtual bool WriteCompiled( SCompiledMaterial& record ) const override
+   {
+      record.mType = ECompiledType::Color;
+      record.mColor0 = mColor;
+      return true;
+   }
+
 private:
    CColor4f mColor;
 };
@@ -186,6 +599,14 @@ public:
       return mColor1;
    }
 
+   virtual bool WriteCompiled( SCompiledMaterial& record ) const override
+   {
+      record.mType = ECompiledType::Checker;
+      record.mColor0 = mColor0;
+      record.mColor1 = mColor1;
+      return true;
+   }
+
 private:
    CColor4f mColor0;
    CColor4f mColor1;
@@ -208,6 +629,14 @@ public:
       return CColor4f::Lerp( mColor0, mColor1, phase );
    }
 
+   virtual bool WriteCompiled( SCompiledMaterial& record ) const override
+   {
+      record.mType = ECompiledType::Gradient;
+      record.mColor0 = mColor0;
+      record.mColor1 = mColor1;
+      return true;
+   }
+
 private:
    CColor4f mColor0;
    CColor4f mColor1;
@@ -215,11 +644,12 @@ private:
 
 //-------------------------------------------------------------------------
 
-class CCustomMaterialObject : public CMaterialObject
+// keeps the type of the function so a lambda can be inlined into GetColorAtPoint
+template<class TFunction>
+class TCustomMaterialObject : public CMaterialObject
 {
 public:
-   using TCallback = std::function<CColor4f( CVector3f )>;
-   explicit CCustomMaterialObject( TCallback const& customFunction )
+   explicit TCustomMaterialObject( TFunction const& customFunction )
       : mCustomFunction( customFunction )
    {
    }
@@ -230,1505 +660,7939 @@ public:
    }
 
 private:
-   TCallback mCustomFunction;
+   TFunction mCustomFunction;
 };
 
-//-------------------------------------------------------------------------
+using CCustomMaterialObject = TCustomMaterialObject< std::function<CColor4f( CVector3f )> >;
 
-// The render objects
+//-------------------------------------------------------------------------
 
-class CRenderObject
+// Gathers the records of the objects of a scene and of their materials, see
+// CRenderObject::WriteCompiled. A material that is shared by several objects
+// is only written once.
+class CCompiledSceneWriter
 {
 public:
-   using TPtr = std::shared_ptr<CRenderObject>;
-   using TConstPtr = std::shared_ptr<CRenderObject const>;
-
-   virtual ~CRenderObject() = 0 { }
-
-   virtual real32 GetDistanceToPoint( CVector3f const& point ) const = 0;
-
-   real32 GetTransformedDistanceToPoint( CVector3f const& point ) const
+   void AddObject( SCompiledObject const& record )
    {
-      return GetDistanceToPoint( mInverseTransform * point );
+      mObjects.push_back( record );
    }
 
-   virtual CColor4f const GetColorAtPoint( CVector3f const& point ) const
+   // returns false for materials that can't be compiled
+   bool AddMaterial( CMaterialObject const& material, uint32_t& index )
    {
-      if (mMaterial.get() != nullptr)
+      auto const found = mMaterialIndices.find( &material );
+      if (found != mMaterialIndices.end())
       {
-         return mMaterial->GetTransformedColorAtPoint( mInverseTransform * point );
+         index = found->second;
+         return true;
       }
-      return CColor4f::White();
-   }
-
-   virtual void SetMaterial( CMaterialObject::TConstPtr const& material )
-   {
-      mMaterial = material;
-   }
-
-   void SetTransform( CTransform4f const& transform )
-   {
-      mTransform = transform;
-      mInverseTransform = mTransform.GetInverse();
-   }
 
-   CTransform4f const& GetTransform() const
-   {
-      return mTransform;
-   }
+      SCompiledMaterial record{ material.GetTransform(), CColor4f::White(), CColor4f::White(), ECompiledType::Color };
+      if (!material.WriteCompiled( record ))
+      {
+         return false;
+      }
 
-   CTransform4f const& GetInverseTransform() const
-   {
-      return mInverseTransform;
+      index = static_cast<uint32_t>(mMaterials.size());
+      mMaterials.push_back( record );
+      mMaterialIndices.emplace( &material, index );
+      return true;
    }
 
-   SSurfaceInfo const& GetSurfaceInfo() const
+   std::vector< SCompiledObject > const& GetObjects() const
    {
-      return mSurfaceInfo;
+      return mObjects;
    }
 
-   void SetSurfaceInfo( SSurfaceInfo const& surfaceInfo )
+   std::vector< SCompiledMaterial > const& GetMaterials() const
    {
-      mSurfaceInfo = surfaceInfo;
+      return mMaterials;
    }
 
 private:
-   CMaterialObject::TConstPtr mMaterial;
-   CTransform4f mTransform{ CTransform4f::Identity() };
-   CTransform4f mInverseTransform{ CTransform4f::Identity() };
-   SSurfaceInfo mSurfaceInfo;
+   std::vector< SCompiledObject > mObjects;
+   std::vector< SCompiledMaterial > mMaterials;
+   std::map< CMaterialObject const*, uint32_t > mMaterialIndices;
 };
 
-using TRenderObjects = std::vector< CRenderObject* >;
-
 //-------------------------------------------------------------------------
 
-// this is a wrapper around objects to make them easier to 
-// manipulate during creation
+// A sphere that the whole surface of an object is inside of. The distance to
+// it is never more than the distance to the surface, which makes it a cheap
+// lower bound for the distance to an object.
 
-class CObjectContainer
+struct SBoundingSphere
 {
-public:
-
-   explicit CObjectContainer( CRenderObject* pRenderObject )
-      : mpRenderObject( pRenderObject )
+   explicit SBoundingSphere( CVector3f const& center, real32 const radius )
+      : mCenter( center )
+      , mRadius( radius )
    {
    }
 
-   CObjectContainer& operator<<( CTransform4f const& transform )
+   explicit SBoundingSphere( real32 const radius )
+      : mCenter( CVector3f::Zero() )
+      , mRadius( radius )
    {
-      mpRenderObject->SetTransform( transform );
-      return *this;
    }
 
-   CObjectContainer& operator<<( CColor4f const& color )
+   // for objects that don't have bounds, every point is inside of it
+   static SBoundingSphere const Infinite() { return SBoundingSphere( skLargeNumber ); }
+
+   bool IsInfinite() const { return mRadius >= skLargeNumber; }
+
+   real32 GetDistanceToPoint( CVector3f const& point ) const
    {
-      mpRenderObject->SetMaterial( CMaterialObject::TConstPtr( new CColorMaterialObject( color ) ) );
-      return *this;
+      return IsInfinite() ? -skLargeNumber : (point - mCenter).Magnitude() - mRadius;
    }
 
-   CObjectContainer& operator<<( CMaterialContainer const& material )
+   SBoundingSphere const Expanded( real32 const amount ) const
    {
-      mpRenderObject->SetMaterial( material.GetMaterial() );
-      return *this;
+      return IsInfinite() ? *this : SBoundingSphere( mCenter, mRadius + amount );
    }
 
-   CObjectContainer& operator<<( SSurfaceInfo const& surfaceInfo )
+   SBoundingSphere const Transformed( CTransform4f const& transform ) const
    {
-      mpRenderObject->SetSurfaceInfo( surfaceInfo );
-      return *this;
+      if (IsInfinite())
+      {
+         return *this;
+      }
+
+      return SBoundingSphere( transform * mCenter, mRadius * GetLargestStretch( transform ) );
    }
 
-   CRenderObject::TConstPtr GetRenderObject() const
+   // The most that the transform can lengthen any vector by, which is its largest
+   // singular value. The lengths of the columns are only that for transforms that
+   // scale before they rotate, and are too small for a rotate followed by a
+   // non-uniform scale. It is the square root of the largest eigenvalue of M^T M,
+   // found in closed form for a symmetric 3x3 matrix:
+   // https://en.wikipedia.org/wiki/Eigenvalue_algorithm#3%C3%973_matrices
+   static real32 const GetLargestStretch( CTransform4f const& transform )
    {
-      return mpRenderObject;
+      CVector3f const column0 = transform.GetColumn( 0 );
+      CVector3f const column1 = transform.GetColumn( 1 );
+      CVector3f const column2 = transform.GetColumn( 2 );
+
+      double const a00 = CVector3f::Dot( column0, column0 );
+      double const a11 = CVector3f::Dot( column1, column1 );
+      double const a22 = CVector3f::Dot( column2, column2 );
+      double const a01 = CVector3f::Dot( column0, column1 );
+      double const a02 = CVector3f::Dot( column0, column2 );
+      double const a12 = CVector3f::Dot( column1, column2 );
+
+      double eigenvalue;
+      double const offDiagonal = a01 * a01 + a02 * a02 + a12 * a12;
+      if (offDiagonal == 0.0)
+      {
+         eigenvalue = std::max( std::max( a00, a11 ), a22 );
+      }
+      else
+      {
+         double const mean = (a00 + a11 + a22) / 3.0;
+         double const b00 = a00 - mean;
+         double const b11 = a11 - mean;
+         double const b22 = a22 - mean;
+         double const p = sqrt( (b00 * b00 + b11 * b11 + b22 * b22 + 2.0 * offDiagonal) / 6.0 );
+         double const determinant = b00 * (b11 * b22 - a12 * a12) - a01 * (a01 * b22 - a12 * a02) + a02 * (a01 * a12 - b11 * a02);
+         double const r = std::clamp( determinant / (2.0 * p * p * p), -1.0, 1.0 );
+         eigenvalue = mean + 2.0 * p * cos( acos( r ) / 3.0 );
+      }
+
+      // rounded up, so that rounding never makes the bounds smaller than the surface
+      return static_cast< real32 >( sqrt( eigenvalue ) * (1.0 + 1e-6) );
    }
 
-   CRenderObject::TPtr const & RenderObject() const
+   // the smallest sphere around both spheres
+   static SBoundingSphere const Enclose( SBoundingSphere const& lhs, SBoundingSphere const& rhs )
    {
-      return mpRenderObject;
+      if (lhs.IsInfinite() || rhs.IsInfinite())
+      {
+         return Infinite();
+      }
+
+      real32 const distance = (rhs.mCenter - lhs.mCenter).Magnitude();
+      if (distance + rhs.mRadius <= lhs.mRadius)
+      {
+         return lhs;
+      }
+      if (distance + lhs.mRadius <= rhs.mRadius)
+      {
+         return rhs;
+      }
+
+      real32 const radius = (distance + lhs.mRadius + rhs.mRadius) * 0.5f;
+      return SBoundingSphere( lhs.mCenter + (rhs.mCenter - lhs.mCenter) * ((radius - lhs.mRadius) / distance), radius );
    }
 
-private:
-   std::shared_ptr< CRenderObject > mpRenderObject;
+   CVector3f mCenter;
+   real32 mRadius;
 };
 
-using TObjectContainers = std::vector< CObjectContainer >;
+//-------------------------------------------------------------------------
 
-//-----------------------------------------------------------------------------------
+// The render objects can be compiled into a flat list of instructions for a
+// small stack machine. Every primitive pushes its distance and every csg
+// operation replaces the distances of its children with the combined value.
+// All the transforms from the world down to a primitive are multiplied
+// together while compiling, so each primitive only does one transform.
 
-// Lots of distance functions
-// https://iquilezles.org/www/articles/distfunctions/distfunctions.htm
+class CRenderObject;
 
-class CRenderSphere : public CRenderObject
+// the positions of a group of points, with one array for each axis so the
+// same axis of several points can be loaded into a simd register
+struct alignas(32) SPointPacket
 {
-public:
-   explicit CRenderSphere( CVector3f const& center, real32 const radius )
-      : mCenter( center )
-      , mRadius( radius )
-   {
-   }
-   explicit CRenderSphere( real32 const radius )
-      : mCenter( CVector3f::Zero() )
-      , mRadius( radius )
-   {
-   }
+   static uint32_t constexpr skWidth = 8;
 
-   virtual real32 GetDistanceToPoint( CVector3f const& point ) const override
-   {
-      return (point - mCenter).Magnitude() - mRadius;
-   }
+   real32 mX[skWidth];
+   real32 mY[skWidth];
+   real32 mZ[skWidth];
+};
 
-private:
-   CVector3f mCenter;
-   real32 mRadius;
+enum class ESdfOp : uint8_t
+{
+   Sphere,        // params: center, radius
+   Plane,         // params: normal, height
+   Cube,          // params: half size
+   Custom,        // calls GetDistanceToPoint on the object
+   Constant,      // params: distance
+   Union,
+   Intersection,
+   Difference,
+   SmoothUnion,   // params: k
+   Blend,         // params: fraction between the two distances
 };
 
-//-----------------------------------------------------------------------------
+struct SSdfInstruction
+{
+   ESdfOp mOp;
+   uint32_t mCount;        // number of distances combined by a csg operation
+   uint32_t mTransform;    // world to local transform of a primitive
+   real32 mParams[4];
+   CRenderObject const* mpObject;
+};
 
-class CRenderPlane : public CRenderObject
+// The range of values that a distance can have over a region of space. These
+// are used to find the parts of the scene that have no surface in a region.
+// See: Keeter "Massively Parallel Rendering of Complex Closed-Form Implicit Surfaces"
+struct SInterval
 {
-public:
-   explicit CRenderPlane( CVector3f const& normal, real32 const height )
-      : mNormal( normal )
-      , mHeight( height )
+   static SInterval const Abs( SInterval const& value )
+   {
+      if (value.mMin >= 0.f)
+      {
+         return value;
+      }
+      if (value.mMax <= 0.f)
+      {
+         return SInterval{ -value.mMax, -value.mMin };
+      }
+      return SInterval{ 0.f, NMath::max_val( -value.mMin, value.mMax ) };
+   }
+
+   static SInterval const Square( SInterval const& value )
    {
+      SInterval const absolute = Abs( value );
+      return SInterval{ absolute.mMin * absolute.mMin, absolute.mMax * absolute.mMax };
    }
 
-   explicit CRenderPlane( CVector3f const& normal )
-      : mNormal( normal )
-      , mHeight( 0 )
+   static SInterval const Length( SInterval const& x, SInterval const& y, SInterval const& z )
    {
+      SInterval const xx = Square( x );
+      SInterval const yy = Square( y );
+      SInterval const zz = Square( z );
+      return SInterval{ sqrtf( xx.mMin + yy.mMin + zz.mMin ), sqrtf( xx.mMax + yy.mMax + zz.mMax ) };
    }
 
-   virtual real32 GetDistanceToPoint( CVector3f const & point ) const override
+   static SInterval const Scale( SInterval const& value, real32 const scale )
    {
-      return CVector3f::Dot( mNormal, point ) - mHeight;
+      return scale >= 0.f ? SInterval{ value.mMin * scale, value.mMax * scale } : SInterval{ value.mMax * scale, value.mMin * scale };
    }
 
-private:
-   CVector3f mNormal;
-   real32 mHeight;
-};
+   SInterval const operator+( SInterval const& rhs ) const { return SInterval{ mMin + rhs.mMin, mMax + rhs.mMax }; }
+   SInterval const operator-( real32 const rhs ) const { return SInterval{ mMin - rhs, mMax - rhs }; }
 
-//-----------------------------------------------------------------------------
+   real32 mMin;
+   real32 mMax;
+};
 
-class CRenderCube : public CRenderObject
+class CSdfProgram
 {
 public:
-   explicit CRenderCube( CVector3f const& size )
-      : mSize( size * 0.5f )
+   // deepest nesting of distances that can be evaluated
+   static uint32_t constexpr skMaxStackDepth = 64;
+
+   // the instructions of a top level object
+   struct SObjectRange
    {
-   }
+      uint32_t mBegin;
+      uint32_t mEnd;
+   };
 
-   explicit CRenderCube( real32 const x, real32 const y, real32 const z )
-      : mSize( x * 0.5f, y * 0.5f, z * 0.5f )
+   // the values that the program is evaluated from, see Attach
+   struct STables
    {
-   }
+      SSdfInstruction const* mpInstructions;
+      uint32_t mInstructionCount;
+      CTransform4f const* mpTransforms;
+      uint32_t mTransformCount;
+      SObjectRange const* mpObjects;
+      uint32_t mObjectCount;
+   };
 
-   explicit CRenderCube( real32 const size )
-      : mSize( size * 0.5f, size * 0.5f, size * 0.5f  )
+   // clearing the program also lets go of attached tables
+   void Clear()
    {
+      mInstructions.clear();
+      mTransforms.clear();
+      mObjects.clear();
+      mAttached = STables{};
+      mIsAttached = false;
+      mDepth = 0;
+      mMaxDepth = 0;
    }
 
-   virtual real32 GetDistanceToPoint( CVector3f const& point ) const override
+   // Evaluates tables that are kept somewhere else, like in a compiled scene file,
+   // instead of copying them. They have to stay around for as long as the program
+   // is used. Returns false without changing anything when the tables aren't a
+   // program that can be evaluated.
+   bool Attach( STables const& tables );
+
+   STables const GetTables() const
    {
-      real32 const x = NMath::AbsF( point.GetX() ) - mSize.GetX();
-      real32 const y = NMath::AbsF( point.GetY() ) - mSize.GetY();
-      real32 const z = NMath::AbsF( point.GetZ() ) - mSize.GetZ();
-      // distance outside
-      real32 const d = CVector3f( NMath::max_val( x, 0.f ), NMath::max_val( y, 0.f ), NMath::max_val( z, 0.f ) ).Magnitude();
-      // distance inside
-      real32 const du = NMath::max_val( NMath::max_val( NMath::min_val( x, 0.f ), NMath::min_val( y, 0.f ) ), NMath::min_val( z, 0.f ) );
-      return  d + du;
+      if (mIsAttached)
+      {
+         return mAttached;
+      }
+      return STables{ mInstructions.data(), static_cast<uint32_t>(mInstructions.size()), mTransforms.data(), static_cast<uint32_t>(mTransforms.size()),
+         mObjects.data(), static_cast<uint32_t>(mObjects.size()) };
    }
 
-private:
-   CVector3f mSize;
-};
-
-//-----------------------------------------------------------------------------
+   // every top level object is evaluated on its own
+   void BeginObject()
+   {
+      uint32_t const start = static_cast<uint32_t>(mInstructions.size());
+      mObjects.push_back( SObjectRange{ start, start } );
+      mDepth = 0;
+   }
 
-class CRenderCustom : public CRenderObject
-{
-public:
-   using TCallback = std::function<real32( CVector3f )>;
-   explicit CRenderCustom( TCallback const& customFunction )
-      : mCustomFunction( customFunction )
+   void EndObject()
    {
+      mObjects.back().mEnd = static_cast<uint32_t>(mInstructions.size());
    }
 
-   virtual real32 GetDistanceToPoint( CVector3f const& point ) const override
+   void AddPrimitive( ESdfOp const op, CTransform4f const& worldToLocal, real32 const a, real32 const b, real32 const c, real32 const d )
    {
-      return mCustomFunction( point );
+      mTransforms.push_back( worldToLocal );
+      mInstructions.push_back( SSdfInstruction{ op, 0, static_cast<uint32_t>(mTransforms.size() - 1), { a, b, c, d }, nullptr } );
+      Push();
    }
 
-private:
-   TCallback mCustomFunction;
-};
+   void AddCustom( CRenderObject const* const pObject, CTransform4f const& worldToLocal )
+   {
+      mTransforms.push_back( worldToLocal );
+      mInstructions.push_back( SSdfInstruction{ ESdfOp::Custom, 0, static_cast<uint32_t>(mTransforms.size() - 1), { 0.f, 0.f, 0.f, 0.f }, pObject } );
+      Push();
+   }
 
-//-----------------------------------------------------------------------------
+   void AddConstant( real32 const distance )
+   {
+      mInstructions.push_back( SSdfInstruction{ ESdfOp::Constant, 0, 0, { distance, 0.f, 0.f, 0.f }, nullptr } );
+      Push();
+   }
 
-class CCompositeRenderObject : public CRenderObject
-{
-public:
-   explicit CCompositeRenderObject(std::initializer_list<CObjectContainer> const & objects)
+   void AddOperation( ESdfOp const op, uint32_t const count, real32 const param = 0.f )
    {
-      mObjectList.reserve(objects.size());
-      for (CObjectContainer const & object : objects)
-      {
-         mObjectList.push_back(CRenderObject::TPtr(object.RenderObject()));
-      }
+      mInstructions.push_back( SSdfInstruction{ op, count, 0, { param, 0.f, 0.f, 0.f }, nullptr } );
+      mDepth -= count;
+      Push();
    }
 
-   virtual CColor4f const GetColorAtPoint( CVector3f const& point ) const override
+   bool IsValid() const
    {
-#if 0
-      CRenderObject::TConstPtr closestObject;
-      real32 minPoint = skLargeNumber;
+      return mMaxDepth <= skMaxStackDepth;
+   }
 
-      for (CRenderObject::TConstPtr const & object : mObjectList)
-      {
-         real32 const objectDistance = NMath::AbsF( object->GetTransformedDistanceToPoint( GetInverseTransform() * point ) );
-         if ( objectDistance < minPoint)
-         {
-            minPoint = objectDistance;
-            closestObject = object;
-         }
-      }
-      if (closestObject.get() != nullptr)
-      {
-         return closestObject->GetColorAtPoint( GetInverseTransform() * point );
-      }
-      return CColor4f::White();
-#else
+   uint32_t GetObjectCount() const
+   {
+      return mIsAttached ? mAttached.mObjectCount : static_cast<uint32_t>(mObjects.size());
+   }
 
-      CColor4f color = CColor4f::Black();
+   real32 Evaluate( uint32_t const objectIndex, CVector3f const& point ) const;
 
-      real32 weight = 0.f;
+   // evaluates an object for the points of activeMask and keeps the smaller of
+   // each distance and the value that is already in pMinDistances
+   void EvaluatePacket( uint32_t const objectIndex, SPointPacket const& points, uint32_t const activeMask, real32* const pMinDistances ) const;
 
-      for (CRenderObject::TConstPtr const& object : mObjectList)
-      {
-         real32 const objectDistance = NMath::AbsF( object->GetTransformedDistanceToPoint( GetInverseTransform() * point ) );
+   // the corners in world space of each region that CopyPruned looks at
+   static uint32_t constexpr skRegionCorners = 8;
 
-         CColor4f const objectColor = object->GetColorAtPoint( GetInverseTransform() * point );
-         if (NMath::small_enough( objectDistance ))
-         {
-            return objectColor;
-         }
-         real32 const objectWeight = 1.f / powf( objectDistance , 0.9f );
-         weight += objectWeight;
-         color = color + objectColor * objectWeight;
-      }
+   // Adds an object to program without the csg children that can't change its
+   // surface inside of the regions, every region is the convex hull of the next
+   // skRegionCorners points of pCorners. Nothing is added and false is returned
+   // when the object has no surface in any of them. The distance may only change
+   // where it is more than slack, which is the hit distance of the rays, so the
+   // rays that only just miss a surface still miss it the same way.
+   bool CopyPruned( uint32_t const objectIndex, CVector3f const* const pCorners, uint32_t const regionCount, real32 const slack, CSdfProgram& program ) const;
 
-      return color * (1.f / weight);
+   // Compiles an object again over its old instructions after some of its values
+   // have changed. Returns false without changing anything when the object now
+   // compiles to different instructions, or the program is attached, then the whole
+   // program has to be compiled again.
+   bool Recompile( uint32_t const objectIndex, CRenderObject const& object );
 
-#endif
+private:
+   SSdfInstruction const* GetInstructions() const
+   {
+      return mIsAttached ? mAttached.mpInstructions : mInstructions.data();
    }
 
-   virtual void SetMaterial( CMaterialObject::TConstPtr const& material )
+   CTransform4f const* GetTransforms() const
    {
-      for (CRenderObject::TPtr & object : mObjectList)
-      {
-         object->SetMaterial( material );
-      }
+      return mIsAttached ? mAttached.mpTransforms : mTransforms.data();
    }
 
-protected:
-   std::vector< CRenderObject::TPtr > mObjectList;
-
-};
-
-//-----------------------------------------------------------------------------
-
-class CRenderUnion : public CCompositeRenderObject
-{
-public:
-   explicit CRenderUnion( std::initializer_list<CObjectContainer> const & objects )
-      : CCompositeRenderObject(objects)
+   SObjectRange const& GetObjectRange( uint32_t const objectIndex ) const
    {
+      return mIsAttached ? mAttached.mpObjects[objectIndex] : mObjects[objectIndex];
    }
 
-   virtual real32 GetDistanceToPoint( CVector3f const& point ) const override
-   {
-      real32 minValue = skLargeNumber;
+   // the range of distances of a primitive over a box in its local space
+   static SInterval EvaluateInterval( SSdfInstruction const& instruction, CVector3f const& boxMin, CVector3f const& boxMax );
 
-      for (CRenderObject::TPtr const& object : mObjectList)
-      {
-         minValue = NMath::min_val( minValue, object->GetTransformedDistanceToPoint( point ) );
-      }
+   // Copies the instructions of the subtree with its last instruction at begin + root,
+   // the arrays have a value for every instruction after begin. The value of a subtree
+   // may only change where it is more than slack, that way the surface of its parent
+   // stays the same.
+   void CopySubtree( uint32_t const begin, uint32_t const root, real32 const slack, real32 const* const pMinDistances, uint32_t const* const pSubtreeBegins, CSdfProgram& program ) const;
 
-      return minValue;
+   void Push()
+   {
+      ++mDepth;
+      mMaxDepth = NMath::max_val( mMaxDepth, mDepth );
    }
+
+   std::vector< SSdfInstruction > mInstructions;
+   std::vector< CTransform4f > mTransforms;
+   std::vector< SObjectRange > mObjects;
+   STables mAttached{};
+   bool mIsAttached = false;
+   uint32_t mDepth = 0;
+   uint32_t mMaxDepth = 0;
 };
 
-//-----------------------------------------------------------------------------
+//-------------------------------------------------------------------------
 
-class CRenderIntersection : public CCompositeRenderObject
+// The render objects
+
+class CRenderObject
 {
 public:
-   explicit CRenderIntersection( std::initializer_list<CObjectContainer> const & objects )
-      : CCompositeRenderObject(objects)
+   using TPtr = std::shared_ptr<CRenderObject>;
+   using TConstPtr = std::shared_ptr<CRenderObject const>;
+
+   virtual ~CRenderObject() { }
+
+   virtual real32 GetDistanceToPoint( CVector3f const& point ) const = 0;
+
+   real32 GetTransformedDistanceToPoint( CVector3f const& point ) const
    {
+      return GetDistanceToPoint( mInverseTransform * point );
    }
 
-   virtual real32 GetDistanceToPoint( CVector3f const& point ) const override
+   // adds the instructions for this object, worldToParent is the transform
+   // that GetTransformedDistanceToPoint would have been called with
+   void CompileTransformed( CSdfProgram& program, CTransform4f const& worldToParent ) const
    {
-      real32 maxValue = 0.f;
-
-      for (CRenderObject::TPtr const& object : mObjectList)
-      {
-         maxValue = NMath::max_val( maxValue, object->GetTransformedDistanceToPoint( point ) );
-      }
-
-      return maxValue;
+      Compile( program, mInverseTransform * worldToParent );
    }
-};
 
-//-----------------------------------------------------------------------------
+   // objects that can't be compiled are called through GetDistanceToPoint
+   virtual void Compile( CSdfProgram& program, CTransform4f const& worldToLocal ) const
+   {
+      program.AddCustom( this, worldToLocal );
+   }
 
-class CRenderDifference : public CCompositeRenderObject
-{
-public:
-   explicit CRenderDifference( std::initializer_list<CObjectContainer> const& objects )
-      : CCompositeRenderObject(objects)
+   // Returns the distance and its gradient. Objects that don't have an exact
+   // gradient estimate it from four distances epsilon away from the point.
+   // See: https://iquilezles.org/www/articles/normalsSDF/normalsSDF.htm
+   virtual real32 GetDistanceAndGradient( CVector3f const& point, real32 const epsilon, CVector3f& gradient ) const
    {
+      return EstimateDistanceAndGradient( [this]( CVector3f const& samplePoint ) { return GetDistanceToPoint( samplePoint ); }, point, epsilon, gradient );
    }
 
-   virtual real32 GetDistanceToPoint( CVector3f const& point ) const override
+   // finds the distances for the lanes in laneMask, the others are skLargeNumber.
+   // Objects that are called through the program can override this to avoid a
+   // virtual call for every point.
+   virtual void GetDistancesToPoints( real32 const* const pX, real32 const* const pY, real32 const* const pZ,
+      uint32_t const count, uint32_t const laneMask, real32* const pDistances ) const
    {
-      real32 maxValue = 0.f;
-      int32_t index = 0;
-      for (CRenderObject::TPtr const& object : mObjectList)
+      for (uint32_t lane = 0; lane < count; ++lane)
       {
-         // the first object is normal and all other objects cut from it
-         real32 const distance = (index++ ? -1.f : 1.f) * object->GetTransformedDistanceToPoint( point );
-         maxValue = NMath::max_val( maxValue, distance );
+         pDistances[lane] = (laneMask & (1u << lane)) ? GetDistanceToPoint( CVector3f( pX[lane], pY[lane], pZ[lane] ) ) : skLargeNumber;
       }
-
-      return maxValue;
    }
-};
 
-//-----------------------------------------------------------------------------
+   real32 GetTransformedDistanceAndGradient( CVector3f const& point, real32 const epsilon, CVector3f& gradient ) const
+   {
+      CVector3f localGradient = CVector3f::Zero();
+      real32 const distance = GetDistanceAndGradient( mInverseTransform * point, epsilon, localGradient );
+      gradient = mInverseTransform.TransposeRotate( localGradient );
+      return distance;
+   }
 
-class CRenderSmoothUnion : public CCompositeRenderObject
-{
-public:
-   explicit CRenderSmoothUnion( std::initializer_list<CObjectContainer> const& objects, real32 const k )
-      : CCompositeRenderObject(objects)
-      , mK(k)
+   // the bounds of the surface in the space that GetDistanceToPoint uses
+   virtual SBoundingSphere const GetLocalBounds() const
    {
+      return SBoundingSphere::Infinite();
    }
 
-   static real32 const SmoothUnion( real32 const d1, real32 const d2, real32 const k )
+   // the bounds in the space that GetTransformedDistanceToPoint uses
+   SBoundingSphere const GetTransformedBounds() const
    {
-      float const h = NMath::max_val( k - NMath::AbsF( d1 - d2 ), 0.f ) / k;
-      return NMath::min_val( d1, d2 ) - h * h * h * k * (1.f / 6.f);
+      return GetLocalBounds().Transformed( mTransform );
    }
 
-   virtual real32 GetDistanceToPoint( CVector3f const& point ) const override
+   // multiplies the transforms of the parents together so the colors can be found
+   // from a world space point with one transform per object. Call this after the
+   // transforms and materials have been set.
+   virtual void FoldTransforms( CTransform4f const& worldToParent )
    {
-      real32 minValue = skLargeNumber;
+      mWorldToLocal = mInverseTransform * worldToParent;
+      mWorldToMaterial = mMaterial.get() != nullptr ? mMaterial->GetInverseTransform() * mWorldToLocal : mWorldToLocal;
+   }
 
-      int32_t index = 0;
+   // the same as GetTransformedDistanceToPoint through all of the parents
+   real32 GetWorldDistanceToPoint( CVector3f const& point ) const
+   {
+      return GetDistanceToPoint( mWorldToLocal * point );
+   }
 
-      for (CRenderObject::TPtr const& object : mObjectList)
+   virtual CColor4f const GetWorldColorAtPoint( CVector3f const& point ) const
+   {
+      if (mMaterial.get() != nullptr)
       {
-         if (index++ == 0)
-         {
-            minValue = object->GetTransformedDistanceToPoint( point );
-         }
-         else
-         {
-            minValue = SmoothUnion( minValue, object->GetTransformedDistanceToPoint( point ), mK );
-         }
+         return mMaterial->GetColorAtPoint( mWorldToMaterial * point );
       }
-
-      return minValue;
+      return CColor4f::White();
    }
-private:
-   real32 mK;
-};
 
-class CRenderBlend : public CCompositeRenderObject
-{
-public:
-   explicit CRenderBlend( std::initializer_list<CObjectContainer> const& objects, real32 const k )
-      : CCompositeRenderObject(objects)
-      , mK( k )
+   virtual void SetMaterial( CMaterialObject::TConstPtr const& material )
    {
+      mMaterial = material;
    }
 
-   virtual real32 GetDistanceToPoint( CVector3f const& point ) const override
+   // only the csg operations that blend their children have a blend factor
+   virtual void SetBlendFactor( real32 const /*blendFactor*/ )
    {
-      uint32_t const lowerPosition = static_cast<uint32_t>(floorf( mK ));
-      uint32_t const upperPosition = lowerPosition + 1;
-
-      real32 const d0 = lowerPosition >= 0 && lowerPosition < mObjectList.size() ?
-         mObjectList[lowerPosition]->GetTransformedDistanceToPoint( GetInverseTransform()*point ) : skLargeNumber;
-      real32 const d1 = upperPosition >= 0 && upperPosition < mObjectList.size() ?
-         mObjectList[upperPosition]->GetTransformedDistanceToPoint( GetInverseTransform()*point ) : skLargeNumber;
-      return NMath::lerp(d0,d1, mK - floorf(mK));
    }
 
-   virtual CColor4f const GetColorAtPoint( CVector3f const& point ) const override
+   // Adds the records of the object and of its children to a compiled scene,
+   // returns false when one of them can't be compiled. Custom objects can't be
+   // since their distance is code.
+   virtual bool WriteCompiled( CCompiledSceneWriter& /*writer*/ ) const
    {
-      uint32_t const lowerPosition = static_cast<uint32_t>(floorf( mK ));
-      uint32_t const upperPosition = lowerPosition + 1;
+      return false;
+   }
 
-      CColor4f const c0 = lowerPosition >= 0 && lowerPosition < mObjectList.size() ?
-         mObjectList[lowerPosition]->GetColorAtPoint( GetInverseTransform() * point ) : CColor4f::Black();
-      CColor4f const c1 = upperPosition >= 0 && upperPosition < mObjectList.size() ?
-         mObjectList[upperPosition]->GetColorAtPoint( GetInverseTransform() * point ) : CColor4f::Black();
-
-      return CColor4f::Lerp( c0, c1, mK - floorf( mK ) );
+   void SetTransform( CTransform4f const& transform )
+   {
+      mTransform = transform;
+      mInverseTransform = mTransform.GetInverse();
    }
-private:
-   real32 mK;
-};
-
-//-----------------------------------------------------------------------------
 
-class CLightObject
-{
-public:
-   using TPtr = std::shared_ptr< CLightObject >;
-   using TConstPtr = std::shared_ptr< CLightObject const >;
+   CTransform4f const& GetTransform() const
+   {
+      return mTransform;
+   }
 
-   virtual ~CLightObject() = 0 {}
+   CTransform4f const& GetInverseTransform() const
+   {
+      return mInverseTransform;
+   }
 
-   virtual CColor4f CalculateValueAtPosition( CVector3f const& position, CVector3f const& surfaceNormal ) const = 0;
-   virtual CVector3f const& GetPosition() const = 0;
-   virtual bool CastsShadow() const 
+   CTransform4f const& GetWorldToLocal() const
    {
-      return false;
+      return mWorldToLocal;
    }
-};
 
-//-----------------------------------------------------------------------------
+protected:
+   template<class TDistance>
+   static real32 EstimateDistanceAndGradient( TDistance const& distance, CVector3f const& point, real32 const epsilon, CVector3f& gradient )
+   {
+      CVector3f const e0( 1.f, -1.f, -1.f );
+      CVector3f const e1( -1.f, -1.f, 1.f );
+      CVector3f const e2( -1.f, 1.f, -1.f );
+      CVector3f const e3( 1.f, 1.f, 1.f );
 
-class CAmbientLightObject : public CLightObject
-{
-public:
-   explicit CAmbientLightObject( CColor4f const& color )
-      : mColor( color )
+      gradient = (e0 * distance( point + e0 * epsilon ) +
+                  e1 * distance( point + e1 * epsilon ) +
+                  e2 * distance( point + e2 * epsilon ) +
+                  e3 * distance( point + e3 * epsilon )) * (0.25f / epsilon);
+      return distance( point );
+   }
+
+   // adds the record of this object, the records of its children have to come right after it
+   bool WriteCompiledRecord( CCompiledSceneWriter& writer, ECompiledType const type, real32 const a, real32 const b, real32 const c, real32 const d, uint32_t const childCount = 0 ) const
    {
+      SCompiledObject record{ mTransform, { a, b, c, d }, mSurfaceInfo, type, childCount, SCompiledObject::skNoMaterial };
+      if (mMaterial.get() != nullptr && !writer.AddMaterial( *mMaterial, record.mMaterial ))
+      {
+         return false;
+      }
+      writer.AddObject( record );
+      return true;
    }
 
-   virtual CColor4f CalculateValueAtPosition( CVector3f const& /*position*/, CVector3f const& /*surfaceNormal*/ ) const override
+public:
+
+   SSurfaceInfo const& GetSurfaceInfo() const
    {
-      return mColor;
+      return mSurfaceInfo;
    }
 
-   virtual CVector3f const& GetPosition() const override
+   void SetSurfaceInfo( SSurfaceInfo const& surfaceInfo )
    {
-      static CVector3f const skZero( CVector3f::Zero() );
-      return skZero;
+      mSurfaceInfo = surfaceInfo;
    }
 
 private:
-   CColor4f mColor;
+   CMaterialObject::TConstPtr mMaterial;
+   CTransform4f mTransform{ CTransform4f::Identity() };
+   CTransform4f mInverseTransform{ CTransform4f::Identity() };
+   CTransform4f mWorldToLocal{ CTransform4f::Identity() };
+   CTransform4f mWorldToMaterial{ CTransform4f::Identity() };
+   SSurfaceInfo mSurfaceInfo;
 };
 
-//-----------------------------------------------------------------------------
+using TRenderObjects = std::vector< CRenderObject* >;
 
-class SAttenuationInfo
+//-------------------------------------------------------------------------
+
+// A value of the scene that changes over time. The scene calls the animations
+// with the time of every frame, and each one writes its value into the object
+// that it is bound to, see CRenderScene::Animate.
+using TAnimation = std::function< void( real32 const time ) >;
+using TAnimations = std::vector< TAnimation >;
+
+template<class TFunction>
+class TAnimatedValue
 {
 public:
-   // attenuation
-   real32 constant{ 0.f };
-   real32 linear{ 0.f };
-   real32 exponential{ 1.f };
+   explicit TAnimatedValue( TFunction const& function )
+      : mFunction( function )
+   {
+   }
+
+   TFunction const& GetFunction() const
+   {
+      return mFunction;
+   }
+
+private:
+   TFunction mFunction;
 };
 
-class CShadowCastingLightObject : public CLightObject
+//-------------------------------------------------------------------------
+
+// this is a wrapper around objects to make them easier to 
+// manipulate during creation
+
+class CObjectContainer
 {
 public:
 
-   virtual bool CastsShadow() const override
+   explicit CObjectContainer( CRenderObject* pRenderObject )
+      : mpRenderObject( pRenderObject )
    {
-      return true;
    }
 
-   real32 GetPenumbra() const
+   explicit CObjectContainer( CRenderObject::TPtr const& pRenderObject )
+      : mpRenderObject( pRenderObject )
    {
-      return mPenumbra;
    }
 
-   void SetAttenuationInfo(SAttenuationInfo const& attenuation)
+   CObjectContainer& operator<<( CTransform4f const& transform )
    {
-      mAttenuation = attenuation;
+      mpRenderObject->SetTransform( transform );
+      return *this;
    }
 
-   SAttenuationInfo const& GetAttenuationInfo() const
+   CObjectContainer& operator<<( CColor4f const& color )
    {
-      return mAttenuation;
+      mpRenderObject->SetMaterial( MakeSceneObject< CColorMaterialObject >( color ) );
+      return *this;
    }
-   void SetTransform(CTransform4f const& transform)
+
+   CObjectContainer& operator<<( CMaterialContainer const& material )
    {
-      mTransform = transform;
+      mpRenderObject->SetMaterial( material.GetMaterial() );
+      return *this;
    }
 
-   CTransform4f const& GetTransform() const
+   CObjectContainer& operator<<( SSurfaceInfo const& surfaceInfo )
    {
-      return mTransform;
+      mpRenderObject->SetSurfaceInfo( surfaceInfo );
+      return *this;
    }
 
-private:
-   CTransform4f mTransform{ CTransform4f::Identity() };
-   real32 mPenumbra{ 24 };
-   SAttenuationInfo mAttenuation;
-};
-
+   // a function that returns a transform animates the transform of the object,
+   // one that returns a number animates its blend factor
+   template<class TFunction>
+   CObjectContainer& operator<<( TAnimatedValue<TFunction> const& value )
+   {
+      CRenderObject* const pRenderObject = mpRenderObject.get();
+      TFunction const function = value.GetFunction();
+      if constexpr (std::is_same_v< decltype(function( 0.f )), CTransform4f >)
+      {
+         mAnimations.push_back( [pRenderObject, function]( real32 const time ) { pRenderObject->SetTransform( function( time ) ); } );
+      }
+      else
+      {
+         mAnimations.push_back( [pRenderObject, function]( real32 const time ) { pRenderObject->SetBlendFactor( function( time ) ); } );
+      }
+      return *this;
+   }
 
-class CPointLightObject : public CShadowCastingLightObject
-{
-public:
-   explicit CPointLightObject( CVector3f const& position, CColor4f const& color )
-      : mPosition( position )
-      , mColor( color )
+   // the animations of the object and of all of its children
+   TAnimations const& GetAnimations() const
    {
+      return mAnimations;
    }
 
-   virtual CColor4f CalculateValueAtPosition( CVector3f const& position, CVector3f const & surfaceNormal ) const override
+   void AddAnimations( TAnimations const& animations )
    {
-      CVector3f const direction = ((GetTransform()*mPosition) - position).AsNormalized();
-      real32 const angle = CVector3f::Dot( surfaceNormal, direction );
-      if (angle < 0.f)
-      {
-         return CColor4f::Black();
-      }
-      return  mColor * angle;
+      mAnimations.insert( mAnimations.end(), animations.begin(), animations.end() );
    }
 
-   virtual CVector3f const& GetPosition() const override
+   CRenderObject::TConstPtr GetRenderObject() const
    {
-      return mPosition;
+      return mpRenderObject;
    }
 
-   CColor4f const& GetColor() const
+   CRenderObject::TPtr const & RenderObject() const
    {
-      return mColor;
+      return mpRenderObject;
    }
 
 private:
-   CVector3f mPosition;
-   CColor4f mColor;
+   std::shared_ptr< CRenderObject > mpRenderObject;
+   TAnimations mAnimations;
 };
 
-class CSpotLightObject : public CShadowCastingLightObject
+using TObjectContainers = std::vector< CObjectContainer >;
+
+//-----------------------------------------------------------------------------------
+
+// Lots of distance functions
+// https://iquilezles.org/www/articles/distfunctions/distfunctions.htm
+
+class CRenderSphere : public CRenderObject
 {
 public:
-   explicit CSpotLightObject(CVector3f const& position, CVector3f const & direction, real32 const angle, CColor4f const& color)
-      : mPosition(position)
-      , mDirection( direction.AsNormalized() )
-      , mCosAngle( ::cosf( CRelAngle::FromDegrees(angle).AsRadians() ))
-      , mColor(color)
+   explicit CRenderSphere( CVector3f const& center, real32 const radius )
+      : mCenter( center )
+      , mRadius( radius )
+   {
+   }
+   explicit CRenderSphere( real32 const radius )
+      : mCenter( CVector3f::Zero() )
+      , mRadius( radius )
    {
    }
 
-   virtual CColor4f CalculateValueAtPosition(CVector3f const& position, CVector3f const& surfaceNormal) const override
+   static real32 const SphereDistance( CVector3f const& point, CVector3f const& center, real32 const radius )
    {
-      CVector3f const direction = (GetTransform() * mPosition - position).AsNormalized();
-      real32 const angleToLight = CVector3f::Dot(surfaceNormal, direction);
-      CVector3f const spotDirection = GetTransform().GetInverse().TransposeRotate(-mDirection);
-      real32 const angleInSpot = CVector3f::Dot(direction, spotDirection);
+      return (point - center).Magnitude() - radius;
+   }
 
-      if (angleToLight < 0.f || angleInSpot < mCosAngle)
-      {
-         return CColor4f::Black();
-      }
-      return  mColor * angleToLight;
+   virtual real32 GetDistanceToPoint( CVector3f const& point ) const override
+   {
+      return SphereDistance( point, mCenter, mRadius );
    }
 
-   virtual CVector3f const& GetPosition() const override
+   virtual void Compile( CSdfProgram& program, CTransform4f const& worldToLocal ) const override
    {
-      return mPosition;
+      program.AddPrimitive( ESdfOp::Sphere, worldToLocal, mCenter.GetX(), mCenter.GetY(), mCenter.GetZ(), mRadius );
    }
 
-   CColor4f const& GetColor() const
+   virtual bool WriteCompiled( CCompiledSceneWriter& writer ) const override
    {
-      return mColor;
+      return WriteCompiledRecord( writer, ECompiledType::Sphere, mCenter.GetX(), mCenter.GetY(), mCenter.GetZ(), mRadius );
+   }
+
+   virtual real32 GetDistanceAndGradient( CVector3f const& point, real32 const /*epsilon*/, CVector3f& gradient ) const override
+   {
+      CVector3f const offset = point - mCenter;
+      real32 const length = offset.Magnitude();
+      gradient = length > 0.f ? offset / length : CVector3f::Up();
+      return length - mRadius;
+   }
+
+   virtual SBoundingSphere const GetLocalBounds() const override
+   {
+      return SBoundingSphere( mCenter, NMath::AbsF( mRadius ) );
    }
 
 private:
-   CVector3f mPosition;
-   CVector3f mDirection;
-   real32 mCosAngle;
-   CColor4f mColor;
+   CVector3f mCenter;
+   real32 mRadius;
 };
 
-class CDirectionalLightObject : public CLightObject
+//-----------------------------------------------------------------------------
+
+class CRenderPlane : public CRenderObject
 {
 public:
-   explicit CDirectionalLightObject( CVector3f const& direction, CColor4f const& color )
-      : mDirection( direction.AsNormalized() )
-      , mColor( color )
+   explicit CRenderPlane( CVector3f const& normal, real32 const height )
+      : mNormal( normal )
+      , mHeight( height )
    {
    }
 
-   virtual CColor4f CalculateValueAtPosition( CVector3f const& /*position*/, CVector3f const& surfaceNormal ) const override
+   explicit CRenderPlane( CVector3f const& normal )
+      : mNormal( normal )
+      , mHeight( 0 )
    {
-      real32 const angle = CVector3f::Dot( surfaceNormal, -mDirection );
-      if (angle < 0.f)
-      {
-         return CColor4f::Black();
-      }
-      return  mColor * angle;
    }
 
-   virtual CVector3f const& GetPosition() const override
+   static real32 const PlaneDistance( CVector3f const& point, CVector3f const& normal, real32 const height )
    {
-      static CVector3f const skZero( CVector3f::Zero() );
-      return skZero;
+      return CVector3f::Dot( normal, point ) - height;
    }
 
-   CColor4f const& GetColor() const
+   virtual real32 GetDistanceToPoint( CVector3f const & point ) const override
    {
-      return mColor;
+      return PlaneDistance( point, mNormal, mHeight );
    }
 
-private:
-   CVector3f mDirection;
-   CColor4f mColor;
-};
+   virtual void Compile( CSdfProgram& program, CTransform4f const& worldToLocal ) const override
+   {
+      program.AddPrimitive( ESdfOp::Plane, worldToLocal, mNormal.GetX(), mNormal.GetY(), mNormal.GetZ(), mHeight );
+   }
 
-//===================================================================================
+   virtual bool WriteCompiled( CCompiledSceneWriter& writer ) const override
+   {
+      return WriteCompiledRecord( writer, ECompiledType::Plane, mNormal.GetX(), mNormal.GetY(), mNormal.GetZ(), mHeight );
+   }
+
+   virtual real32 GetDistanceAndGradient( CVector3f const& point, real32 const /*epsilon*/, CVector3f& gradient ) const override
+   {
+      gradient = mNormal;
+      return PlaneDistance( point, mNormal, mHeight );
+   }
 
-class CInfiniteRay
-{
-public:
-   explicit CInfiniteRay( CVector3f const& position, CVector3f const& direction ) : mPosition( position ), mDirection( direction ) { }
-   CVector3f const& GetPosition() const { return mPosition; }
-   CVector3f const& GetDirection() const { return mDirection; }
-   CVector3f const GetPositionAlongRay( real32 const time ) const { return mPosition + mDirection * time; }
 private:
-   CVector3f mPosition;
-   CVector3f mDirection;
+   CVector3f mNormal;
+   real32 mHeight;
 };
 
-//-------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
 
-class CRayResult
+class CRenderCube : public CRenderObject
 {
 public:
-   explicit CRayResult( CVector3f const& collisionPoint, real32 const time, bool const hit )
-      : mCollisionPoint( collisionPoint )
-      , mTime( time )
-      , mHit( hit )
+   explicit CRenderCube( CVector3f const& size )
+      : mSize( size * 0.5f )
    {
    }
 
-   static CRayResult NoResults() { return CRayResult( CVector3f::Zero(), skLargeNumber, false ); }
-
-   CVector3f mCollisionPoint;
-   real32 mTime;
-   bool mHit;
-};
-
-//-------------------------------------------------------------------------
-
-class CCamera
-{
-public:
-   explicit CCamera( CVector3f const& cameraCenter, CVector3f const& cameraLookAt, real32 const cameraFOV = 45.f, bool const verticalFOV = false )
-   : mCameraTransform( CTransform4f::Identity())
-   , mSceneWidth(skDefaultWidth)
-   , mSceneHeight(skDefaultHeight)
-   , mCameraScale(1.f)
-   , mCameraFOV(cameraFOV)
-   , mVerticalFOV(verticalFOV)
+   explicit CRenderCube( real32 const x, real32 const y, real32 const z )
+      : mSize( x * 0.5f, y * 0.5f, z * 0.5f )
    {
-      CalculateParameters(cameraCenter, cameraLookAt, cameraFOV, verticalFOV);
    }
 
-   static CCamera DefaultCamera() { return CCamera( CVector3f::Zero(), CVector3f( 0.f, 0.f, 1.f ), 45.f ); }
-
-   CInfiniteRay const GetRayForPosition( uint32_t const x, uint32_t const y ) const
+   explicit CRenderCube( real32 const size )
+      : mSize( size * 0.5f, size * 0.5f, size * 0.5f  )
    {
-      real32 const hFactor = (x - (mSceneWidth * 0.5f)) * mCameraScale;
-      real32 const vFactor = -(y - (mSceneHeight * 0.5f)) * mCameraScale;
-
-      CVector3f const direction = mCameraTransform.GetZBasis() + mCameraTransform.GetXBasis() * hFactor + mCameraTransform.GetYBasis() * vFactor;
-
-      return CInfiniteRay( mCameraTransform.GetTranslation(), direction.AsNormalized() );
    }
 
-   real32 const GetCameraScale() const { return mCameraScale; }
-   CTransform4f const& GetCameraTransform() const { return mCameraTransform; }
-   void SetCameraTransform( CTransform4f const& transform ) { mCameraTransform = transform; }
-
-   void SetSceneSize( uint32_t const sceneWidth, uint32_t const sceneHeight )
+   static real32 const CubeDistance( CVector3f const& point, CVector3f const& halfSize )
    {
-      mSceneWidth = sceneWidth;
-      mSceneHeight = sceneHeight;
+      real32 const x = NMath::AbsF( point.GetX() ) - halfSize.GetX();
+      real32 const y = NMath::AbsF( point.GetY() ) - halfSize.GetY();
+      real32 const z = NMath::AbsF( point.GetZ() ) - halfSize.GetZ();
+      // distance outside
+      real32 const d = CVector3f( NMath::max_val( x, 0.f ), NMath::max_val( y, 0.f ), NMath::max_val( z, 0.f ) ).Magnitude();
+      // distance inside
+      real32 const du = NMath::max_val( NMath::max_val( NMath::min_val( x, 0.f ), NMath::min_val( y, 0.f ) ), NMath::min_val( z, 0.f ) );
+      return  d + du;
+   }
 
-      CalculateParameters( mCameraTransform.GetTranslation(), mCameraTransform.GetTranslation() + mCameraTransform.GetBackward(), mCameraFOV, mVerticalFOV );
+   virtual real32 GetDistanceToPoint( CVector3f const& point ) const override
+   {
+      return CubeDistance( point, mSize );
    }
 
-private:
+   virtual void Compile( CSdfProgram& program, CTransform4f const& worldToLocal ) const override
+   {
+      program.AddPrimitive( ESdfOp::Cube, worldToLocal, mSize.GetX(), mSize.GetY(), mSize.GetZ(), 0.f );
+   }
 
-   void CalculateParameters( CVector3f const& cameraCenter, CVector3f const& cameraLookAt, real32 const cameraFOV, bool const verticalFOV )
+   // the record has the whole size, the same as the constructor
+   virtual bool WriteCompiled( CCompiledSceneWriter& writer ) const override
    {
-      CVector3f const worldUp = CVector3f::Up();
+      return WriteCompiledRecord( writer, ECompiledType::Cube, mSize.GetX() * 2.f, mSize.GetY() * 2.f, mSize.GetZ() * 2.f, 0.f );
+   }
 
-      real32 const fovScale( tanf( cameraFOV * ((NMath::gkPi32 / 180.f) / 2.f) ) * 2.f );
+   virtual real32 GetDistanceAndGradient( CVector3f const& point, real32 const /*epsilon*/, CVector3f& gradient ) const override
+   {
+      real32 const x = NMath::AbsF( point.GetX() ) - mSize.GetX();
+      real32 const y = NMath::AbsF( point.GetY() ) - mSize.GetY();
+      real32 const z = NMath::AbsF( point.GetZ() ) - mSize.GetZ();
+      CVector3f const sign( NMath::Sign( point.GetX() ), NMath::Sign( point.GetY() ), NMath::Sign( point.GetZ() ) );
 
-      if (verticalFOV)
+      CVector3f const outside( NMath::max_val( x, 0.f ), NMath::max_val( y, 0.f ), NMath::max_val( z, 0.f ) );
+      real32 const outsideLength = outside.Magnitude();
+      if (outsideLength > 0.f)
       {
-         mCameraScale = fovScale / mSceneHeight;
+         // points outside move away from the closest point on the surface
+         gradient = sign * outside / outsideLength;
       }
       else
       {
-         mCameraScale = fovScale / mSceneWidth;
+         // points inside move towards the closest face
+         gradient = x > y ? (x > z ? CVector3f( 1.f, 0.f, 0.f ) : CVector3f( 0.f, 0.f, 1.f )) :
+                            (y > z ? CVector3f( 0.f, 1.f, 0.f ) : CVector3f( 0.f, 0.f, 1.f ));
+         gradient = sign * gradient;
       }
+      return CubeDistance( point, mSize );
+   }
 
-      CVector3f const cameraForward = (cameraLookAt - cameraCenter).AsNormalized();
-      CVector3f const cameraRight = cameraForward.CrossProductWith( worldUp ).AsNormalized();
-      CVector3f const cameraUp = cameraRight.CrossProductWith( cameraForward );
-
-      mCameraTransform = CTransform4f::FromVectors( cameraRight, cameraUp, cameraForward, cameraCenter );
+   virtual SBoundingSphere const GetLocalBounds() const override
+   {
+      return SBoundingSphere( mSize.Magnitude() );
    }
 
-   CTransform4f mCameraTransform;
-   uint32_t mSceneWidth;
-   uint32_t mSceneHeight;
-   real32 mCameraScale;
-   real32 mCameraFOV;
-   bool mVerticalFOV;
+private:
+   CVector3f mSize;
 };
 
-//-------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
 
-class CLightObjectContainer
+// Keeps the type of the function so a lambda is inlined into the distance
+// functions instead of being called through a std::function
+template<class TFunction>
+class TRenderCustom : public CRenderObject
 {
 public:
+   explicit TRenderCustom( TFunction const& customFunction )
+      : mCustomFunction( customFunction )
+      , mBounds( SBoundingSphere::Infinite() )
+   {
+   }
 
-   explicit CLightObjectContainer( CLightObject* pLightObject )
-      : mpLightObject( pLightObject )
+   // the bounds have to contain the whole surface of the custom function
+   explicit TRenderCustom( TFunction const& customFunction, SBoundingSphere const& bounds )
+      : mCustomFunction( customFunction )
+      , mBounds( bounds )
    {
    }
 
-   CLightObject::TConstPtr GetLightObject() const
+   virtual real32 GetDistanceToPoint( CVector3f const& point ) const override
    {
-      return mpLightObject;
+      return mCustomFunction( point );
    }
 
-   CLightObject::TPtr const & LightObject() const
+   virtual real32 GetDistanceAndGradient( CVector3f const& point, real32 const epsilon, CVector3f& gradient ) const override
    {
-      return mpLightObject;
+      return EstimateDistanceAndGradient( mCustomFunction, point, epsilon, gradient );
+   }
+
+   virtual void GetDistancesToPoints( real32 const* const pX, real32 const* const pY, real32 const* const pZ,
+      uint32_t const count, uint32_t const laneMask, real32* const pDistances ) const override
+   {
+      for (uint32_t lane = 0; lane < count; ++lane)
+      {
+         pDistances[lane] = (laneMask & (1u << lane)) ? mCustomFunction( CVector3f( pX[lane], pY[lane], pZ[lane] ) ) : skLargeNumber;
+      }
+   }
+
+   virtual SBoundingSphere const GetLocalBounds() const override
+   {
+      return mBounds;
    }
 
 private:
-   CLightObject::TPtr mpLightObject;
+   TFunction mCustomFunction;
+   SBoundingSphere mBounds;
 };
 
-//-------------------------------------------------------------------------
+using CRenderCustom = TRenderCustom< std::function<real32( CVector3f )> >;
 
-class CRenderScene
+//-----------------------------------------------------------------------------
+
+class CCompositeRenderObject : public CRenderObject
 {
 public:
-   explicit CRenderScene( TRenderObjects const& renderObjects )
-      : mCamera( CCamera::DefaultCamera() )
+   explicit CCompositeRenderObject(TObjectContainers const& objects)
    {
-      mObjects.reserve( renderObjects.size() );
-      for (CRenderObject const* const object : renderObjects)
+      mObjectList.reserve(objects.size());
+      for (CObjectContainer const & object : objects)
       {
-mObjects.push_back( CRenderObject::TConstPtr( object ) );
+         mObjectList.push_back(CRenderObject::TPtr(object.RenderObject()));
       }
    }
 
-   explicit CRenderScene()
-      : mCamera( CCamera::DefaultCamera() )
+   virtual void FoldTransforms( CTransform4f const& worldToParent ) override
    {
+      CRenderObject::FoldTransforms( worldToParent );
+      for (CRenderObject::TPtr const& object : mObjectList)
+      {
+         object->FoldTransforms( GetWorldToLocal() );
+      }
    }
 
-   CRenderScene& operator+=( CObjectContainer const& containerObject )
+   virtual CColor4f const GetWorldColorAtPoint( CVector3f const& point ) const override
    {
-      mObjects.push_back( CRenderObject::TConstPtr( containerObject.GetRenderObject() ) );
-      return *this;
+#if 0
+      CRenderObject::TConstPtr closestObject;
+      real32 minPoint = skLargeNumber;
+
+      for (CRenderObject::TConstPtr const & object : mObjectList)
+      {
+         real32 const objectDistance = NMath::AbsF( object->GetWorldDistanceToPoint( point ) );
+         if ( objectDistance < minPoint)
+         {
+            minPoint = objectDistance;
+            closestObject = object;
+         }
+      }
+      if (closestObject.get() != nullptr)
+      {
+         return closestObject->GetWorldColorAtPoint( point );
+      }
+      return CColor4f::White();
+#else
+
+      CColor4f color = CColor4f::Black();
+
+      real32 weight = 0.f;
+
+      for (CRenderObject::TConstPtr const& object : mObjectList)
+      {
+         real32 const objectDistance = NMath::AbsF( object->GetWorldDistanceToPoint( point ) );
+
+         CColor4f const objectColor = object->GetWorldColorAtPoint( point );
+         if (NMath::small_enough( objectDistance ))
+         {
+            return objectColor;
+         }
+         real32 const objectWeight = 1.f / powf( objectDistance , 0.9f );
+         weight += objectWeight;
+         color = color + objectColor * objectWeight;
+      }
+
+      return color * (1.f / weight);
+
+#endif
    }
 
-   CRenderScene& operator+=( CLightObjectContainer const& containerObject )
+   virtual void SetMaterial( CMaterialObject::TConstPtr const& material )
    {
-      mLights.push_back( CLightObject::TConstPtr( containerObject.GetLightObject() ) );
-      return *this;
+      for (CRenderObject::TPtr & object : mObjectList)
+      {
+         object->SetMaterial( material );
+      }
    }
 
-   void AddObject( CRenderObject* pRenderObject )
+protected:
+   // adds the children followed by the operation that combines them
+   void CompileChildren( CSdfProgram& program, CTransform4f const& worldToLocal, ESdfOp const op, real32 const param = 0.f ) const
    {
-      mObjects.push_back( CRenderObject::TConstPtr( pRenderObject ) );
+      for (CRenderObject::TPtr const& object : mObjectList)
+      {
+         object->CompileTransformed( program, worldToLocal );
+      }
+      program.AddOperation( op, static_cast<uint32_t>(mObjectList.size()), param );
    }
 
-   CRenderScene& operator<<( CCamera const& camera )
+   // adds the record of the operation followed by the records of the children
+   bool WriteCompiledChildren( CCompiledSceneWriter& writer, ECompiledType const type, real32 const param = 0.f ) const
    {
-      mCamera = camera;
-      return *this;
+      if (!WriteCompiledRecord( writer, type, param, 0.f, 0.f, 0.f, static_cast<uint32_t>(mObjectList.size()) ))
+      {
+         return false;
+      }
+
+      for (CRenderObject::TPtr const& object : mObjectList)
+      {
+         if (!object->WriteCompiled( writer ))
+         {
+            return false;
+         }
+      }
+      return true;
    }
 
-   CRenderScene& operator<<( CTransform4f const& cameraTransform )
+   // the bounds around all of the children
+   SBoundingSphere const GetChildrenBounds() const
    {
-      mCamera.SetCameraTransform( cameraTransform );
-      return *this;
+      if (mObjectList.empty())
+      {
+         return SBoundingSphere::Infinite();
+      }
+
+      SBoundingSphere bounds = mObjectList.front()->GetTransformedBounds();
+      for (CRenderObject::TPtr const& object : mObjectList)
+      {
+         bounds = SBoundingSphere::Enclose( bounds, object->GetTransformedBounds() );
+      }
+      return bounds;
    }
 
-   CRenderScene& operator*( CTransform4f const& cameraTransform )
+   // the list is kept in the arena with the objects
+   std::vector< CRenderObject::TPtr, TArenaAllocator< CRenderObject::TPtr > > mObjectList{ TArenaAllocator< CRenderObject::TPtr >( tlpSceneArena ) };
+
+};
+
+//-----------------------------------------------------------------------------
+
+class CRenderUnion : public CCompositeRenderObject
+{
+public:
+   explicit CRenderUnion( TObjectContainers const& objects )
+      : CCompositeRenderObject(objects)
    {
-      mCamera.SetCameraTransform( cameraTransform * mCamera.GetCameraTransform() );
-      return *this;
    }
 
-   void SetCamera( CCamera const& camera )
+   virtual real32 GetDistanceToPoint( CVector3f const& point ) const override
    {
-      mCamera = camera;
-   }
+      real32 minValue = skLargeNumber;
+
+      for (CRenderObject::TPtr const& object : mObjectList)
+      {
+         minValue = NMath::min_val( minValue, object->GetTransformedDistanceToPoint( point ) );
+      }
 
+      return minValue;
+   }
 
-   void SetSceneSize( uint32_t const width, uint32_t const height )
+   virtual void Compile( CSdfProgram& program, CTransform4f const& worldToLocal ) const override
    {
-      mCamera.SetSceneSize( width, height );
+      CompileChildren( program, worldToLocal, ESdfOp::Union );
    }
 
-   CColor4f DoIntersection( uint32_t const x, uint32_t const y ) const
+   virtual bool WriteCompiled( CCompiledSceneWriter& writer ) const override
    {
-      CInfiniteRay const infiniteRay = mCamera.GetRayForPosition( x, y );
-      return DoIntersection( infiniteRay, 4 );
+      return WriteCompiledChildren( writer, ECompiledType::Union );
    }
 
-   //----------------------------------------------------------------------------
-
-   CColor4f DoIntersection( CInfiniteRay const& infiniteRay, int32_t const depth = 1 ) const
+   virtual real32 GetDistanceAndGradient( CVector3f const& point, real32 const epsilon, CVector3f& gradient ) const override
    {
-      if (depth == 0)
-      {
-         return CColor4f::Black();
-      }
-
-      CRayResult result = MarchRay( infiniteRay, skMaxLength );
+      real32 minValue = skLargeNumber;
+      gradient = CVector3f::Zero();
 
-      if (result.mHit)
-      {
-         CRenderObject const* const pRenderObject = GetClosestObject( result.mCollisionPoint );
-         if (pRenderObject != nullptr)
-         {
-            return CalculateSurfaceColor( pRenderObject, infiniteRay.GetDirection(), result.mCollisionPoint, depth );
-         }
-      }
-#if DRAW_OBJECT_OUTLINE()
-      else
+      for (CRenderObject::TPtr const& object : mObjectList)
       {
-         if (result.mTime < 0.05f)
+         CVector3f objectGradient = CVector3f::Zero();
+         real32 const distance = object->GetTransformedDistanceAndGradient( point, epsilon, objectGradient );
+         if (distance < minValue)
          {
-            return CColor4f::Lerp( CColor4f::White(), skBackgroundColor, result.mTime * 20.f);
+            minValue = distance;
+            gradient = objectGradient;
          }
       }
-#endif
 
-      return skBackgroundColor;
+      return minValue;
    }
 
-   //----------------------------------------------------------------------------
-
-   CColor4f CalculateSurfaceColor( CRenderObject const* const pRenderObject, CVector3f const & viewDirection, CVector3f const& collisionPoint, int32_t const depth ) const
+   virtual SBoundingSphere const GetLocalBounds() const override
    {
-      CColor4f color = CColor4f::Black();
-
-      CVector3f const normal = GetNormalAtPoint( collisionPoint );
+      return GetChildrenBounds();
+   }
+};
 
+//-----------------------------------------------------------------------------
 
-      CColor4f const surfaceColor = pRenderObject->GetColorAtPoint( collisionPoint );
+class CRenderIntersection : public CCompositeRenderObject
+{
+public:
+   explicit CRenderIntersection( TObjectContainers const& objects )
+      : CCompositeRenderObject(objects)
+   {
+   }
 
-      // get the start of the ray off of the surface just a little bit
-      CVector3f const startPoint = collisionPoint + normal * skSecondaryRayOffset;
+   virtual real32 GetDistanceToPoint( CVector3f const& point ) const override
+   {
+      real32 maxValue = 0.f;
 
-      SSurfaceInfo const surfaceInfo = pRenderObject->GetSurfaceInfo();
-
-      if (!NMath::small_enough( surfaceInfo.dielectric ) || !NMath::small_enough( surfaceInfo.metallic ))
+      for (CRenderObject::TPtr const& object : mObjectList)
       {
-         CVector3f const reflection = viewDirection - normal * 2.f * CVector3f::Dot( viewDirection, normal );
-         CColor4f const reflectedColor = DoIntersection( CInfiniteRay( startPoint, reflection ), depth - 1 );
-
-         color += reflectedColor * surfaceColor * surfaceInfo.metallic;
-         color += reflectedColor * surfaceInfo.dielectric;
+         maxValue = NMath::max_val( maxValue, object->GetTransformedDistanceToPoint( point ) );
       }
 
-      // for each light do a light check
-      for (CLightObject::TConstPtr const& pLight : mLights)
-      {
-         CVector3f toLight = pLight->GetPosition() - collisionPoint;
-         real32 const distance = toLight.Magnitude();
-         toLight = toLight / distance;
+      return maxValue;
+   }
 
-         if (pLight->CastsShadow())
-         {
-            CShadowCastingLightObject const& shadowLight = static_cast<CShadowCastingLightObject const&>(*pLight);
-            
-            real32 const shadow = MarchShadowRay( CInfiniteRay( startPoint, toLight ), distance, shadowLight.GetPenumbra() );
+   virtual void Compile( CSdfProgram& program, CTransform4f const& worldToLocal ) const override
+   {
+      CompileChildren( program, worldToLocal, ESdfOp::Intersection );
+   }
 
-            if (shadow > 0.f)
-            {
-               SAttenuationInfo const attenuationInfo = shadowLight.GetAttenuationInfo();
-               real32 const attenuationFactor = 1.f / (
-                  attenuationInfo.constant +
-                  attenuationInfo.linear * distance +
-                  attenuationInfo.exponential * distance * distance
-                  );
-                                                
-                   
-               color += pLight->CalculateValueAtPosition( collisionPoint, normal ) * surfaceColor 
-                  * (shadow * surfaceInfo.albedo * attenuationFactor);
-            }
-         }
-         else
+   virtual bool WriteCompiled( CCompiledSceneWriter& writer ) const override
+   {
+      return WriteCompiledChildren( writer, ECompiledType::Intersection );
+   }
+
+   virtual real32 GetDistanceAndGradient( CVector3f const& point, real32 const epsilon, CVector3f& gradient ) const override
+   {
+      // the gradient comes from the largest child, even when the distance is clamped to zero
+      real32 maxValue = -skLargeNumber;
+      gradient = CVector3f::Zero();
+
+      for (CRenderObject::TPtr const& object : mObjectList)
+      {
+         CVector3f objectGradient = CVector3f::Zero();
+         real32 const distance = object->GetTransformedDistanceAndGradient( point, epsilon, objectGradient );
+         if (distance > maxValue)
          {
-            color += pLight->CalculateValueAtPosition( collisionPoint, normal ) * 
-               ( surfaceColor * surfaceInfo.albedo );
+            maxValue = distance;
+            gradient = objectGradient;
          }
       }
-      return color;
-   }
 
-   //----------------------------------------------------------------------------
-   // This is the marching ray code
+      return NMath::max_val( maxValue, 0.f );
+   }
 
-   CRayResult MarchRay( CInfiniteRay const& ray, real32 const maxLength ) const
+   virtual SBoundingSphere const GetLocalBounds() const override
    {
-      real32 time = skMinLength;
-
-      int32_t count = 0;
-      real32 minDistance = skLargeNumber;
-
-      while (time < maxLength  )
+      // the surface is inside of every child, so use the smallest one
+      SBoundingSphere bounds = SBoundingSphere::Infinite();
+      for (CRenderObject::TPtr const& object : mObjectList)
       {
-         CVector3f const currentPoint = ray.GetPositionAlongRay( time );
-         real32 const distanceToNearestObject = GetMinDistanceAtPoint( currentPoint );
-         minDistance = NMath::min_val( minDistance, distanceToNearestObject );
-
-         if ( fabsf(distanceToNearestObject) < skMinLength || count++ > 200)
+         SBoundingSphere const objectBounds = object->GetTransformedBounds();
+         if (objectBounds.mRadius < bounds.mRadius)
          {
-            return CRayResult( currentPoint, time, true );
+            bounds = objectBounds;
          }
-
-         time += distanceToNearestObject;
       }
-      return CRayResult(CVector3f::Zero(), minDistance, false );
+      return bounds;
    }
+};
 
-   //----------------------------------------------------------------------------
-   // Calculate the shadow amount
-   // See: https://iquilezles.org/www/articles/rmshadows/rmshadows.htm
+//-----------------------------------------------------------------------------
 
-   real32 MarchShadowRay( CInfiniteRay const& ray, real32 const maxLength, real32 const penumbra ) const
+class CRenderDifference : public CCompositeRenderObject
+{
+public:
+   explicit CRenderDifference( TObjectContainers const& objects )
+      : CCompositeRenderObject(objects)
    {
-#if 1
-      real32 shadow = 1.f;
-      real32 time = 0.f;
+   }
 
-      while (time < maxLength )
+   virtual real32 GetDistanceToPoint( CVector3f const& point ) const override
+   {
+      real32 maxValue = 0.f;
+      int32_t index = 0;
+      for (CRenderObject::TPtr const& object : mObjectList)
       {
-         CVector3f const currentPoint = ray.GetPositionAlongRay( time );
-         real32 const distanceToNearestObject = GetMinDistanceAtPoint( currentPoint );
+         // the first object is normal and all other objects cut from it
+         real32 const distance = (index++ ? -1.f : 1.f) * object->GetTransformedDistanceToPoint( point );
+         maxValue = NMath::max_val( maxValue, distance );
+      }
 
-         if (distanceToNearestObject < skMinLength )
-         {
-            return 0.f;
-         }
+      return maxValue;
+   }
 
-         shadow = NMath::min_val( shadow, penumbra * distanceToNearestObject / time );
+   virtual void Compile( CSdfProgram& program, CTransform4f const& worldToLocal ) const override
+   {
+      CompileChildren( program, worldToLocal, ESdfOp::Difference );
+   }
 
-         time += distanceToNearestObject;
-      }
-      return shadow;
-#else
-      real32 shadow = 1.f;
-      real32 ph = skLargeNumber;
+   virtual bool WriteCompiled( CCompiledSceneWriter& writer ) const override
+   {
+      return WriteCompiledChildren( writer, ECompiledType::Difference );
+   }
 
-      real32 time = skMinLength * 2.f;
+   virtual real32 GetDistanceAndGradient( CVector3f const& point, real32 const epsilon, CVector3f& gradient ) const override
+   {
+      // the gradient comes from the largest value, even when the distance is clamped to zero
+      real32 maxValue = -skLargeNumber;
+      gradient = CVector3f::Zero();
 
-      int32_t count = 0;
-      while (time < maxLength && count++ < 25)
+      int32_t index = 0;
+      for (CRenderObject::TPtr const& object : mObjectList)
       {
-         CVector3f const currentPoint = ray.GetPositionAlongRay( time );
-         real32 const distanceToNearestObject = GetMinDistanceAtPoint( currentPoint );
-
-         if (distanceToNearestObject < 0.f)
+         CVector3f objectGradient = CVector3f::Zero();
+         real32 const sign = index++ ? -1.f : 1.f;
+         real32 const distance = sign * object->GetTransformedDistanceAndGradient( point, epsilon, objectGradient );
+         if (distance > maxValue)
          {
-            return 0.f;
+            maxValue = distance;
+            gradient = objectGradient * sign;
          }
-
-         real32 const y = distanceToNearestObject * distanceToNearestObject / (2.f * ph);
-         real32 const d = sqrtf( distanceToNearestObject * distanceToNearestObject - y * y );
-         shadow = NMath::min_val( shadow, penumbra * d / NMath::max_val( 0.f, time - y ) );
-         ph = distanceToNearestObject;
-         time += distanceToNearestObject;
       }
 
-      return shadow;
-#endif
+      return NMath::max_val( maxValue, 0.f );
    }
 
-   //----------------------------------------------------------------------------
-
-   CVector3f GetNormalAtPoint( CVector3f const& point ) const
+   virtual SBoundingSphere const GetLocalBounds() const override
    {
-#if 1
-      //real32 const skNormalEpsilon = 0.1f * (1.f / skDefaultWidth);
-      real32 const skNormalEpsilon = skSecondaryRayOffset;
-      return
-      // look at the gradient in the local area
-      CVector3f( GetMinDistanceAtPoint( point + CVector3f( skNormalEpsilon, 0.f, 0.f ) ) - GetMinDistanceAtPoint( point - CVector3f( skNormalEpsilon, 0.f, 0.f ) ),
-                 GetMinDistanceAtPoint( point + CVector3f( 0.f, skNormalEpsilon, 0.f ) ) - GetMinDistanceAtPoint( point - CVector3f( 0.f, skNormalEpsilon, 0.f ) ),
-                 GetMinDistanceAtPoint( point + CVector3f( 0.f, 0.f, skNormalEpsilon ) ) - GetMinDistanceAtPoint( point - CVector3f( 0.f, 0.f, skNormalEpsilon ) ) ).AsNormalized();
-#else
-
-      real32 const skNormalEpsilon = 0.5773f * (1.f / skDefaultWidth);
-
-      CVector3f const e0( 1.f, -1.f, -1.f );
-      CVector3f const e1( -1.f, -1.f, 1.f );
-      CVector3f const e2( -1.f, 1.f, -1.f );
-      CVector3f const e3( 1.f, 1.f, 1.f );
+      // the other objects only cut away from the first one
+      return mObjectList.empty() ? SBoundingSphere::Infinite() : mObjectList.front()->GetTransformedBounds();
+   }
+};
 
-      return     
-         (e0 * GetMinDistanceAtPoint( point + e0 * skNormalEpsilon )  +
-        e1 * GetMinDistanceAtPoint( point + e1 * skNormalEpsilon ) +
-        e2 * GetMinDistanceAtPoint( point + e2 * skNormalEpsilon ) +
-        e3 * GetMinDistanceAtPoint( point + e3 * skNormalEpsilon)).AsNormalized();
+//-----------------------------------------------------------------------------
 
-#endif
+class CRenderSmoothUnion : public CCompositeRenderObject
+{
+public:
+   explicit CRenderSmoothUnion( TObjectContainers const& objects, real32 const k )
+      : CCompositeRenderObject(objects)
+      , mK(k)
+   {
    }
 
-   //----------------------------------------------------------------------------
+   static real32 const SmoothUnion( real32 const d1, real32 const d2, real32 const k )
+   {
+      float const h = NMath::max_val( k - NMath::AbsF( d1 - d2 ), 0.f ) / k;
+      return NMath::min_val( d1, d2 ) - h * h * h * k * (1.f / 6.f);
+   }
 
-   real32 GetMinDistanceAtPoint( CVector3f const& point ) const
+   virtual real32 GetDistanceToPoint( CVector3f const& point ) const override
    {
-      real32 time = skLargeNumber;
+      real32 minValue = skLargeNumber;
 
-      for (CRenderObject::TConstPtr const & pObject : mObjects)
+      int32_t index = 0;
+
+      for (CRenderObject::TPtr const& object : mObjectList)
       {
-         time = NMath::min_val( time, pObject->GetTransformedDistanceToPoint( point ) );
+         if (index++ == 0)
+         {
+            minValue = object->GetTransformedDistanceToPoint( point );
+         }
+         else
+         {
+            minValue = SmoothUnion( minValue, object->GetTransformedDistanceToPoint( point ), mK );
+         }
       }
 
-      return time;
+      return minValue;
    }
 
-   //----------------------------------------------------------------------------
+   virtual void Compile( CSdfProgram& program, CTransform4f const& worldToLocal ) const override
+   {
+      CompileChildren( program, worldToLocal, ESdfOp::SmoothUnion, mK );
+   }
 
-   CRenderObject const * GetClosestObject( CVector3f const& point ) const
+   virtual bool WriteCompiled( CCompiledSceneWriter& writer ) const override
    {
-      real32 minTime = skLargeNumber;
-      CRenderObject const* pClosestObject = nullptr;
-      for (CRenderObject::TConstPtr const & pObject : mObjects)
+      return WriteCompiledChildren( writer, ECompiledType::SmoothUnion, mK );
+   }
+
+   virtual real32 GetDistanceAndGradient( CVector3f const& point, real32 const epsilon, CVector3f& gradient ) const override
+   {
+      real32 minValue = skLargeNumber;
+      gradient = CVector3f::Zero();
+
+      int32_t index = 0;
+
+      for (CRenderObject::TPtr const& object : mObjectList)
       {
-         real32 const currentTime = pObject->GetTransformedDistanceToPoint( point );
+         CVector3f objectGradient = CVector3f::Zero();
+         real32 const distance = object->GetTransformedDistanceAndGradient( point, epsilon, objectGradient );
 
-         if (currentTime < minTime)
+         if (index++ == 0)
+         {
+            minValue = distance;
+            gradient = objectGradient;
+         }
+         else
          {
-            minTime = currentTime;
-            pClosestObject = pObject.get();
+            // the derivative of SmoothUnion, the blend shifts towards the other
+            // gradient as the two distances get closer
+            real32 const h = NMath::max_val( mK - NMath::AbsF( minValue - distance ), 0.f ) / mK;
+            real32 const weight = h * h * 0.5f;
+            CVector3f const minGradient = minValue < distance ? gradient : objectGradient;
+            CVector3f const otherGradient = minValue < distance ? objectGradient : gradient;
+
+            gradient = minGradient * (1.f - weight) + otherGradient * weight;
+            minValue = SmoothUnion( minValue, distance, mK );
          }
       }
-      return pClosestObject;
+
+      return minValue;
    }
 
-   void Reset()
+   virtual SBoundingSphere const GetLocalBounds() const override
    {
-      mCamera = CCamera::DefaultCamera();
-      mObjects.clear();
-      mLights.clear();
+      // every SmoothUnion can pull the surface out by up to k / 6
+      real32 const blendDistance = NMath::AbsF( mK ) * (1.f / 6.f) * static_cast<real32>(mObjectList.size());
+      return GetChildrenBounds().Expanded( blendDistance );
    }
 
+   virtual void SetBlendFactor( real32 const blendFactor ) override
+   {
+      mK = blendFactor;
+   }
 private:
-   CCamera mCamera;
-   std::vector< CRenderObject::TConstPtr > mObjects;
-   std::vector< CLightObject::TConstPtr > mLights;
+   real32 mK;
 };
 
-//===================================================================================
-
-namespace NScene
+class CRenderBlend : public CCompositeRenderObject
 {
-   template<class TClassType>
-   class TMaterialContainer : public CMaterialContainer
+public:
+   explicit CRenderBlend( TObjectContainers const& objects, real32 const k )
+      : CCompositeRenderObject(objects)
+      , mK( k )
    {
-   public:
-      template<class... TArgs>
-      explicit TMaterialContainer( TArgs... args )
-         : CMaterialContainer( new TClassType( args... ) )
-      {
-      }
-   };
+   }
 
-   template<class TClassType>
-   class TObjectContainer : public CObjectContainer
+   virtual real32 GetDistanceToPoint( CVector3f const& point ) const override
    {
-   public:
-      template <class... TArgs>
-      explicit TObjectContainer( TArgs... args )
-         : CObjectContainer( new TClassType( args... ) )
-      {
-      }
-      
-      template <class... TArgs>
-      TObjectContainer( std::initializer_list<CObjectContainer> const& objects, TArgs... args )
-         : CObjectContainer( new TClassType( objects, args... ) )
-      {
-      }
-      
-   };
+      uint32_t const lowerPosition = static_cast<uint32_t>(floorf( mK ));
+      uint32_t const upperPosition = lowerPosition + 1;
 
-   template<class TClassType>
-   class TLightObjectContainer : public CLightObjectContainer
+      real32 const d0 = lowerPosition >= 0 && lowerPosition < mObjectList.size() ?
+         mObjectList[lowerPosition]->GetTransformedDistanceToPoint( GetInverseTransform()*point ) : skLargeNumber;
+      real32 const d1 = upperPosition >= 0 && upperPosition < mObjectList.size() ?
+         mObjectList[upperPosition]->GetTransformedDistanceToPoint( GetInverseTransform()*point ) : skLargeNumber;
+      return NMath::lerp(d0,d1, mK - floorf(mK));
+   }
+
+   virtual void Compile( CSdfProgram& program, CTransform4f const& worldToLocal ) const override
    {
-   public:
-      template <class... TArgs>
-      explicit TLightObjectContainer( TArgs... args )
-         : CLightObjectContainer( new TClassType( args... ) )
-      {
-      }
+      // the children get the inverse transform a second time, the same as GetDistanceToPoint
+      CTransform4f const childWorldToLocal = GetInverseTransform() * worldToLocal;
+      uint32_t const lowerPosition = static_cast<uint32_t>(floorf( mK ));
 
-      TLightObjectContainer& operator<<(SAttenuationInfo const& attenuation)
+      for (uint32_t const position : { lowerPosition, lowerPosition + 1 })
       {
-         static_cast<TClassType&>(*LightObject()).SetAttenuationInfo(attenuation);
-         return *this;
+         if (position < mObjectList.size())
+         {
+            mObjectList[position]->CompileTransformed( program, childWorldToLocal );
+         }
+         else
+         {
+            program.AddConstant( skLargeNumber );
+         }
       }
+      program.AddOperation( ESdfOp::Blend, 2, mK - floorf( mK ) );
+   }
 
-      TLightObjectContainer& operator<<(CTransform4f const& transform)
-      {
-         static_cast<TClassType&>(*LightObject()).SetTransform(transform);
-         return *this;
-      }
+   virtual bool WriteCompiled( CCompiledSceneWriter& writer ) const override
+   {
+      return WriteCompiledChildren( writer, ECompiledType::Blend, mK );
+   }
+
+   virtual real32 GetDistanceAndGradient( CVector3f const& point, real32 const epsilon, CVector3f& gradient ) const override
+   {
+      uint32_t const lowerPosition = static_cast<uint32_t>(floorf( mK ));
+      uint32_t const upperPosition = lowerPosition + 1;
+
+      // the children get the inverse transform a second time, the same as GetDistanceToPoint
+      CVector3f const childPoint = GetInverseTransform() * point;
+      CVector3f g0 = CVector3f::Zero();
+      CVector3f g1 = CVector3f::Zero();
+
+      real32 const d0 = lowerPosition < mObjectList.size() ?
+         mObjectList[lowerPosition]->GetTransformedDistanceAndGradient( childPoint, epsilon, g0 ) : skLargeNumber;
+      real32 const d1 = upperPosition < mObjectList.size() ?
+         mObjectList[upperPosition]->GetTransformedDistanceAndGradient( childPoint, epsilon, g1 ) : skLargeNumber;
+
+      real32 const t = mK - floorf( mK );
+      gradient = GetInverseTransform().TransposeRotate( g0 * (1.f - t) + g1 * t );
+      return NMath::lerp( d0, d1, t );
+   }
+
+   virtual SBoundingSphere const GetLocalBounds() const override
+   {
+      // the blended distance is never less than the smaller of the two, and the
+      // children get the inverse transform a second time
+      uint32_t const lowerPosition = static_cast<uint32_t>(floorf( mK ));
+
+      SBoundingSphere bounds = SBoundingSphere::Infinite();
+      bool first = true;
+      for (uint32_t const position : { lowerPosition, lowerPosition + 1 })
+      {
+         if (position < mObjectList.size())
+         {
+            SBoundingSphere const objectBounds = mObjectList[position]->GetTransformedBounds().Transformed( GetTransform() );
+            bounds = first ? objectBounds : SBoundingSphere::Enclose( bounds, objectBounds );
+            first = false;
+         }
+      }
+      return bounds;
+   }
+
+   virtual CColor4f const GetWorldColorAtPoint( CVector3f const& point ) const override
+   {
+      uint32_t const lowerPosition = static_cast<uint32_t>(floorf( mK ));
+      uint32_t const upperPosition = lowerPosition + 1;
+
+      // unlike the distances the colors only use the inverse transform once
+      CColor4f const c0 = lowerPosition >= 0 && lowerPosition < mObjectList.size() ?
+         mObjectList[lowerPosition]->GetWorldColorAtPoint( point ) : CColor4f::Black();
+      CColor4f const c1 = upperPosition >= 0 && upperPosition < mObjectList.size() ?
+         mObjectList[upperPosition]->GetWorldColorAtPoint( point ) : CColor4f::Black();
+
+      return CColor4f::Lerp( c0, c1, mK - floorf( mK ) );
+   }
+
+   virtual void SetBlendFactor( real32 const blendFactor ) override
+   {
+      mK = blendFactor;
+   }
+private:
+   real32 mK;
+};
+
+//-----------------------------------------------------------------------------
+
+inline real32 CSdfProgram::Evaluate( uint32_t const objectIndex, CVector3f const& point ) const
+{
+   real32 stack[skMaxStackDepth];
+   uint32_t top = 0;
+
+   SSdfInstruction const* const pInstructions = GetInstructions();
+   CTransform4f const* const pTransforms = GetTransforms();
+   SObjectRange const& range = GetObjectRange( objectIndex );
+   for (uint32_t index = range.mBegin; index < range.mEnd; ++index)
+   {
+      SSdfInstruction const& instruction = pInstructions[index];
+      real32 const* const params = instruction.mParams;
+      switch (instruction.mOp)
+      {
+      case ESdfOp::Sphere:
+         stack[top++] = CRenderSphere::SphereDistance( pTransforms[instruction.mTransform] * point, CVector3f( params[0], params[1], params[2] ), params[3] );
+         break;
+      case ESdfOp::Plane:
+         stack[top++] = CRenderPlane::PlaneDistance( pTransforms[instruction.mTransform] * point, CVector3f( params[0], params[1], params[2] ), params[3] );
+         break;
+      case ESdfOp::Cube:
+         stack[top++] = CRenderCube::CubeDistance( pTransforms[instruction.mTransform] * point, CVector3f( params[0], params[1], params[2] ) );
+         break;
+      case ESdfOp::Custom:
+         stack[top++] = instruction.mpObject->GetDistanceToPoint( pTransforms[instruction.mTransform] * point );
+         break;
+      case ESdfOp::Constant:
+         stack[top++] = params[0];
+         break;
+      case ESdfOp::Union:
+         {
+            top -= instruction.mCount;
+            real32 minValue = skLargeNumber;
+            for (uint32_t child = 0; child < instruction.mCount; ++child)
+            {
+               minValue = NMath::min_val( minValue, stack[top + child] );
+            }
+            stack[top++] = minValue;
+         }
+         break;
+      case ESdfOp::Intersection:
+         {
+            top -= instruction.mCount;
+            real32 maxValue = 0.f;
+            for (uint32_t child = 0; child < instruction.mCount; ++child)
+            {
+               maxValue = NMath::max_val( maxValue, stack[top + child] );
+            }
+            stack[top++] = maxValue;
+         }
+         break;
+      case ESdfOp::Difference:
+         {
+            top -= instruction.mCount;
+            real32 maxValue = 0.f;
+            for (uint32_t child = 0; child < instruction.mCount; ++child)
+            {
+               maxValue = NMath::max_val( maxValue, child ? -stack[top + child] : stack[top + child] );
+            }
+            stack[top++] = maxValue;
+         }
+         break;
+      case ESdfOp::SmoothUnion:
+         {
+            top -= instruction.mCount;
+            real32 minValue = instruction.mCount ? stack[top] : skLargeNumber;
+            for (uint32_t child = 1; child < instruction.mCount; ++child)
+            {
+               minValue = CRenderSmoothUnion::SmoothUnion( minValue, stack[top + child], params[0] );
+            }
+            stack[top++] = minValue;
+         }
+         break;
+      case ESdfOp::Blend:
+         top -= 2;
+         stack[top] = NMath::lerp( stack[top], stack[top + 1], params[0] );
+         ++top;
+         break;
+      }
+   }
+
+   return top ? stack[0] : skLargeNumber;
+}
+
+//-----------------------------------------------------------------------------
+
+inline SInterval CSdfProgram::EvaluateInterval( SSdfInstruction const& instruction, CVector3f const& boxMin, CVector3f const& boxMax )
+{
+   SInterval const x{ boxMin.GetX(), boxMax.GetX() };
+   SInterval const y{ boxMin.GetY(), boxMax.GetY() };
+   SInterval const z{ boxMin.GetZ(), boxMax.GetZ() };
+
+   real32 const* const params = instruction.mParams;
+   switch (instruction.mOp)
+   {
+   case ESdfOp::Sphere:
+      return SInterval::Length( x - params[0], y - params[1], z - params[2] ) - params[3];
+
+   case ESdfOp::Plane:
+      return (SInterval::Scale( x, params[0] ) + SInterval::Scale( y, params[1] ) + SInterval::Scale( z, params[2] )) - params[3];
+
+   case ESdfOp::Cube:
+      {
+         // see CRenderCube::CubeDistance
+         SInterval const qx = SInterval::Abs( x ) - params[0];
+         SInterval const qy = SInterval::Abs( y ) - params[1];
+         SInterval const qz = SInterval::Abs( z ) - params[2];
+         auto const outside = []( SInterval const& q ) { return SInterval{ NMath::max_val( q.mMin, 0.f ), NMath::max_val( q.mMax, 0.f ) }; };
+         SInterval const d = SInterval::Length( outside( qx ), outside( qy ), outside( qz ) );
+         SInterval const du{ NMath::min_val( NMath::max_val( NMath::max_val( qx.mMin, qy.mMin ), qz.mMin ), 0.f ),
+                             NMath::min_val( NMath::max_val( NMath::max_val( qx.mMax, qy.mMax ), qz.mMax ), 0.f ) };
+         return d + du;
+      }
+
+   default:
+      {
+         // only the bounds of a custom object are known, the surface is inside of them
+         SBoundingSphere const bounds = instruction.mpObject->GetLocalBounds();
+         if (bounds.IsInfinite())
+         {
+            return SInterval{ -skLargeNumber, skLargeNumber };
+         }
+
+         real32 const boundsDistance = SInterval::Length( x - bounds.mCenter.GetX(), y - bounds.mCenter.GetY(), z - bounds.mCenter.GetZ() ).mMin - bounds.mRadius;
+         return SInterval{ boundsDistance, skLargeNumber };
+      }
+   }
+}
+
+inline bool CSdfProgram::CopyPruned( uint32_t const objectIndex, CVector3f const* const pCorners, uint32_t const regionCount, real32 const slack, CSdfProgram& program ) const
+{
+   SSdfInstruction const* const pInstructions = GetInstructions();
+   CTransform4f const* const pTransforms = GetTransforms();
+   SObjectRange const& range = GetObjectRange( objectIndex );
+   uint32_t const count = range.mEnd - range.mBegin;
+   if (count == 0)
+   {
+      return false;
+   }
+
+   // the lowest distance of every instruction in any of the regions, and where
+   // the subtree that ends with the instruction begins
+   std::vector< real32 > minDistances( count, skLargeNumber );
+   std::vector< uint32_t > subtreeBegins( count, 0 );
+
+   for (uint32_t region = 0; region < regionCount; ++region)
+   {
+      CVector3f const* const pRegionCorners = pCorners + region * skRegionCorners;
+
+      SInterval stack[skMaxStackDepth];
+      uint32_t begins[skMaxStackDepth];
+      uint32_t top = 0;
+
+      for (uint32_t index = 0; index < count; ++index)
+      {
+         SSdfInstruction const& instruction = pInstructions[range.mBegin + index];
+         real32 const* const params = instruction.mParams;
+         switch (instruction.mOp)
+         {
+         case ESdfOp::Sphere:
+         case ESdfOp::Plane:
+         case ESdfOp::Cube:
+         case ESdfOp::Custom:
+            {
+               // the box around the corners in the local space of the primitive
+               CTransform4f const& transform = pTransforms[instruction.mTransform];
+               CVector3f boxMin = transform * pRegionCorners[0];
+               CVector3f boxMax = boxMin;
+               for (uint32_t corner = 1; corner < skRegionCorners; ++corner)
+               {
+                  CVector3f const point = transform * pRegionCorners[corner];
+                  boxMin = CVector3f( NMath::min_val( boxMin.GetX(), point.GetX() ), NMath::min_val( boxMin.GetY(), point.GetY() ), NMath::min_val( boxMin.GetZ(), point.GetZ() ) );
+                  boxMax = CVector3f( NMath::max_val( boxMax.GetX(), point.GetX() ), NMath::max_val( boxMax.GetY(), point.GetY() ), NMath::max_val( boxMax.GetZ(), point.GetZ() ) );
+               }
+               begins[top] = index;
+               stack[top++] = EvaluateInterval( instruction, boxMin, boxMax );
+            }
+            break;
+         case ESdfOp::Constant:
+            begins[top] = index;
+            stack[top++] = SInterval{ params[0], params[0] };
+            break;
+         case ESdfOp::Union:
+            {
+               top -= instruction.mCount;
+               SInterval minValue{ skLargeNumber, skLargeNumber };
+               for (uint32_t child = 0; child < instruction.mCount; ++child)
+               {
+                  minValue = SInterval{ NMath::min_val( minValue.mMin, stack[top + child].mMin ), NMath::min_val( minValue.mMax, stack[top + child].mMax ) };
+               }
+               begins[top] = instruction.mCount ? begins[top] : index;
+               stack[top++] = minValue;
+            }
+            break;
+         case ESdfOp::Intersection:
+         case ESdfOp::Difference:
+            {
+               top -= instruction.mCount;
+               SInterval maxValue{ 0.f, 0.f };
+               for (uint32_t child = 0; child < instruction.mCount; ++child)
+               {
+                  SInterval const& value = stack[top + child];
+                  SInterval const signedValue = (child && instruction.mOp == ESdfOp::Difference) ? SInterval{ -value.mMax, -value.mMin } : value;
+                  maxValue = SInterval{ NMath::max_val( maxValue.mMin, signedValue.mMin ), NMath::max_val( maxValue.mMax, signedValue.mMax ) };
+               }
+               begins[top] = instruction.mCount ? begins[top] : index;
+               stack[top++] = maxValue;
+            }
+            break;
+         case ESdfOp::SmoothUnion:
+            {
+               // every SmoothUnion is the smaller distance minus at most k / 6
+               top -= instruction.mCount;
+               SInterval minValue{ skLargeNumber, skLargeNumber };
+               for (uint32_t child = 0; child < instruction.mCount; ++child)
+               {
+                  minValue = SInterval{ NMath::min_val( minValue.mMin, stack[top + child].mMin ), NMath::min_val( minValue.mMax, stack[top + child].mMax ) };
+               }
+               if (instruction.mCount > 1)
+               {
+                  minValue.mMin -= NMath::max_val( params[0], 0.f ) * (1.f / 6.f) * static_cast<real32>(instruction.mCount - 1);
+               }
+               begins[top] = instruction.mCount ? begins[top] : index;
+               stack[top++] = minValue;
+            }
+            break;
+         case ESdfOp::Blend:
+            top -= 2;
+            stack[top] = SInterval{ NMath::lerp( stack[top].mMin, stack[top + 1].mMin, params[0] ), NMath::lerp( stack[top].mMax, stack[top + 1].mMax, params[0] ) };
+            ++top;
+            break;
+         }
+
+         subtreeBegins[index] = begins[top - 1];
+         minDistances[index] = NMath::min_val( minDistances[index], stack[top - 1].mMin );
+      }
+   }
+
+   if (minDistances[count - 1] > slack)
+   {
+      return false;
+   }
+
+   program.BeginObject();
+   CopySubtree( range.mBegin, count - 1, slack, minDistances.data(), subtreeBegins.data(), program );
+   program.EndObject();
+   return true;
+}
+
+inline bool CSdfProgram::Recompile( uint32_t const objectIndex, CRenderObject const& object )
+{
+   // attached tables can't be written to
+   if (mIsAttached)
+   {
+      return false;
+   }
+
+   CSdfProgram program;
+   program.BeginObject();
+   object.CompileTransformed( program, CTransform4f::Identity() );
+   program.EndObject();
+
+   SObjectRange const& range = mObjects[objectIndex];
+   uint32_t const count = range.mEnd - range.mBegin;
+   if (program.mInstructions.size() != count)
+   {
+      return false;
+   }
+
+   for (uint32_t index = 0; index < count; ++index)
+   {
+      SSdfInstruction const& oldInstruction = mInstructions[range.mBegin + index];
+      SSdfInstruction const& newInstruction = program.mInstructions[index];
+      if (oldInstruction.mOp != newInstruction.mOp || oldInstruction.mCount != newInstruction.mCount)
+      {
+         return false;
+      }
+   }
+
+   // the primitives keep the transforms that they already had
+   for (uint32_t index = 0; index < count; ++index)
+   {
+      SSdfInstruction& instruction = mInstructions[range.mBegin + index];
+      SSdfInstruction const& newInstruction = program.mInstructions[index];
+      switch (instruction.mOp)
+      {
+      case ESdfOp::Sphere:
+      case ESdfOp::Plane:
+      case ESdfOp::Cube:
+      case ESdfOp::Custom:
+         mTransforms[instruction.mTransform] = program.mTransforms[newInstruction.mTransform];
+         break;
+      default:
+         break;
+      }
+      std::copy( std::begin( newInstruction.mParams ), std::end( newInstruction.mParams ), instruction.mParams );
+      instruction.mpObject = newInstruction.mpObject;
+   }
+   return true;
+}
+
+inline void CSdfProgram::CopySubtree( uint32_t const begin, uint32_t const root, real32 const slack, real32 const* const pMinDistances, uint32_t const* const pSubtreeBegins, CSdfProgram& program ) const
+{
+   SSdfInstruction const& instruction = GetInstructions()[begin + root];
+   switch (instruction.mOp)
+   {
+   case ESdfOp::Sphere:
+   case ESdfOp::Plane:
+   case ESdfOp::Cube:
+   case ESdfOp::Custom:
+      program.mTransforms.push_back( GetTransforms()[instruction.mTransform] );
+      program.mInstructions.push_back( instruction );
+      program.mInstructions.back().mTransform = static_cast<uint32_t>(program.mTransforms.size() - 1);
+      program.Push();
+      return;
+   case ESdfOp::Constant:
+      program.mInstructions.push_back( instruction );
+      program.Push();
+      return;
+   default:
+      break;
+   }
+
+   // the children are found backwards from the last one
+   std::vector< uint32_t > children( instruction.mCount );
+   uint32_t child = root;
+   for (uint32_t index = instruction.mCount; index > 0; --index)
+   {
+      children[index - 1] = --child;
+      child = pSubtreeBegins[child];
+   }
+
+   uint32_t keptCount = 0;
+   for (uint32_t index = 0; index < instruction.mCount; ++index)
+   {
+      // A child can be left out of a Union when the distance to it is never the
+      // smallest one where the union is within slack of a surface. The same goes
+      // for SmoothUnion when the child is further than slack + (count - 1) * 7k / 6.
+      // A child cut from a Difference never changes it while the distance to the
+      // child is positive. The other children have to be kept, but their own
+      // children can still be pruned. Pruning only ever makes a distance larger, so
+      // the lowest distance to the other child of a Blend bounds how far a child has
+      // to be for the blend to be more than slack.
+      real32 childSlack = slack;
+      bool canSkip = false;
+      switch (instruction.mOp)
+      {
+      case ESdfOp::Union:
+         canSkip = true;
+         break;
+      case ESdfOp::Difference:
+         canSkip = index > 0;
+         childSlack = index > 0 ? 0.f : slack;
+         break;
+      case ESdfOp::SmoothUnion:
+         {
+            // smin( a, b ) is never below min( a, b ) - k / 6, so each fold step after a cut
+            // child lowers the value by less than 7k / 6 until the folds with and without it agree
+            real32 const k = NMath::max_val( instruction.mParams[0], 0.f );
+            canSkip = true;
+            childSlack = slack + k * (7.f / 6.f) * static_cast<real32>(instruction.mCount - 1);
+         }
+         break;
+      case ESdfOp::Blend:
+         {
+            // where weight * distance + (1 - weight) * otherMin > slack the blend is
+            // too, a weight that isn't between 0 and 1 has no such bound
+            real32 const weight = index == 0 ? 1.f - instruction.mParams[0] : instruction.mParams[0];
+            real32 const otherMin = pMinDistances[children[1 - index]];
+            childSlack = weight > 0.f && weight <= 1.f ? NMath::min_val( (slack - (1.f - weight) * otherMin) / weight, skLargeNumber ) : skLargeNumber;
+         }
+         break;
+      default:
+         break;
+      }
+
+      if (canSkip && pMinDistances[children[index]] > childSlack)
+      {
+         continue;
+      }
+
+      CopySubtree( begin, children[index], childSlack, pMinDistances, pSubtreeBegins, program );
+      ++keptCount;
+   }
+
+   program.mInstructions.push_back( instruction );
+   program.mInstructions.back().mCount = keptCount;
+   program.mDepth -= keptCount;
+   program.Push();
+}
+
+//-----------------------------------------------------------------------------
+
+namespace NSdfSse
+{
+   class CLanes
+   {
+   public:
+      static uint32_t constexpr skWidth = 4;
+
+      CLanes() = default;
+      explicit CLanes( __m128 const value ) : mValue( value ) { }
+      explicit CLanes( real32 const value ) : mValue( _mm_set1_ps( value ) ) { }
+
+      static CLanes Load( real32 const* const pValues ) { return CLanes( _mm_loadu_ps( pValues ) ); }
+      void Store( real32* const pValues ) const { _mm_storeu_ps( pValues, mValue ); }
+
+      CLanes operator-() const { return CLanes( _mm_xor_ps( mValue, _mm_set1_ps( -0.f ) ) ); }
+      CLanes operator+( CLanes const& rhs ) const { return CLanes( _mm_add_ps( mValue, rhs.mValue ) ); }
+      CLanes operator-( CLanes const& rhs ) const { return CLanes( _mm_sub_ps( mValue, rhs.mValue ) ); }
+      CLanes operator*( CLanes const& rhs ) const { return CLanes( _mm_mul_ps( mValue, rhs.mValue ) ); }
+      CLanes operator/( CLanes const& rhs ) const { return CLanes( _mm_div_ps( mValue, rhs.mValue ) ); }
+
+      __m128 GetValue() const { return mValue; }
+
+   private:
+      __m128 mValue;
+   };
+
+   // these pick the same value as NMath::min_val and NMath::max_val
+   inline CLanes Min( CLanes const& lhs, CLanes const& rhs ) { return CLanes( _mm_min_ps( lhs.GetValue(), rhs.GetValue() ) ); }
+   inline CLanes Max( CLanes const& lhs, CLanes const& rhs ) { return CLanes( _mm_max_ps( lhs.GetValue(), rhs.GetValue() ) ); }
+   inline CLanes Abs( CLanes const& value ) { return CLanes( _mm_andnot_ps( _mm_set1_ps( -0.f ), value.GetValue() ) ); }
+   inline CLanes Sqrt( CLanes const& value ) { return CLanes( _mm_sqrt_ps( value.GetValue() ) ); }
+
+#include "SdfPacket.inl"
+}
+
+// everything up to pop_options may use avx2, it is only called when the
+// processor supports it
+#if defined(__clang__)
+#pragma clang attribute push( __attribute__(( target( "avx2,fma" ) )), apply_to = function )
+#elif defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC target( "avx2,fma" )
+#endif
+
+namespace NSdfAvx2
+{
+   class CLanes
+   {
+   public:
+      static uint32_t constexpr skWidth = 8;
+
+      CLanes() = default;
+      explicit CLanes( __m256 const value ) : mValue( value ) { }
+      explicit CLanes( real32 const value ) : mValue( _mm256_set1_ps( value ) ) { }
+
+      static CLanes Load( real32 const* const pValues ) { return CLanes( _mm256_loadu_ps( pValues ) ); }
+      void Store( real32* const pValues ) const { _mm256_storeu_ps( pValues, mValue ); }
+
+      CLanes operator-() const { return CLanes( _mm256_xor_ps( mValue, _mm256_set1_ps( -0.f ) ) ); }
+      CLanes operator+( CLanes const& rhs ) const { return CLanes( _mm256_add_ps( mValue, rhs.mValue ) ); }
+      CLanes operator-( CLanes const& rhs ) const { return CLanes( _mm256_sub_ps( mValue, rhs.mValue ) ); }
+      CLanes operator*( CLanes const& rhs ) const { return CLanes( _mm256_mul_ps( mValue, rhs.mValue ) ); }
+      CLanes operator/( CLanes const& rhs ) const { return CLanes( _mm256_div_ps( mValue, rhs.mValue ) ); }
+
+      __m256 GetValue() const { return mValue; }
+
+   private:
+      __m256 mValue;
+   };
+
+   inline CLanes Min( CLanes const& lhs, CLanes const& rhs ) { return CLanes( _mm256_min_ps( lhs.GetValue(), rhs.GetValue() ) ); }
+   inline CLanes Max( CLanes const& lhs, CLanes const& rhs ) { return CLanes( _mm256_max_ps( lhs.GetValue(), rhs.GetValue() ) ); }
+   inline CLanes Abs( CLanes const& value ) { return CLanes( _mm256_andnot_ps( _mm256_set1_ps( -0.f ), value.GetValue() ) ); }
+   inline CLanes Sqrt( CLanes const& value ) { return CLanes( _mm256_sqrt_ps( value.GetValue() ) ); }
+
+#include "SdfPacket.inl"
+}
+
+#if defined(__clang__)
+#pragma clang attribute pop
+#elif defined(__GNUC__)
+#pragma GCC pop_options
+#endif
+
+inline void CSdfProgram::EvaluatePacket( uint32_t const objectIndex, SPointPacket const& points, uint32_t const activeMask, real32* const pMinDistances ) const
+{
+   using TEvaluatePacket = void (*)( SSdfInstruction const*, SSdfInstruction const*, CTransform4f const*, SPointPacket const&, uint32_t, real32* );
+   static TEvaluatePacket const spEvaluatePacket = NMath::HasAvx2() ? &NSdfAvx2::EvaluatePacket : &NSdfSse::EvaluatePacket;
+
+   SSdfInstruction const* const pInstructions = GetInstructions();
+   SObjectRange const& range = GetObjectRange( objectIndex );
+   spEvaluatePacket( pInstructions + range.mBegin, pInstructions + range.mEnd, GetTransforms(), points, activeMask, pMinDistances );
+}
+
+inline bool CSdfProgram::Attach( STables const& tables )
+{
+   // The tables usually come from a file, so everything that the evaluation relies
+   // on is checked here: every object leaves one distance on the stack without
+   // going past the end of it, and the primitives have transforms. Objects that
+   // call code can't be attached.
+   uint32_t maxDepth = 0;
+   for (uint32_t object = 0; object < tables.mObjectCount; ++object)
+   {
+      SObjectRange const& range = tables.mpObjects[object];
+      if (range.mBegin > range.mEnd || range.mEnd > tables.mInstructionCount)
+      {
+         return false;
+      }
+
+      uint32_t depth = 0;
+      for (uint32_t index = range.mBegin; index < range.mEnd; ++index)
+      {
+         SSdfInstruction const& instruction = tables.mpInstructions[index];
+         switch (instruction.mOp)
+         {
+         case ESdfOp::Sphere:
+         case ESdfOp::Plane:
+         case ESdfOp::Cube:
+            if (instruction.mTransform >= tables.mTransformCount)
+            {
+               return false;
+            }
+            ++depth;
+            break;
+         case ESdfOp::Constant:
+            ++depth;
+            break;
+         case ESdfOp::Union:
+         case ESdfOp::Intersection:
+         case ESdfOp::Difference:
+         case ESdfOp::SmoothUnion:
+            if (instruction.mCount > depth)
+            {
+               return false;
+            }
+            depth = depth - instruction.mCount + 1;
+            break;
+         case ESdfOp::Blend:
+            if (instruction.mCount != 2 || depth < 2)
+            {
+               return false;
+            }
+            --depth;
+            break;
+         default:
+            return false;
+         }
+
+         maxDepth = NMath::max_val( maxDepth, depth );
+         if (maxDepth > skMaxStackDepth)
+         {
+            return false;
+         }
+      }
+
+      if (depth != 1)
+      {
+         return false;
+      }
+   }
+
+   Clear();
+   mAttached = tables;
+   mIsAttached = true;
+   mMaxDepth = maxDepth;
+   return true;
+}
+
+//-----------------------------------------------------------------------------
+
+class SAttenuationInfo
+{
+public:
+   // attenuation
+   real32 constant{ 0.f };
+   real32 linear{ 0.f };
+   real32 exponential{ 1.f };
+};
+
+// The record of a light in a compiled scene, see NCompiledScene. The lights are
+// created from their records since some of their values are found in the
+// constructors that the scenes use.
+struct SCompiledLight
+{
+   CTransform4f mTransform;
+   CVector3f mPosition;
+   CVector3f mDirection;
+   CColor4f mColor;
+   SAttenuationInfo mAttenuation;
+   real32 mCosAngle;
+   ECompiledType mType;
+};
+
+class CLightObject
+{
+public:
+   using TPtr = std::shared_ptr< CLightObject >;
+   using TConstPtr = std::shared_ptr< CLightObject const >;
+
+   virtual ~CLightObject() {}
+
+   virtual CColor4f CalculateValueAtPosition( CVector3f const& position, CVector3f const& surfaceNormal ) const = 0;
+   virtual CVector3f const& GetPosition() const = 0;
+   virtual bool CastsShadow() const 
+   {
+      return false;
+   }
+
+   virtual void WriteCompiled( SCompiledLight& record ) const = 0;
+};
+
+//-----------------------------------------------------------------------------
+
+class CAmbientLightObject : public CLightObject
+{
+public:
+   explicit CAmbientLightObject( CColor4f const& color )
+      : mColor( color )
+   {
+   }
+
+   explicit CAmbientLightObject( SCompiledLight const& record )
+      : mColor( record.mColor )
+   {
+   }
+
+   virtual CColor4f CalculateValueAtPosition( CVector3f const& /*position*/, CVector3f const& /*surfaceNormal*/ ) const override
+   {
+      return mColor;
+   }
+
+   virtual CVector3f const& GetPosition() const override
+   {
+      static CVector3f const skZero( CVector3f::Zero() );
+      return skZero;
+   }
+
+   virtual void WriteCompiled( SCompiledLight& record ) const override
+   {
+      record.mType = ECompiledType::AmbientLight;
+      record.mColor = mColor;
+   }
+
+private:
+   CColor4f mColor;
+};
+
+//-----------------------------------------------------------------------------
+
+class CShadowCastingLightObject : public CLightObject
+{
+public:
+   CShadowCastingLightObject() = default;
+
+   explicit CShadowCastingLightObject( SCompiledLight const& record )
+      : mTransform( record.mTransform )
+      , mInverseTransform( record.mTransform.GetInverse() )
+      , mAttenuation( record.mAttenuation )
+   {
+   }
+
+   virtual bool CastsShadow() const override
+   {
+      return true;
+   }
+
+   real32 GetPenumbra() const
+   {
+      return mPenumbra;
+   }
+
+   void SetAttenuationInfo(SAttenuationInfo const& attenuation)
+   {
+      mAttenuation = attenuation;
+   }
+
+   SAttenuationInfo const& GetAttenuationInfo() const
+   {
+      return mAttenuation;
+   }
+   void SetTransform(CTransform4f const& transform)
+   {
+      mTransform = transform;
+      mInverseTransform = mTransform.GetInverse();
+      UpdateWorldValues();
+   }
+
+   CTransform4f const& GetTransform() const
+   {
+      return mTransform;
+   }
+
+   CTransform4f const& GetInverseTransform() const
+   {
+      return mInverseTransform;
+   }
+
+   // the values that the lights that cast shadows have in common
+   virtual void WriteCompiled( SCompiledLight& record ) const override
+   {
+      record.mTransform = mTransform;
+      record.mAttenuation = mAttenuation;
+   }
+
+protected:
+   // Moves the values of the light through its transform, so shading doesn't have to
+   // do it for every point. This is called whenever the transform or the values
+   // change, and by the constructors of the lights once their values are set.
+   virtual void UpdateWorldValues() = 0;
+
+private:
+   CTransform4f mTransform{ CTransform4f::Identity() };
+   CTransform4f mInverseTransform{ CTransform4f::Identity() };
+   real32 mPenumbra{ 24 };
+   SAttenuationInfo mAttenuation;
+};
+
+
+class CPointLightObject : public CShadowCastingLightObject
+{
+public:
+   explicit CPointLightObject( CVector3f const& position, CColor4f const& color )
+      : mPosition( position )
+      , mColor( color )
+   {
+      UpdateWorldValues();
+   }
+
+   explicit CPointLightObject( SCompiledLight const& record )
+      : CShadowCastingLightObject( record )
+      , mPosition( record.mPosition )
+      , mColor( record.mColor )
+   {
+      UpdateWorldValues();
+   }
+
+   virtual CColor4f CalculateValueAtPosition( CVector3f const& position, CVector3f const & surfaceNormal ) const override
+   {
+      CVector3f const direction = (mWorldPosition - position).AsNormalized();
+      real32 const angle = CVector3f::Dot( surfaceNormal, direction );
+      if (angle < 0.f)
+      {
+         return CColor4f::Black();
+      }
+      return  mColor * angle;
+   }
+
+   // the position after the transform
+   virtual CVector3f const& GetPosition() const override
+   {
+      return mWorldPosition;
+   }
+
+   void SetPosition( CVector3f const& position )
+   {
+      mPosition = position;
+      UpdateWorldValues();
+   }
+
+   CColor4f const& GetColor() const
+   {
+      return mColor;
+   }
+
+   virtual void WriteCompiled( SCompiledLight& record ) const override
+   {
+      CShadowCastingLightObject::WriteCompiled( record );
+      record.mType = ECompiledType::PointLight;
+      record.mPosition = mPosition;
+      record.mColor = mColor;
+   }
+
+protected:
+   virtual void UpdateWorldValues() override
+   {
+      mWorldPosition = GetTransform() * mPosition;
+   }
+
+private:
+   CVector3f mPosition;
+   CVector3f mWorldPosition{ CVector3f::Zero() };
+   CColor4f mColor;
+};
+
+class CSpotLightObject : public CShadowCastingLightObject
+{
+public:
+   explicit CSpotLightObject(CVector3f const& position, CVector3f const & direction, real32 const angle, CColor4f const& color)
+      : mPosition(position)
+      , mDirection( direction.AsNormalized() )
+      , mCosAngle( ::cosf( CRelAngle::FromDegrees(angle).AsRadians() ))
+      , mColor(color)
+   {
+      UpdateWorldValues();
+   }
+
+   explicit CSpotLightObject( SCompiledLight const& record )
+      : CShadowCastingLightObject( record )
+      , mPosition( record.mPosition )
+      , mDirection( record.mDirection )
+      , mCosAngle( record.mCosAngle )
+      , mColor( record.mColor )
+   {
+      UpdateWorldValues();
+   }
+
+   virtual CColor4f CalculateValueAtPosition(CVector3f const& position, CVector3f const& surfaceNormal) const override
+   {
+      CVector3f const direction = (mWorldPosition - position).AsNormalized();
+      real32 const angleToLight = CVector3f::Dot(surfaceNormal, direction);
+      real32 const angleInSpot = CVector3f::Dot(direction, mWorldSpotDirection);
+
+      if (angleToLight < 0.f || angleInSpot < mCosAngle)
+      {
+         return CColor4f::Black();
+      }
+      return  mColor * angleToLight;
+   }
+
+   // the position after the transform
+   virtual CVector3f const& GetPosition() const override
+   {
+      return mWorldPosition;
+   }
+
+   void SetPosition( CVector3f const& position )
+   {
+      mPosition = position;
+      UpdateWorldValues();
+   }
+
+   CColor4f const& GetColor() const
+   {
+      return mColor;
+   }
+
+   virtual void WriteCompiled( SCompiledLight& record ) const override
+   {
+      CShadowCastingLightObject::WriteCompiled( record );
+      record.mType = ECompiledType::SpotLight;
+      record.mPosition = mPosition;
+      record.mDirection = mDirection;
+      record.mCosAngle = mCosAngle;
+      record.mColor = mColor;
+   }
+
+protected:
+   // the spot direction points from a lit point towards the light
+   virtual void UpdateWorldValues() override
+   {
+      mWorldPosition = GetTransform() * mPosition;
+      mWorldSpotDirection = GetInverseTransform().TransposeRotate( -mDirection );
+   }
+
+private:
+   CVector3f mPosition;
+   CVector3f mDirection;
+   CVector3f mWorldPosition{ CVector3f::Zero() };
+   CVector3f mWorldSpotDirection{ CVector3f::Zero() };
+   real32 mCosAngle;
+   CColor4f mColor;
+};
+
+class CDirectionalLightObject : public CLightObject
+{
+public:
+   explicit CDirectionalLightObject( CVector3f const& direction, CColor4f const& color )
+      : mDirection( direction.AsNormalized() )
+      , mColor( color )
+   {
+   }
+
+   explicit CDirectionalLightObject( SCompiledLight const& record )
+      : mDirection( record.mDirection )
+      , mColor( record.mColor )
+   {
+   }
+
+   virtual CColor4f CalculateValueAtPosition( CVector3f const& /*position*/, CVector3f const& surfaceNormal ) const override
+   {
+      real32 const angle = CVector3f::Dot( surfaceNormal, -mDirection );
+      if (angle < 0.f)
+      {
+         return CColor4f::Black();
+      }
+      return  mColor * angle;
+   }
+
+   virtual CVector3f const& GetPosition() const override
+   {
+      static CVector3f const skZero( CVector3f::Zero() );
+      return skZero;
+   }
+
+   CColor4f const& GetColor() const
+   {
+      return mColor;
+   }
+
+   virtual void WriteCompiled( SCompiledLight& record ) const override
+   {
+      record.mType = ECompiledType::DirectionalLight;
+      record.mDirection = mDirection;
+      record.mColor = mColor;
+   }
+
+private:
+   CVector3f mDirection;
+   CColor4f mColor;
+};
+
+//===================================================================================
+
+class CInfiniteRay
+{
+public:
+   explicit CInfiniteRay( CVector3f const& position, CVector3f const& direction ) : mPosition( position ), mDirection( direction ) { }
+   CVector3f const& GetPosition() const { return mPosition; }
+   CVector3f const& GetDirection() const { return mDirection; }
+   CVector3f const GetPositionAlongRay( real32 const time ) const { return mPosition + mDirection * time; }
+private:
+   CVector3f mPosition;
+   CVector3f mDirection;
+};
+
+//-------------------------------------------------------------------------
+
+class CRayResult
+{
+public:
+   explicit CRayResult( CVector3f const& collisionPoint, real32 const time, bool const hit, int32_t const steps, CRenderObject const* const pObject )
+      : mCollisionPoint( collisionPoint )
+      , mTime( time )
+      , mHit( hit )
+      , mSteps( steps )
+      , mpObject( pObject )
+   {
+   }
+
+   static CRayResult NoResults() { return CRayResult( CVector3f::Zero(), skLargeNumber, false, 0, nullptr ); }
+
+   CVector3f mCollisionPoint;
+   real32 mTime;
+   bool mHit;
+   int32_t mSteps;
+   // the object that was closest to the collision point
+   CRenderObject const* mpObject;
+};
+
+//-------------------------------------------------------------------------
+
+// The primary rays of up to SPointPacket::skWidth pixels on a row that are
+// marched together. The results match the CRayResult of each ray.
+struct SRayPacket
+{
+   uint32_t mCount = 0;
+   uint32_t mY = 0;
+   uint32_t mX[SPointPacket::skWidth];
+
+   // where each ray starts when it is marched
+   real32 mTime[SPointPacket::skWidth];
+#if USE_TEMPORAL_REPROJECTION()
+   // a depth that the ray can skip to when nothing is in front of it
+   real32 mGuessTime[SPointPacket::skWidth];
+#endif
+   int32_t mSteps[SPointPacket::skWidth];
+   bool mHit[SPointPacket::skWidth];
+   CRenderObject const* mpObject[SPointPacket::skWidth];
+};
+
+//-------------------------------------------------------------------------
+
+class CCamera
+{
+public:
+   explicit CCamera( CVector3f const& cameraCenter, CVector3f const& cameraLookAt, real32 const cameraFOV = 45.f, bool const verticalFOV = false )
+   : mCameraTransform( CTransform4f::Identity())
+   , mSceneWidth(skDefaultWidth)
+   , mSceneHeight(skDefaultHeight)
+   , mCameraScale(1.f)
+   , mCameraFOV(cameraFOV)
+   , mVerticalFOV(verticalFOV)
+   {
+      CalculateParameters(cameraCenter, cameraLookAt, cameraFOV, verticalFOV);
+   }
+
+   static CCamera DefaultCamera() { return CCamera( CVector3f::Zero(), CVector3f( 0.f, 0.f, 1.f ), 45.f ); }
+
+   CInfiniteRay const GetRayForPosition( uint32_t const x, uint32_t const y ) const
+   {
+      return GetRayForPosition( static_cast<real32>(x), static_cast<real32>(y) );
+   }
+
+   // the position can be between pixels
+   CInfiniteRay const GetRayForPosition( real32 const x, real32 const y ) const
+   {
+      return CInfiniteRay( mCameraTransform.GetTranslation(), GetDirectionForPosition( x, y ).AsNormalized() );
+   }
+
+   // the direction of the ray before it is normalized, it ends on the plane one
+   // unit in front of the camera so it is never shorter than 1
+   CVector3f const GetDirectionForPosition( real32 const x, real32 const y ) const
+   {
+      real32 const hFactor = (x - (mSceneWidth * 0.5f)) * mCameraScale;
+      real32 const vFactor = -(y - (mSceneHeight * 0.5f)) * mCameraScale;
+
+      return mCameraTransform.GetZBasis() + mCameraTransform.GetXBasis() * hFactor + mCameraTransform.GetYBasis() * vFactor;
+   }
+
+   // the opposite of GetRayForPosition, returns false for points behind the camera
+   bool GetPositionForPoint( CVector3f const& point, real32& x, real32& y ) const
+   {
+      CVector3f const offset = point - mCameraTransform.GetTranslation();
+      real32 const forward = CVector3f::Dot( offset, mCameraTransform.GetZBasis() );
+      if (forward <= skMinLength)
+      {
+         return false;
+      }
+
+      x = CVector3f::Dot( offset, mCameraTransform.GetXBasis() ) / (forward * mCameraScale) + mSceneWidth * 0.5f;
+      y = -CVector3f::Dot( offset, mCameraTransform.GetYBasis() ) / (forward * mCameraScale) + mSceneHeight * 0.5f;
+      return true;
+   }
+
+   // The rectangle on the screen that the sphere is inside of, in the same units as
+   // GetPositionForPoint. Returns false when the sphere is behind the camera.
+   bool GetScreenBounds( SBoundingSphere const& bounds, real32& minX, real32& minY, real32& maxX, real32& maxY ) const
+   {
+      CVector3f const offset = bounds.mCenter - mCameraTransform.GetTranslation();
+      real32 const forward = CVector3f::Dot( offset, mCameraTransform.GetZBasis() );
+      if (forward + bounds.mRadius <= 0.f)
+      {
+         return false;
+      }
+
+      if (bounds.IsInfinite() || forward - bounds.mRadius <= skMinLength)
+      {
+         // the sphere reaches around the camera
+         minX = -skLargeNumber;
+         minY = -skLargeNumber;
+         maxX = skLargeNumber;
+         maxY = skLargeNumber;
+         return true;
+      }
+
+      // every point of the sphere is inside of the box around it in camera space, so
+      // the smallest and largest value of right / forward is at one of its corners
+      real32 const nearForward = (forward - bounds.mRadius) * mCameraScale;
+      real32 const farForward = (forward + bounds.mRadius) * mCameraScale;
+      auto const project = [&]( real32 const side, real32& minValue, real32& maxValue )
+      {
+         real32 const minSide = side - bounds.mRadius;
+         real32 const maxSide = side + bounds.mRadius;
+         minValue = minSide / (minSide >= 0.f ? farForward : nearForward);
+         maxValue = maxSide / (maxSide >= 0.f ? nearForward : farForward);
+      };
+
+      real32 minUp = 0.f;
+      real32 maxUp = 0.f;
+      project( CVector3f::Dot( offset, mCameraTransform.GetXBasis() ), minX, maxX );
+      project( CVector3f::Dot( offset, mCameraTransform.GetYBasis() ), minUp, maxUp );
+
+      minX += mSceneWidth * 0.5f;
+      maxX += mSceneWidth * 0.5f;
+      minY = mSceneHeight * 0.5f - maxUp;
+      maxY = mSceneHeight * 0.5f - minUp;
+      return true;
+   }
+
+   real32 const GetCameraScale() const { return mCameraScale; }
+   real32 const GetCameraFOV() const { return mCameraFOV; }
+   bool IsVerticalFOV() const { return mVerticalFOV; }
+   CTransform4f const& GetCameraTransform() const { return mCameraTransform; }
+   void SetCameraTransform( CTransform4f const& transform ) { mCameraTransform = transform; }
+
+   void SetSceneSize( uint32_t const sceneWidth, uint32_t const sceneHeight )
+   {
+      mSceneWidth = sceneWidth;
+      mSceneHeight = sceneHeight;
+
+      CalculateParameters( mCameraTransform.GetTranslation(), mCameraTransform.GetTranslation() + mCameraTransform.GetBackward(), mCameraFOV, mVerticalFOV );
+   }
+
+private:
+
+   void CalculateParameters( CVector3f const& cameraCenter, CVector3f const& cameraLookAt, real32 const cameraFOV, bool const verticalFOV )
+   {
+      CVector3f const worldUp = CVector3f::Up();
+
+      real32 const fovScale( tanf( cameraFOV * ((NMath::gkPi32 / 180.f) / 2.f) ) * 2.f );
+
+      if (verticalFOV)
+      {
+         mCameraScale = fovScale / mSceneHeight;
+      }
+      else
+      {
+         mCameraScale = fovScale / mSceneWidth;
+      }
+
+      CVector3f const cameraForward = (cameraLookAt - cameraCenter).AsNormalized();
+      CVector3f const cameraRight = cameraForward.CrossProductWith( worldUp ).AsNormalized();
+      CVector3f const cameraUp = cameraRight.CrossProductWith( cameraForward );
+
+      mCameraTransform = CTransform4f::FromVectors( cameraRight, cameraUp, cameraForward, cameraCenter );
+   }
+
+   CTransform4f mCameraTransform;
+   uint32_t mSceneWidth;
+   uint32_t mSceneHeight;
+   real32 mCameraScale;
+   real32 mCameraFOV;
+   bool mVerticalFOV;
+};
+
+//-------------------------------------------------------------------------
+
+class CLightObjectContainer
+{
+public:
+
+   explicit CLightObjectContainer( CLightObject* pLightObject )
+      : mpLightObject( pLightObject )
+   {
+   }
+
+   explicit CLightObjectContainer( CLightObject::TPtr const& pLightObject )
+      : mpLightObject( pLightObject )
+   {
+   }
+
+   CLightObject::TConstPtr GetLightObject() const
+   {
+      return mpLightObject;
+   }
+
+   CLightObject::TPtr const & LightObject() const
+   {
+      return mpLightObject;
+   }
+
+   TAnimations const& GetAnimations() const
+   {
+      return mAnimations;
+   }
+
+   void AddAnimation( TAnimation const& animation )
+   {
+      mAnimations.push_back( animation );
+   }
+
+private:
+   CLightObject::TPtr mpLightObject;
+   TAnimations mAnimations;
+};
+
+//-------------------------------------------------------------------------
+
+// A bounding volume hierarchy over the top level objects of a scene, it lets
+// the closest object be found without looking at every object. Objects
+// without bounds can't be sorted into it and are always visited. For a few
+// objects checking all of their bounds is quicker than walking a tree.
+
+class CObjectHierarchy
+{
+public:
+   void Clear()
+   {
+      mNodes.clear();
+      mUnboundedObjects.clear();
+      mBoundedObjects.clear();
+   }
+
+   void Build( std::vector< SBoundingSphere > const& bounds )
+   {
+      Clear();
+
+      std::vector< uint32_t > objects;
+      for (uint32_t index = 0; index < bounds.size(); ++index)
+      {
+         if (bounds[index].IsInfinite())
+         {
+            mUnboundedObjects.push_back( index );
+         }
+         else if (bounds.size() < skMinTreeObjects)
+         {
+            mBoundedObjects.push_back( SNode{ bounds[index], true, index } );
+         }
+         else
+         {
+            objects.push_back( index );
+         }
+      }
+
+      if (!objects.empty())
+      {
+         mNodes.reserve( objects.size() * 2 - 1 );
+         mNodes.push_back( SNode{ SBoundingSphere::Infinite(), true, 0 } );
+         BuildNode( bounds, 0, objects.data(), objects.data() + objects.size() );
+      }
+   }
+
+   // Updates the bounds of the nodes after objects have moved, the tree keeps
+   // its shape. Returns false when an object gained or lost its bounds, then the
+   // hierarchy has to be built again.
+   bool Refit( std::vector< SBoundingSphere > const& bounds )
+   {
+      for (uint32_t const index : mUnboundedObjects)
+      {
+         if (!bounds[index].IsInfinite())
+         {
+            return false;
+         }
+      }
+
+      for (SNode& object : mBoundedObjects)
+      {
+         if (bounds[object.mIndex].IsInfinite())
+         {
+            return false;
+         }
+         object.mBounds = bounds[object.mIndex];
+      }
+
+      // the children of a node always come after it
+      for (size_t nodeIndex = mNodes.size(); nodeIndex-- > 0;)
+      {
+         SNode& node = mNodes[nodeIndex];
+         if (!node.mLeaf)
+         {
+            node.mBounds = SBoundingSphere::Enclose( mNodes[node.mIndex].mBounds, mNodes[node.mIndex + 1].mBounds );
+         }
+         else if (bounds[node.mIndex].IsInfinite())
+         {
+            return false;
+         }
+         else
+         {
+            node.mBounds = bounds[node.mIndex];
+         }
+      }
+      return true;
+   }
+
+   // Calls function( objectIndex, boundsDistance ) for the objects whose bounds
+   // are closer to the point than limit. The function can lower the limit as it
+   // goes, which prunes the rest of the search. Objects without bounds come
+   // first, after that the closer nodes are visited before the further ones.
+   template< class TFunction >
+   void VisitObjects( CVector3f const& point, real32 const& limit, TFunction const& function ) const
+   {
+      for (uint32_t const index : mUnboundedObjects)
+      {
+         function( index, -skLargeNumber );
+      }
+
+      for (SNode const& object : mBoundedObjects)
+      {
+         real32 const boundsDistance = object.mBounds.GetDistanceToPoint( point );
+         if (boundsDistance < limit)
+         {
+            function( object.mIndex, boundsDistance );
+         }
+      }
+
+      if (mNodes.empty())
+      {
+         return;
+      }
+
+      struct SEntry
+      {
+         uint32_t mNode;
+         real32 mDistance;
+      };
+
+      SEntry stack[skMaxStackDepth];
+      uint32_t top = 0;
+      stack[top++] = SEntry{ 0, mNodes[0].mBounds.GetDistanceToPoint( point ) };
+
+      while (top > 0)
+      {
+         SEntry const entry = stack[--top];
+         if (entry.mDistance >= limit)
+         {
+            continue;
+         }
+
+         SNode const& node = mNodes[entry.mNode];
+         if (node.mLeaf)
+         {
+            function( node.mIndex, entry.mDistance );
+            continue;
+         }
+
+         // the closer child goes on the top of the stack
+         SEntry const first{ node.mIndex, mNodes[node.mIndex].mBounds.GetDistanceToPoint( point ) };
+         SEntry const second{ node.mIndex + 1, mNodes[node.mIndex + 1].mBounds.GetDistanceToPoint( point ) };
+         bool const firstIsCloser = first.mDistance < second.mDistance;
+         stack[top++] = firstIsCloser ? second : first;
+         stack[top++] = firstIsCloser ? first : second;
+      }
+   }
+
+   // The same as VisitObjects for the active points of a packet, pLimits has a
+   // limit for each point. function( objectIndex, laneMask, pBoundsDistances )
+   // gets the points that are closer to the bounds than their limits.
+   template< class TFunction >
+   void VisitObjects( SPointPacket const& points, uint32_t const activeMask, real32 const* const pLimits, TFunction const& function ) const
+   {
+      uint32_t constexpr skWidth = SPointPacket::skWidth;
+
+      if (!mUnboundedObjects.empty())
+      {
+         real32 unboundedDistances[skWidth];
+         std::fill( unboundedDistances, unboundedDistances + skWidth, -skLargeNumber );
+         for (uint32_t const index : mUnboundedObjects)
+         {
+            function( index, activeMask, unboundedDistances );
+         }
+      }
+
+      for (SNode const& object : mBoundedObjects)
+      {
+         real32 boundsDistances[skWidth];
+         uint32_t mask = 0;
+         for (uint32_t lane = 0; lane < skWidth; ++lane)
+         {
+            if (activeMask & (1u << lane))
+            {
+               boundsDistances[lane] = object.mBounds.GetDistanceToPoint( CVector3f( points.mX[lane], points.mY[lane], points.mZ[lane] ) );
+               mask |= boundsDistances[lane] < pLimits[lane] ? (1u << lane) : 0;
+            }
+         }
+
+         if (mask != 0)
+         {
+            function( object.mIndex, mask, boundsDistances );
+         }
+      }
+
+      if (mNodes.empty())
+      {
+         return;
+      }
+
+      struct SEntry
+      {
+         uint32_t mNode;
+         uint32_t mMask;
+         real32 mDistances[skWidth];
+      };
+
+      auto const makeEntry = [&]( uint32_t const nodeIndex, uint32_t const mask )
+      {
+         SEntry entry{ nodeIndex, mask, {} };
+         for (uint32_t lane = 0; lane < skWidth; ++lane)
+         {
+            if (mask & (1u << lane))
+            {
+               entry.mDistances[lane] = mNodes[nodeIndex].mBounds.GetDistanceToPoint( CVector3f( points.mX[lane], points.mY[lane], points.mZ[lane] ) );
+            }
+         }
+         return entry;
+      };
+
+      SEntry stack[skMaxStackDepth];
+      uint32_t top = 0;
+      stack[top++] = makeEntry( 0, activeMask );
+
+      while (top > 0)
+      {
+         SEntry const entry = stack[--top];
+
+         uint32_t mask = 0;
+         for (uint32_t lane = 0; lane < skWidth; ++lane)
+         {
+            if ((entry.mMask & (1u << lane)) && entry.mDistances[lane] < pLimits[lane])
+            {
+               mask |= 1u << lane;
+            }
+         }
+
+         if (mask == 0)
+         {
+            continue;
+         }
+
+         SNode const& node = mNodes[entry.mNode];
+         if (node.mLeaf)
+         {
+            function( node.mIndex, mask, entry.mDistances );
+            continue;
+         }
+
+         // the child that is closer to the first point goes on the top of the stack
+         uint32_t const lane = std::countr_zero( mask );
+         SEntry const first = makeEntry( node.mIndex, mask );
+         SEntry const second = makeEntry( node.mIndex + 1, mask );
+         bool const firstIsCloser = first.mDistances[lane] < second.mDistances[lane];
+         stack[top++] = firstIsCloser ? second : first;
+         stack[top++] = firstIsCloser ? first : second;
+      }
+   }
+
+private:
+   // the nodes are split in half so the tree is never deeper than this
+   static uint32_t constexpr skMaxStackDepth = 64;
+
+   // scenes with fewer objects than this don't build a tree
+   static uint32_t constexpr skMinTreeObjects = 8;
+
+   struct SNode
+   {
+      SBoundingSphere mBounds;
+      bool mLeaf;
+      uint32_t mIndex;     // the object of a leaf, or the first of the two children
+   };
+
+   // splits the objects in half along the axis where their centers are spread out the most
+   void BuildNode( std::vector< SBoundingSphere > const& bounds, uint32_t const nodeIndex, uint32_t* const pBegin, uint32_t* const pEnd )
+   {
+      if (pEnd - pBegin == 1)
+      {
+         mNodes[nodeIndex] = SNode{ bounds[*pBegin], true, *pBegin };
+         return;
+      }
+
+      CVector3f minCenter = bounds[*pBegin].mCenter;
+      CVector3f maxCenter = minCenter;
+      for (uint32_t const* pObject = pBegin; pObject != pEnd; ++pObject)
+      {
+         CVector3f const& center = bounds[*pObject].mCenter;
+         minCenter = CVector3f( NMath::min_val( minCenter.GetX(), center.GetX() ), NMath::min_val( minCenter.GetY(), center.GetY() ), NMath::min_val( minCenter.GetZ(), center.GetZ() ) );
+         maxCenter = CVector3f( NMath::max_val( maxCenter.GetX(), center.GetX() ), NMath::max_val( maxCenter.GetY(), center.GetY() ), NMath::max_val( maxCenter.GetZ(), center.GetZ() ) );
+      }
+
+      CVector3f const extent = maxCenter - minCenter;
+      int32_t const axis = extent.GetX() > extent.GetY() ? (extent.GetX() > extent.GetZ() ? 0 : 2) : (extent.GetY() > extent.GetZ() ? 1 : 2);
+      auto const axisValue = [&]( uint32_t const object )
+      {
+         CVector3f const& center = bounds[object].mCenter;
+         return axis == 0 ? center.GetX() : (axis == 1 ? center.GetY() : center.GetZ());
+      };
+
+      uint32_t* const pMiddle = pBegin + (pEnd - pBegin) / 2;
+      std::nth_element( pBegin, pMiddle, pEnd, [&]( uint32_t const lhs, uint32_t const rhs ) { return axisValue( lhs ) < axisValue( rhs ); } );
+
+      // the two children are next to each other
+      uint32_t const firstChild = static_cast<uint32_t>(mNodes.size());
+      mNodes.push_back( SNode{ SBoundingSphere::Infinite(), true, 0 } );
+      mNodes.push_back( SNode{ SBoundingSphere::Infinite(), true, 0 } );
+      BuildNode( bounds, firstChild, pBegin, pMiddle );
+      BuildNode( bounds, firstChild + 1, pMiddle, pEnd );
+
+      mNodes[nodeIndex] = SNode{ SBoundingSphere::Enclose( mNodes[firstChild].mBounds, mNodes[firstChild + 1].mBounds ), false, firstChild };
+   }
+
+   std::vector< SNode > mNodes;
+   std::vector< uint32_t > mUnboundedObjects;
+   std::vector< SNode > mBoundedObjects;
+};
+
+//-------------------------------------------------------------------------
+// Over-relaxed sphere tracing of a single ray
+// See: Keinert et al. "Enhanced Sphere Tracing"
+//
+// A step is made longer than the distance to the nearest object. It is safe as
+// long as the spheres around the points at both ends of the step overlap. When
+// they don't, a surface could have been stepped over, so the ray goes back and
+// takes plain steps for the rest of the march.
+
+class CRelaxedStepper
+{
+public:
+   CRelaxedStepper() = default;
+
+   explicit CRelaxedStepper( real32 const relaxation )
+      : mRelaxation( relaxation )
+   {
+   }
+
+   // a point that is found after a step that went too far can't be a hit
+   bool Overshot( real32 const distance ) const
+   {
+      return mRelaxation > 1.f && NMath::AbsF( distance ) + NMath::AbsF( mPreviousDistance ) < NMath::AbsF( mStepLength );
+   }
+
+   // how far to move along the ray from the point that the distance was found at
+   real32 NextStep( real32 const distance, bool const overshot )
+   {
+      if (overshot)
+      {
+         RENDER_STAT_ADD( mRelaxationFallbacks, 1 );
+         real32 const step = mPreviousDistance - mStepLength;
+         mRelaxation = 1.f;
+         mStepLength = mPreviousDistance;
+         return step;
+      }
+
+      mPreviousDistance = distance;
+      mStepLength = distance * mRelaxation;
+      return mStepLength;
+   }
+
+private:
+   real32 mRelaxation{ 1.f };
+   real32 mPreviousDistance{ 0.f };
+   real32 mStepLength{ 0.f };
+};
+
+//-------------------------------------------------------------------------
+
+// The objects that the primary rays of a tile of the screen can hit. When the
+// scene is pruned the program has a copy of every one of them, in the same order.
+struct SSceneTile
+{
+   std::vector< uint32_t > mObjects;
+   CSdfProgram mProgram;
+};
+
+//-------------------------------------------------------------------------
+
+// A file that is mapped into memory to be read. The pages are only read from
+// the disk when they are first used, so even a big file opens right away.
+class CMappedFile
+{
+public:
+   CMappedFile() = default;
+   CMappedFile( CMappedFile const& ) = delete;
+   CMappedFile& operator=( CMappedFile const& ) = delete;
+
+   ~CMappedFile()
+   {
+      Close();
+   }
+
+   bool Open( std::string const& fileName )
+   {
+      Close();
+#if defined(_WIN32)
+      HANDLE const file = ::CreateFileA( fileName.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL );
+      if (file == INVALID_HANDLE_VALUE)
+      {
+         return false;
+      }
+
+      LARGE_INTEGER size;
+      HANDLE const mapping = ::GetFileSizeEx( file, &size ) && size.QuadPart > 0 ? ::CreateFileMappingA( file, NULL, PAGE_READONLY, 0, 0, NULL ) : NULL;
+      // the mapping keeps the file open and the view keeps the mapping open
+      ::CloseHandle( file );
+      if (mapping == NULL)
+      {
+         return false;
+      }
+      void const* const pData = ::MapViewOfFile( mapping, FILE_MAP_READ, 0, 0, 0 );
+      ::CloseHandle( mapping );
+      if (pData == nullptr)
+      {
+         return false;
+      }
+      mSize = static_cast<size_t>(size.QuadPart);
+#else
+      int const file = ::open( fileName.c_str(), O_RDONLY );
+      if (file < 0)
+      {
+         return false;
+      }
+
+      struct stat status;
+      void* const pData = ::fstat( file, &status ) == 0 && status.st_size > 0 ? ::mmap( nullptr, static_cast<size_t>(status.st_size), PROT_READ, MAP_PRIVATE, file, 0 ) : MAP_FAILED;
+      // the mapping keeps the file open
+      ::close( file );
+      if (pData == MAP_FAILED)
+      {
+         return false;
+      }
+      mSize = static_cast<size_t>(status.st_size);
+#endif
+      mpData = static_cast<uint8_t const*>(pData);
+      return true;
+   }
+
+   void Close()
+   {
+      if (mpData != nullptr)
+      {
+#if defined(_WIN32)
+         ::UnmapViewOfFile( mpData );
+#else
+         ::munmap( const_cast<uint8_t*>(mpData), mSize );
+#endif
+      }
+      mpData = nullptr;
+      mSize = 0;
+   }
+
+   uint8_t const* GetData() const
+   {
+      return mpData;
+   }
+
+   size_t GetSize() const
+   {
+      return mSize;
+   }
+
+private:
+   uint8_t const* mpData{ nullptr };
+   size_t mSize{ 0 };
+};
+
+//-------------------------------------------------------------------------
+
+class CRenderScene
+{
+public:
+   explicit CRenderScene( TRenderObjects const& renderObjects )
+      : mCamera( CCamera::DefaultCamera() )
+   {
+      mObjects.reserve( renderObjects.size() );
+      for (CRenderObject* const object : renderObjects)
+      {
+mObjects.push_back( CRenderObject::TPtr( object ) );
+      }
+   }
+
+   explicit CRenderScene()
+      : mCamera( CCamera::DefaultCamera() )
+   {
+   }
+
+   CRenderScene& operator+=( CObjectContainer const& containerObject )
+   {
+      for (TAnimation const& animation : containerObject.GetAnimations())
+      {
+         mAnimations.push_back( SAnimation{ animation, static_cast<uint32_t>(mObjects.size()) } );
+      }
+      mObjects.push_back( containerObject.RenderObject() );
+      mUseProgram = false;
+      mBounds.clear();
+      return *this;
+   }
+
+   CRenderScene& operator+=( CLightObjectContainer const& containerObject )
+   {
+      for (TAnimation const& animation : containerObject.GetAnimations())
+      {
+         mAnimations.push_back( SAnimation{ animation, skNoObject } );
+      }
+      mLights.push_back( CLightObject::TConstPtr( containerObject.GetLightObject() ) );
+      return *this;
+   }
+
+   void AddObject( CRenderObject* pRenderObject )
+   {
+      mObjects.push_back( CRenderObject::TPtr( pRenderObject ) );
+      mUseProgram = false;
+      mBounds.clear();
+   }
+
+   // flattens the objects into instructions, gathers their bounds and folds the
+   // transforms that the colors use, call this after all of the objects have been
+   // added. Until then the object tree is used for the distances.
+   void Compile()
+   {
+      mProgram.Clear();
+      mBounds.clear();
+      for (CRenderObject::TPtr const& pObject : mObjects)
+      {
+         pObject->FoldTransforms( CTransform4f::Identity() );
+
+         mProgram.BeginObject();
+         pObject->CompileTransformed( mProgram, CTransform4f::Identity() );
+         mProgram.EndObject();
+
+#if USE_BOUNDING_VOLUMES()
+         mBounds.push_back( pObject->GetTransformedBounds() );
+#endif
+      }
+      mUseProgram = mProgram.IsValid();
+      mHierarchy.Build( mBounds );
+   }
+
+   // Takes the place of Compile for a compiled scene, see NCompiledScene::Load. The
+   // objects have already been added from their records, and the program has been
+   // attached to the tables of the file, which the scene keeps mapped.
+   void UseCompiled( std::unique_ptr< CMappedFile const > pFile, CSdfProgram const& program, SBoundingSphere const* const pBounds, uint32_t const boundsCount )
+   {
+      for (CRenderObject::TPtr const& pObject : mObjects)
+      {
+         pObject->FoldTransforms( CTransform4f::Identity() );
+      }
+
+      mpCompiledFile = std::move( pFile );
+      mProgram = program;
+      mUseProgram = mProgram.IsValid();
+      mBounds.assign( pBounds, pBounds + boundsCount );
+      mHierarchy.Build( mBounds );
+   }
+
+   // Sets the animated values of the scene to the ones at the time. The objects
+   // that they are in are compiled again over their old instructions and the
+   // hierarchy is refit around their new bounds, everything else is kept. Only
+   // when an object compiles to different instructions is the whole scene
+   // compiled again.
+   void Animate( real32 const time )
+   {
+      for (SAnimation const& animation : mAnimations)
+      {
+         animation.mAnimation( time );
+      }
+
+      // objects that haven't been compiled yet get their values in Compile
+      if (mProgram.GetObjectCount() != mObjects.size())
+      {
+         return;
+      }
+
+      bool refit = false;
+      uint32_t lastObject = skNoObject;
+      for (SAnimation const& animation : mAnimations)
+      {
+         // the animations of an object are next to each other
+         if (animation.mObject == skNoObject || animation.mObject == lastObject)
+         {
+            continue;
+         }
+         lastObject = animation.mObject;
+
+         CRenderObject& object = *mObjects[lastObject];
+         object.FoldTransforms( CTransform4f::Identity() );
+         if (!mProgram.Recompile( lastObject, object ))
+         {
+            Compile();
+            return;
+         }
+
+#if USE_BOUNDING_VOLUMES()
+         mBounds[lastObject] = object.GetTransformedBounds();
+         refit = true;
+#endif
+      }
+
+      if (refit && !mHierarchy.Refit( mBounds ))
+      {
+         mHierarchy.Build( mBounds );
+      }
+   }
+
+   // Finds the objects for every skTileSize tile of the screen, call this after
+   // Compile and SetSceneSize.
+   //
+   // The bounds of every object are projected onto the screen, and the object goes
+   // into the list of each tile that the rectangle around them overlaps.
+   //
+   // With pruning the view frustum of a tile is cut into slices along the rays, and
+   // the distances of the objects of the tile are bounded over each slice with
+   // interval arithmetic. Objects that have no surface in any slice are left out,
+   // and so are the csg children that can't change the surface of their object.
+   void BuildTiles( uint32_t const width, uint32_t const height, bool const cull, bool const prune )
+   {
+      mPrunedTiles = prune && mUseProgram;
+      if (!cull && !mPrunedTiles)
+      {
+         mTiles.clear();
+         return;
+      }
+
+      mTileColumns = (width + skTileSize - 1) / skTileSize;
+      uint32_t const tileRows = (height + skTileSize - 1) / skTileSize;
+      mTiles.resize( static_cast<size_t>(mTileColumns) * tileRows );
+      for (SSceneTile& tile : mTiles)
+      {
+         tile.mObjects.clear();
+         tile.mProgram.Clear();
+      }
+
+      CVector3f const origin = mCamera.GetCameraTransform().GetTranslation();
+
+      for (uint32_t index = 0; index < mObjects.size(); ++index)
+      {
+         uint32_t minColumn = 0;
+         uint32_t minRow = 0;
+         uint32_t maxColumn = mTileColumns - 1;
+         uint32_t maxRow = tileRows - 1;
+
+         if (cull && !mBounds.empty())
+         {
+            // objects past the end of the rays can't be hit either
+            real32 minX = 0.f, minY = 0.f, maxX = 0.f, maxY = 0.f;
+            if (mBounds[index].GetDistanceToPoint( origin ) >= skMaxLength || !mCamera.GetScreenBounds( mBounds[index], minX, minY, maxX, maxY ))
+            {
+               continue;
+            }
+
+            // The rays go through the pixel positions, a pixel more is added for
+            // rays that only come close enough to count as a hit
+            minX = NMath::max_val( minX - 1.f, 0.f );
+            minY = NMath::max_val( minY - 1.f, 0.f );
+            maxX = maxX + 1.f;
+            maxY = maxY + 1.f;
+            if (minX >= width || minY >= height || maxX < 0.f || maxY < 0.f)
+            {
+               continue;
+            }
+
+            minColumn = static_cast<uint32_t>(minX) / skTileSize;
+            minRow = static_cast<uint32_t>(minY) / skTileSize;
+            maxColumn = NMath::min_val( maxColumn, static_cast<uint32_t>(NMath::min_val( maxX, static_cast<real32>(width) )) / skTileSize );
+            maxRow = NMath::min_val( maxRow, static_cast<uint32_t>(NMath::min_val( maxY, static_cast<real32>(height) )) / skTileSize );
+         }
+
+         for (uint32_t row = minRow; row <= maxRow; ++row)
+         {
+            for (uint32_t column = minColumn; column <= maxColumn; ++column)
+            {
+               mTiles[row * mTileColumns + column].mObjects.push_back( index );
+            }
+         }
+      }
+
+      if (!mPrunedTiles)
+      {
+         return;
+      }
+
+      std::vector< CVector3f > corners( skTileSlices * CSdfProgram::skRegionCorners, origin );
+      // the hit distance of the far end of the slices is the largest one of the rays
+      real32 const hitDistance = GetHitDistance( skMaxLength );
+      std::vector< uint32_t > tileObjects;
+
+      for (uint32_t row = 0; row < tileRows; ++row)
+      {
+         for (uint32_t column = 0; column < mTileColumns; ++column)
+         {
+            SSceneTile& tile = mTiles[row * mTileColumns + column];
+            tileObjects.swap( tile.mObjects );
+            tile.mObjects.clear();
+
+            // the rays of the pixels in the corners, every ray of the tile is between them
+            real32 const minX = static_cast<real32>(column * skTileSize);
+            real32 const minY = static_cast<real32>(row * skTileSize);
+            real32 const maxX = static_cast<real32>(NMath::min_val( (column + 1) * skTileSize, width ) - 1);
+            real32 const maxY = static_cast<real32>(NMath::min_val( (row + 1) * skTileSize, height ) - 1);
+            CVector3f const directions[4] = {
+               mCamera.GetDirectionForPosition( minX, minY ), mCamera.GetDirectionForPosition( maxX, minY ),
+               mCamera.GetDirectionForPosition( minX, maxY ), mCamera.GetDirectionForPosition( maxX, maxY ) };
+
+            real32 maxDirectionLength = 1.f;
+            for (CVector3f const& direction : directions)
+            {
+               maxDirectionLength = NMath::max_val( maxDirectionLength, direction.Magnitude() );
+            }
+
+            // A ray is time / length along its direction at a time, so a slice
+            // goes from the near time along the longest direction to the far
+            // time along the shortest one
+            for (uint32_t slice = 0; slice < skTileSlices; ++slice)
+            {
+               real32 const nearTime = skMaxLength * slice / skTileSlices;
+               real32 const farTime = skMaxLength * (slice + 1) / skTileSlices;
+               CVector3f* const pSliceCorners = corners.data() + slice * CSdfProgram::skRegionCorners;
+               for (uint32_t corner = 0; corner < 4; ++corner)
+               {
+                  pSliceCorners[corner] = origin + directions[corner] * (nearTime / maxDirectionLength);
+                  pSliceCorners[corner + 4] = origin + directions[corner] * farTime;
+               }
+            }
+
+            for (uint32_t const index : tileObjects)
+            {
+               if (mProgram.CopyPruned( index, corners.data(), skTileSlices, hitDistance, tile.mProgram ))
+               {
+                  tile.mObjects.push_back( index );
+               }
+            }
+         }
+      }
+   }
+
+   // the tile of a pixel, or nullptr when the scene hasn't been split into tiles
+   SSceneTile const* GetTile( uint32_t const x, uint32_t const y ) const
+   {
+      return mTiles.empty() ? nullptr : &mTiles[(y / skTileSize) * mTileColumns + x / skTileSize];
+   }
+
+   // see CRelaxedStepper, this is kept when the scene is reset
+   void SetRelaxation( real32 const relaxation )
+   {
+      mRelaxation = relaxation;
+   }
+
+   real32 GetRelaxation() const
+   {
+      return mRelaxation;
+   }
+
+   CRenderScene& operator<<( CCamera const& camera )
+   {
+      mCamera = camera;
+      return *this;
+   }
+
+   CRenderScene& operator<<( CTransform4f const& cameraTransform )
+   {
+      mCamera.SetCameraTransform( cameraTransform );
+      return *this;
+   }
+
+   CRenderScene& operator*( CTransform4f const& cameraTransform )
+   {
+      mCamera.SetCameraTransform( cameraTransform * mCamera.GetCameraTransform() );
+      return *this;
+   }
+
+   void SetCamera( CCamera const& camera )
+   {
+      mCamera = camera;
+   }
+
+   CCamera const& GetCamera() const
+   {
+      return mCamera;
+   }
+
+   std::vector< CRenderObject::TPtr > const& GetObjects() const
+   {
+      return mObjects;
+   }
+
+   std::vector< CLightObject::TConstPtr > const& GetLights() const
+   {
+      return mLights;
+   }
+
+   // the program is only used for the distances when it could be compiled
+   CSdfProgram const* GetProgram() const
+   {
+      return mUseProgram ? &mProgram : nullptr;
+   }
+
+   std::vector< SBoundingSphere > const& GetBounds() const
+   {
+      return mBounds;
+   }
+
+   // the objects of the scene are allocated from this, see NScene::BuildScene
+   CSceneArena& GetArena()
+   {
+      return mArena;
+   }
+
+
+   void SetSceneSize( uint32_t const width, uint32_t const height )
+   {
+      mCamera.SetSceneSize( width, height );
+   }
+
+   // startTime is how far along the ray that nothing can be hit, see MarchCone, and
+   // guessTime is a depth to start at if it can be validated, see ValidateStartTime.
+   // hitTime is where the ray hit a surface or skLargeNumber when it didn't.
+   CColor4f DoIntersection( uint32_t const x, uint32_t const y, real32 const startTime, real32 const guessTime, real32& hitTime ) const
+   {
+      CInfiniteRay const infiniteRay = mCamera.GetRayForPosition( x, y );
+      RENDER_STAT_ADD( mPrimaryRays, 1 );
+      SSceneTile const* const pTile = GetTile( x, y );
+      CRayResult const result = MarchRay( infiniteRay, skMaxLength, ValidateStartTime( infiniteRay, startTime, guessTime, pTile ), 0.f, pTile );
+      hitTime = result.mHit ? result.mTime : skLargeNumber;
+      return ShadeRayResult( infiniteRay, result, skPrimaryRayDepth, 0.f );
+   }
+
+   // shades a pixel of a packet after MarchRayPacket
+   CColor4f DoPacketIntersection( SRayPacket const& packet, uint32_t const lane ) const
+   {
+      CInfiniteRay const infiniteRay = mCamera.GetRayForPosition( packet.mX[lane], packet.mY );
+      RENDER_STAT_ADD( mPrimaryRays, 1 );
+
+      CVector3f const collisionPoint = packet.mHit[lane] ? infiniteRay.GetPositionAlongRay( packet.mTime[lane] ) : CVector3f::Zero();
+      return ShadeRayResult( infiniteRay, CRayResult( collisionPoint, packet.mTime[lane], packet.mHit[lane], packet.mSteps[lane], packet.mpObject[lane] ), skPrimaryRayDepth, 0.f );
+   }
+
+   //----------------------------------------------------------------------------
+
+   // rayDistance is how far the start of the ray is from the camera along the rays before it
+   CColor4f DoIntersection( CInfiniteRay const& infiniteRay, int32_t const depth, real32 const rayDistance ) const
+   {
+      if (depth == 0)
+      {
+         return CColor4f::Black();
+      }
+
+      return ShadeRayResult( infiniteRay, MarchRay( infiniteRay, skMaxLength, skMinLength, rayDistance ), depth, rayDistance );
+   }
+
+   CColor4f ShadeRayResult( CInfiniteRay const& infiniteRay, CRayResult const& result, int32_t const depth, real32 const rayDistance ) const
+   {
+      if (depth == skPrimaryRayDepth)
+      {
+         RENDER_STAT_ADD( mPrimarySteps, result.mSteps );
+      }
+      else
+      {
+         RENDER_STAT_ADD( mReflectionSteps, result.mSteps );
+      }
+
+      if (result.mHit)
+      {
+         CRenderObject const* const pRenderObject = result.mpObject;
+         if (pRenderObject != nullptr)
+         {
+            return CalculateSurfaceColor( pRenderObject, infiniteRay.GetDirection(), result.mCollisionPoint, depth, rayDistance + result.mTime );
+         }
+      }
+#if DRAW_OBJECT_OUTLINE()
+      else
+      {
+         if (result.mTime < 0.05f)
+         {
+            return CColor4f::Lerp( CColor4f::White(), skBackgroundColor, result.mTime * 20.f);
+         }
+      }
+#endif
+
+      return skBackgroundColor;
+   }
+
+   //----------------------------------------------------------------------------
+
+   // collisionDistance is how far the rays travelled from the camera to the collision point
+   CColor4f CalculateSurfaceColor( CRenderObject const* const pRenderObject, CVector3f const & viewDirection, CVector3f const& collisionPoint, int32_t const depth, real32 const collisionDistance ) const
+   {
+      CColor4f color = CColor4f::Black();
+
+      real32 const hitDistance = GetHitDistance( collisionDistance );
+      CVector3f const normal = GetNormalAtPoint( pRenderObject, collisionPoint, NMath::min_val( hitDistance * skNormalEpsilon, skMaxNormalEpsilon ) );
+
+
+      CColor4f const surfaceColor = pRenderObject->GetWorldColorAtPoint( collisionPoint );
+
+      // get the start of the ray off of the surface just a little bit
+      CVector3f const startPoint = collisionPoint + normal * NMath::min_val( hitDistance * skSurfaceOffset, skMaxSurfaceOffset );
+
+      SSurfaceInfo const surfaceInfo = pRenderObject->GetSurfaceInfo();
+
+      if (!NMath::small_enough( surfaceInfo.dielectric ) || !NMath::small_enough( surfaceInfo.metallic ))
+      {
+         CVector3f const reflection = viewDirection - normal * 2.f * CVector3f::Dot( viewDirection, normal );
+         RENDER_STAT_ADD( mReflectionRays, 1 );
+         CColor4f const reflectedColor = DoIntersection( CInfiniteRay( startPoint, reflection ), depth - 1, collisionDistance );
+
+         color += reflectedColor * surfaceColor * surfaceInfo.metallic;
+         color += reflectedColor * surfaceInfo.dielectric;
+      }
+
+      // for each light do a light check
+      for (CLightObject::TConstPtr const& pLight : mLights)
+      {
+         CVector3f toLight = pLight->GetPosition() - collisionPoint;
+         real32 const distance = toLight.Magnitude();
+         toLight = toLight / distance;
+
+         if (pLight->CastsShadow())
+         {
+            CShadowCastingLightObject const& shadowLight = static_cast<CShadowCastingLightObject const&>(*pLight);
+            
+            RENDER_STAT_ADD( mShadowRays, 1 );
+            real32 const shadow = MarchShadowRay( CInfiniteRay( startPoint, toLight ), distance, shadowLight.GetPenumbra(), hitDistance );
+
+            if (shadow > 0.f)
+            {
+               SAttenuationInfo const attenuationInfo = shadowLight.GetAttenuationInfo();
+               real32 const attenuationFactor = 1.f / (
+                  attenuationInfo.constant +
+                  attenuationInfo.linear * distance +
+                  attenuationInfo.exponential * distance * distance
+                  );
+                                                
+                   
+               color += pLight->CalculateValueAtPosition( collisionPoint, normal ) * surfaceColor 
+                  * (shadow * surfaceInfo.albedo * attenuationFactor);
+            }
+         }
+         else
+         {
+            color += pLight->CalculateValueAtPosition( collisionPoint, normal ) * 
+               ( surfaceColor * surfaceInfo.albedo );
+         }
+      }
+      return color;
+   }
+
+   //----------------------------------------------------------------------------
+   // This is the marching ray code
+
+   // A ray hits a surface when it is closer than this, distance is how far the
+   // point is from the camera along the rays that led to it
+   real32 GetHitDistance( real32 const distance ) const
+   {
+      return NMath::min_val( skMaxHitDistance, NMath::max_val( skMinLength, distance * mCamera.GetCameraScale() * skPixelFootprint ) );
+   }
+
+   // a primary ray only has to look at the objects of the tile that its pixel is in
+   CRayResult MarchRay( CInfiniteRay const& ray, real32 const maxLength, real32 const startTime = skMinLength, real32 const rayDistance = 0.f, SSceneTile const* const pTile = nullptr ) const
+   {
+      real32 time = startTime;
+
+      int32_t count = 0;
+      real32 minDistance = skLargeNumber;
+      CRelaxedStepper stepper( mRelaxation );
+
+      while (time < maxLength  )
+      {
+         CVector3f const currentPoint = ray.GetPositionAlongRay( time );
+         uint32_t closestObject = skNoObject;
+         real32 const distanceToNearestObject = GetMinDistanceAtPoint( currentPoint, closestObject, pTile );
+         ++count;
+         minDistance = NMath::min_val( minDistance, distanceToNearestObject );
+         bool const overshot = stepper.Overshot( distanceToNearestObject );
+
+         if ( (!overshot && fabsf(distanceToNearestObject) < GetHitDistance( rayDistance + time )) || count > skMaxMarchSteps)
+         {
+            return CRayResult( currentPoint, time, true, count, GetObject( closestObject ) );
+         }
+
+         time += stepper.NextStep( distanceToNearestObject, overshot );
+      }
+      return CRayResult(CVector3f::Zero(), minDistance, false, count, nullptr );
+   }
+
+   //----------------------------------------------------------------------------
+   // Marches the primary rays of a packet together. Every ray takes the same
+   // steps as it would in MarchRay, the rays that are done are masked off.
+   // All of the pixels of a packet have to be in the same tile.
+
+   void MarchRayPacket( SRayPacket& packet ) const
+   {
+      uint32_t constexpr skWidth = SPointPacket::skWidth;
+      SSceneTile const* const pTile = GetTile( packet.mX[0], packet.mY );
+
+#if USE_RAY_PACKETS()
+      if (!mUseProgram)
+#endif
+      {
+         for (uint32_t lane = 0; lane < packet.mCount; ++lane)
+         {
+            CInfiniteRay const ray = mCamera.GetRayForPosition( packet.mX[lane], packet.mY );
+#if USE_TEMPORAL_REPROJECTION()
+            CRayResult const result = MarchRay( ray, skMaxLength, ValidateStartTime( ray, packet.mTime[lane], packet.mGuessTime[lane], pTile ), 0.f, pTile );
+#else
+            CRayResult const result = MarchRay( ray, skMaxLength, packet.mTime[lane], 0.f, pTile );
+#endif
+            packet.mTime[lane] = result.mTime;
+            packet.mSteps[lane] = result.mSteps;
+            packet.mHit[lane] = result.mHit;
+            packet.mpObject[lane] = result.mpObject;
+         }
+         return;
+      }
+
+      SPointPacket points{};
+      real32 positionX[skWidth], positionY[skWidth], positionZ[skWidth];
+      real32 directionX[skWidth], directionY[skWidth], directionZ[skWidth];
+      real32 minDistance[skWidth];
+      alignas(32) real32 distances[skWidth];
+      uint32_t closestObjects[skWidth];
+      CRelaxedStepper steppers[skWidth];
+      uint32_t activeMask = 0;
+#if USE_TEMPORAL_REPROJECTION()
+      // the first distance of these lanes is found half way to the guess, see ValidateStartTime
+      uint32_t guessMask = 0;
+#endif
+
+      for (uint32_t lane = 0; lane < packet.mCount; ++lane)
+      {
+         CInfiniteRay const ray = mCamera.GetRayForPosition( packet.mX[lane], packet.mY );
+         positionX[lane] = ray.GetPosition().GetX();
+         positionY[lane] = ray.GetPosition().GetY();
+         positionZ[lane] = ray.GetPosition().GetZ();
+         directionX[lane] = ray.GetDirection().GetX();
+         directionY[lane] = ray.GetDirection().GetY();
+         directionZ[lane] = ray.GetDirection().GetZ();
+
+         packet.mSteps[lane] = 0;
+         packet.mHit[lane] = false;
+         packet.mpObject[lane] = nullptr;
+         minDistance[lane] = skLargeNumber;
+         steppers[lane] = CRelaxedStepper( mRelaxation );
+         activeMask |= 1u << lane;
+#if USE_TEMPORAL_REPROJECTION()
+         if (packet.mGuessTime[lane] > packet.mTime[lane] && packet.mGuessTime[lane] < skMaxLength)
+         {
+            guessMask |= 1u << lane;
+         }
+#endif
+      }
+
+      while (activeMask != 0)
+      {
+         for (uint32_t lane = 0; lane < skWidth; ++lane)
+         {
+            if ((activeMask & (1u << lane)) == 0)
+            {
+               continue;
+            }
+
+#if USE_TEMPORAL_REPROJECTION()
+            real32 const time = (guessMask & (1u << lane)) ? (packet.mTime[lane] + packet.mGuessTime[lane]) * 0.5f : packet.mTime[lane];
+#else
+            real32 const time = packet.mTime[lane];
+#endif
+            if (!(time < skMaxLength))
+            {
+               // missed everything
+               packet.mTime[lane] = minDistance[lane];
+               activeMask &= ~(1u << lane);
+               continue;
+            }
+
+            points.mX[lane] = positionX[lane] + directionX[lane] * time;
+            points.mY[lane] = positionY[lane] + directionY[lane] * time;
+            points.mZ[lane] = positionZ[lane] + directionZ[lane] * time;
+            distances[lane] = skLargeNumber;
+            closestObjects[lane] = skNoObject;
+         }
+
+         if (activeMask == 0)
+         {
+            break;
+         }
+
+         // evaluates an object exactly and keeps track of which object is the closest,
+         // programIndex is the index of the object in the program
+         auto const evaluateObject = [&]( CSdfProgram const& program, uint32_t const programIndex, uint32_t const index, uint32_t const mask )
+         {
+            real32 previousDistances[skWidth];
+            std::copy( distances, distances + skWidth, previousDistances );
+            program.EvaluatePacket( programIndex, points, mask, distances );
+
+            for (uint32_t lane = 0; lane < skWidth; ++lane)
+            {
+               if ((mask & (1u << lane)) && distances[lane] < previousDistances[lane])
+               {
+                  closestObjects[lane] = index;
+               }
+            }
+         };
+
+         // the same choices as GetMinDistanceAtPoint for every point
+         auto const visitObject = [&]( CSdfProgram const& program, uint32_t const programIndex, uint32_t const index, uint32_t const laneMask, real32 const* const pBoundsDistances )
+         {
+            uint32_t exactMask = 0;
+            for (uint32_t lane = 0; lane < skWidth; ++lane)
+            {
+               if ((laneMask & (1u << lane)) == 0)
+               {
+                  continue;
+               }
+
+               if (pBoundsDistances[lane] > skBoundsMargin)
+               {
+                  distances[lane] = pBoundsDistances[lane];
+                  closestObjects[lane] = index;
+               }
+               else
+               {
+                  exactMask |= 1u << lane;
+               }
+            }
+
+            if (exactMask != 0)
+            {
+               evaluateObject( program, programIndex, index, exactMask );
+            }
+         };
+
+         RENDER_STAT_ADD( mDistanceEvaluations, std::popcount( activeMask ) );
+         if (pTile != nullptr)
+         {
+            // the objects of a tile are few enough to check all of their bounds
+            CSdfProgram const& program = mPrunedTiles ? pTile->mProgram : mProgram;
+            for (uint32_t tileIndex = 0; tileIndex < pTile->mObjects.size(); ++tileIndex)
+            {
+               uint32_t const index = pTile->mObjects[tileIndex];
+               uint32_t const programIndex = mPrunedTiles ? tileIndex : index;
+               if (mBounds.empty())
+               {
+                  evaluateObject( program, programIndex, index, activeMask );
+                  continue;
+               }
+
+               real32 boundsDistances[skWidth];
+               uint32_t mask = 0;
+               for (uint32_t lane = 0; lane < skWidth; ++lane)
+               {
+                  if (activeMask & (1u << lane))
+                  {
+                     boundsDistances[lane] = mBounds[index].GetDistanceToPoint( CVector3f( points.mX[lane], points.mY[lane], points.mZ[lane] ) );
+                     mask |= boundsDistances[lane] < distances[lane] ? (1u << lane) : 0;
+                  }
+               }
+
+               if (mask != 0)
+               {
+                  visitObject( program, programIndex, index, mask, boundsDistances );
+               }
+            }
+         }
+         else if (mBounds.empty())
+         {
+            for (uint32_t index = 0; index < mObjects.size(); ++index)
+            {
+               evaluateObject( mProgram, index, index, activeMask );
+            }
+         }
+         else
+         {
+            mHierarchy.VisitObjects( points, activeMask, distances, [&]( uint32_t const index, uint32_t const laneMask, real32 const* const pBoundsDistances )
+            {
+               visitObject( mProgram, index, index, laneMask, pBoundsDistances );
+            } );
+         }
+
+         for (uint32_t lane = 0; lane < skWidth; ++lane)
+         {
+            if ((activeMask & (1u << lane)) == 0)
+            {
+               continue;
+            }
+
+            real32 const distanceToNearestObject = distances[lane];
+            ++packet.mSteps[lane];
+
+#if USE_TEMPORAL_REPROJECTION()
+            if (guessMask & (1u << lane))
+            {
+               guessMask &= ~(1u << lane);
+               if (distanceToNearestObject >= (packet.mGuessTime[lane] - packet.mTime[lane]) * 0.5f)
+               {
+                  RENDER_STAT_ADD( mReprojectedRays, 1 );
+                  packet.mTime[lane] = packet.mGuessTime[lane];
+               }
+               else
+               {
+                  RENDER_STAT_ADD( mReprojectionFailures, 1 );
+               }
+               continue;
+            }
+#endif
+
+            minDistance[lane] = NMath::min_val( minDistance[lane], distanceToNearestObject );
+            bool const overshot = steppers[lane].Overshot( distanceToNearestObject );
+
+            if ((!overshot && fabsf( distanceToNearestObject ) < GetHitDistance( packet.mTime[lane] )) || packet.mSteps[lane] > skMaxMarchSteps)
+            {
+               packet.mHit[lane] = true;
+               packet.mpObject[lane] = GetObject( closestObjects[lane] );
+               activeMask &= ~(1u << lane);
+               continue;
+            }
+
+            packet.mTime[lane] += steppers[lane].NextStep( distanceToNearestObject, overshot );
+         }
+      }
+   }
+
+   //----------------------------------------------------------------------------
+   // Marches a cone that contains the primary rays of a block of pixels and
+   // returns how far the rays can skip. The sphere around a point on the axis
+   // has to cover the whole width of the cone, so the cone stops a bit before
+   // the first surface that any of its rays could hit.
+   // See: http://www.fulcrum-demo.org/wp-content/uploads/2012/04/Cone_Marching_Mandelbox_by_Seven_Fulcrum_LongVersion.pdf
+
+   real32 MarchCone( uint32_t const x, uint32_t const y, uint32_t const blockSize ) const
+   {
+      real32 const center = (blockSize - 1) * 0.5f;
+      CInfiniteRay const ray = mCamera.GetRayForPosition( x + center, y + center );
+
+      // the angle between the axis and the ray through a corner pixel, a little too
+      // big because the angle is never more than its tangent
+      real32 const slope = blockSize * 0.5f * sqrtf( 2.f ) * mCamera.GetCameraScale();
+
+      // the block is inside of one tile
+      SSceneTile const* const pTile = GetTile( x, y );
+
+      real32 time = skMinLength;
+      int32_t count = 0;
+
+      while (time < skMaxLength && count++ < skMaxMarchSteps)
+      {
+         real32 const distanceToNearestObject = GetMinDistanceAtPoint( ray.GetPositionAlongRay( time ), pTile );
+         real32 const coneRadius = time * slope;
+         if (distanceToNearestObject <= coneRadius + skMinLength)
+         {
+            break;
+         }
+
+         // the points of the rays in the next step are never further from the
+         // axis than the step plus the radius of the cone at the end of it
+         time += (distanceToNearestObject - coneRadius) / (1.f + slope);
+      }
+
+      RENDER_STAT_ADD( mConeSteps, count );
+      return NMath::min_val( time, skMaxLength );
+   }
+
+   //----------------------------------------------------------------------------
+   // Returns where a primary ray can start. The guess is a depth that is expected
+   // to be just in front of a surface, it can only be used when nothing is between
+   // it and the start time. That is the case when the empty sphere around the point
+   // half way between them reaches both ends, otherwise the start time is used.
+   // MarchRayPacket does the same thing with the first distance of each ray.
+
+   real32 ValidateStartTime( CInfiniteRay const& ray, real32 const startTime, real32 const guessTime, SSceneTile const* const pTile ) const
+   {
+      if (!(guessTime > startTime && guessTime < skMaxLength))
+      {
+         return startTime;
+      }
+
+      real32 const distanceToNearestObject = GetMinDistanceAtPoint( ray.GetPositionAlongRay( (startTime + guessTime) * 0.5f ), pTile );
+      if (distanceToNearestObject >= (guessTime - startTime) * 0.5f)
+      {
+         RENDER_STAT_ADD( mReprojectedRays, 1 );
+         return guessTime;
+      }
+
+      RENDER_STAT_ADD( mReprojectionFailures, 1 );
+      return startTime;
+   }
+
+   //----------------------------------------------------------------------------
+   // Calculate the shadow amount
+   // See: https://iquilezles.org/www/articles/rmshadows/rmshadows.htm
+
+   // hitDistance is the hit distance of the surface that the ray starts at
+   real32 MarchShadowRay( CInfiniteRay const& ray, real32 const maxLength, real32 const penumbra, real32 const hitDistance ) const
+   {
+#if 1
+      real32 shadow = 1.f;
+      real32 time = 0.f;
+      int32_t count = 0;
+
+      while (time < maxLength )
+      {
+         CVector3f const currentPoint = ray.GetPositionAlongRay( time );
+         real32 const distanceToNearestObject = GetMinDistanceAtPoint( currentPoint );
+         ++count;
+
+         if (distanceToNearestObject < hitDistance )
+         {
+            RENDER_STAT_ADD( mShadowSteps, count );
+            return 0.f;
+         }
+
+         shadow = NMath::min_val( shadow, penumbra * distanceToNearestObject / time );
+
+         time += distanceToNearestObject;
+      }
+      RENDER_STAT_ADD( mShadowSteps, count );
+      return shadow;
+#else
+      real32 shadow = 1.f;
+      real32 ph = skLargeNumber;
+
+      real32 time = skMinLength * 2.f;
+
+      int32_t count = 0;
+      while (time < maxLength && count++ < 25)
+      {
+         CVector3f const currentPoint = ray.GetPositionAlongRay( time );
+         real32 const distanceToNearestObject = GetMinDistanceAtPoint( currentPoint );
+
+         if (distanceToNearestObject < 0.f)
+         {
+            return 0.f;
+         }
+
+         real32 const y = distanceToNearestObject * distanceToNearestObject / (2.f * ph);
+         real32 const d = sqrtf( distanceToNearestObject * distanceToNearestObject - y * y );
+         shadow = NMath::min_val( shadow, penumbra * d / NMath::max_val( 0.f, time - y ) );
+         ph = distanceToNearestObject;
+         time += distanceToNearestObject;
+      }
+
+      return shadow;
+#endif
+   }
+
+   //----------------------------------------------------------------------------
+
+   CVector3f GetNormalAtPoint( CRenderObject const* const pRenderObject, CVector3f const& point, real32 const epsilon ) const
+   {
+#if USE_ANALYTIC_NORMALS()
+      CVector3f gradient = CVector3f::Zero();
+      pRenderObject->GetTransformedDistanceAndGradient( point, epsilon, gradient );
+
+      real32 const length = gradient.Magnitude();
+      if (length > skSmallNumber)
+      {
+         return gradient / length;
+      }
+#else
+      UNREFERENCED_PARAMETER( pRenderObject );
+#endif
+      return GetNormalAtPoint( point, epsilon );
+   }
+
+   CVector3f GetNormalAtPoint( CVector3f const& point, real32 const epsilon ) const
+   {
+#if 1
+      return
+      // look at the gradient in the local area
+      CVector3f( GetMinDistanceAtPoint( point + CVector3f( epsilon, 0.f, 0.f ) ) - GetMinDistanceAtPoint( point - CVector3f( epsilon, 0.f, 0.f ) ),
+                 GetMinDistanceAtPoint( point + CVector3f( 0.f, epsilon, 0.f ) ) - GetMinDistanceAtPoint( point - CVector3f( 0.f, epsilon, 0.f ) ),
+                 GetMinDistanceAtPoint( point + CVector3f( 0.f, 0.f, epsilon ) ) - GetMinDistanceAtPoint( point - CVector3f( 0.f, 0.f, epsilon ) ) ).AsNormalized();
+#else
+
+      CVector3f const e0( 1.f, -1.f, -1.f );
+      CVector3f const e1( -1.f, -1.f, 1.f );
+      CVector3f const e2( -1.f, 1.f, -1.f );
+      CVector3f const e3( 1.f, 1.f, 1.f );
+
+      return     
+         (e0 * GetMinDistanceAtPoint( point + e0 * epsilon )  +
+        e1 * GetMinDistanceAtPoint( point + e1 * epsilon ) +
+        e2 * GetMinDistanceAtPoint( point + e2 * epsilon ) +
+        e3 * GetMinDistanceAtPoint( point + e3 * epsilon)).AsNormalized();
+
+#endif
+   }
+
+   //----------------------------------------------------------------------------
+
+   // pTile is the tile of a primary ray, or nullptr for the whole scene
+   real32 GetMinDistanceAtPoint( CVector3f const& point, SSceneTile const* const pTile = nullptr ) const
+   {
+      uint32_t closestObject = skNoObject;
+      return GetMinDistanceAtPoint( point, closestObject, pTile );
+   }
+
+   // also returns the index of the object that the distance came from
+   real32 GetMinDistanceAtPoint( CVector3f const& point, uint32_t& closestObject, SSceneTile const* const pTile = nullptr ) const
+   {
+      RENDER_STAT_ADD( mDistanceEvaluations, 1 );
+
+      real32 time = skLargeNumber;
+
+      if (pTile != nullptr)
+      {
+         for (uint32_t tileIndex = 0; tileIndex < pTile->mObjects.size(); ++tileIndex)
+         {
+            uint32_t const index = pTile->mObjects[tileIndex];
+            real32 const boundsDistance = mBounds.empty() ? -skLargeNumber : mBounds[index].GetDistanceToPoint( point );
+            if (boundsDistance >= time)
+            {
+               continue;
+            }
+
+            real32 const distance = boundsDistance > skBoundsMargin ? boundsDistance :
+               (mPrunedTiles ? pTile->mProgram.Evaluate( tileIndex, point ) : GetObjectDistance( index, point ));
+            if (distance < time)
+            {
+               time = distance;
+               closestObject = index;
+            }
+         }
+         return time;
+      }
+
+      if (mBounds.empty())
+      {
+         for (uint32_t index = 0; index < mObjects.size(); ++index)
+         {
+            real32 const distance = GetObjectDistance( index, point );
+            if (distance < time)
+            {
+               time = distance;
+               closestObject = index;
+            }
+         }
+         return time;
+      }
+
+      // objects that are further away than the closest one so far are skipped,
+      // and an object that is far away enough only needs its bounds
+      mHierarchy.VisitObjects( point, time, [&]( uint32_t const index, real32 const boundsDistance )
+      {
+         real32 const distance = boundsDistance > skBoundsMargin ? boundsDistance : GetObjectDistance( index, point );
+         if (distance < time)
+         {
+            time = distance;
+            closestObject = index;
+         }
+      } );
+
+      return time;
+   }
+
+   real32 GetObjectDistance( uint32_t const index, CVector3f const& point ) const
+   {
+#if USE_COMPILED_SDF()
+      if (mUseProgram)
+      {
+         return mProgram.Evaluate( index, point );
+      }
+#endif
+      return mObjects[index]->GetTransformedDistanceToPoint( point );
+   }
+
+   // returns nullptr for skNoObject
+   CRenderObject const* GetObject( uint32_t const index ) const
+   {
+      return index < mObjects.size() ? mObjects[index].get() : nullptr;
+   }
+
+   // returns false when an object of the scene is still held somewhere else, its
+   // memory can't be used again so the arena grows instead
+   bool Reset()
+   {
+      mCamera = CCamera::DefaultCamera();
+      mAnimations.clear();
+      mObjects.clear();
+      mLights.clear();
+      mProgram.Clear();
+      mUseProgram = false;
+      mpCompiledFile.reset();
+      mBounds.clear();
+      mHierarchy.Clear();
+      mTiles.clear();
+      mPrunedTiles = false;
+
+      // every object has been released, so their memory can be used again
+      return mArena.Reset();
+   }
+
+private:
+   static uint32_t constexpr skNoObject = ~0u;
+
+   // mObject is the top level object that the value is in, or skNoObject for lights
+   struct SAnimation
+   {
+      TAnimation mAnimation;
+      uint32_t mObject;
+   };
+
+   // this is the first member so it goes away after all of the objects
+   CSceneArena mArena;
+   CCamera mCamera;
+   std::vector< SAnimation > mAnimations;
+   std::vector< CRenderObject::TPtr > mObjects;
+   std::vector< CLightObject::TConstPtr > mLights;
+   CSdfProgram mProgram;
+   bool mUseProgram = false;
+   // the file that the program of a compiled scene is in
+   std::unique_ptr< CMappedFile const > mpCompiledFile;
+   std::vector< SBoundingSphere > mBounds;
+   CObjectHierarchy mHierarchy;
+   std::vector< SSceneTile > mTiles;
+   uint32_t mTileColumns{ 0 };
+   bool mPrunedTiles{ false };
+   real32 mRelaxation{ skDefaultRelaxation };
+};
+
+//===================================================================================
+
+namespace NScene
+{
+   template<class TClassType>
+   class TMaterialContainer : public CMaterialContainer
+   {
+   public:
+      template<class... TArgs>
+      explicit TMaterialContainer( TArgs... args )
+         : CMaterialContainer( MakeSceneObject< TClassType >( args... ) )
+      {
+      }
+   };
+
+   template<class TClassType>
+   class TObjectContainer : public CObjectContainer
+   {
+   public:
+      template <class... TArgs>
+      explicit TObjectContainer( TArgs... args )
+         : CObjectContainer( MakeSceneObject< TClassType >( args... ) )
+      {
+      }
+      
+      template <class... TArgs>
+      TObjectContainer( std::initializer_list<CObjectContainer> const& objects, TArgs... args )
+         : TObjectContainer( TObjectContainers( objects ), args... )
+      {
+      }
+
+      template <class... TArgs>
+      TObjectContainer( TObjectContainers const& objects, TArgs... args )
+         : CObjectContainer( MakeSceneObject< TClassType >( objects, args... ) )
+      {
+         for (CObjectContainer const& object : objects)
+         {
+            AddAnimations( object.GetAnimations() );
+         }
+      }
+      
+   };
+
+   // the type of the function is deduced from the lambda, see TRenderCustom
+   template<class TFunction>
+   class custom : public CObjectContainer
+   {
+   public:
+      explicit custom( TFunction const& customFunction )
+         : CObjectContainer( MakeSceneObject< TRenderCustom<TFunction> >( customFunction ) )
+      {
+      }
+
+      explicit custom( TFunction const& customFunction, SBoundingSphere const& bounds )
+         : CObjectContainer( MakeSceneObject< TRenderCustom<TFunction> >( customFunction, bounds ) )
+      {
+      }
+   };
+
+   template<class TFunction>
+   class custom_material : public CMaterialContainer
+   {
+   public:
+      explicit custom_material( TFunction const& customFunction )
+         : CMaterialContainer( MakeSceneObject< TCustomMaterialObject<TFunction> >( customFunction ) )
+      {
+      }
+   };
+
+   template<class TClassType>
+   class TLightObjectContainer : public CLightObjectContainer
+   {
+   public:
+      template <class... TArgs>
+      explicit TLightObjectContainer( TArgs... args )
+         : CLightObjectContainer( MakeSceneObject< TClassType >( args... ) )
+      {
+      }
+
+      TLightObjectContainer& operator<<(SAttenuationInfo const& attenuation)
+      {
+         static_cast<TClassType&>(*LightObject()).SetAttenuationInfo(attenuation);
+         return *this;
+      }
+
+      TLightObjectContainer& operator<<(CTransform4f const& transform)
+      {
+         static_cast<TClassType&>(*LightObject()).SetTransform(transform);
+         return *this;
+      }
+
+      // a function that returns a transform animates the transform of the light,
+      // one that returns a vector animates its position
+      template<class TFunction>
+      TLightObjectContainer& operator<<(TAnimatedValue<TFunction> const& value)
+      {
+         TClassType* const pLightObject = static_cast<TClassType*>(LightObject().get());
+         TFunction const function = value.GetFunction();
+         if constexpr (std::is_same_v< decltype(function( 0.f )), CTransform4f >)
+         {
+            AddAnimation( [pLightObject, function]( real32 const time ) { pLightObject->SetTransform( function( time ) ); } );
+         }
+         else
+         {
+            AddAnimation( [pLightObject, function]( real32 const time ) { pLightObject->SetPosition( function( time ) ); } );
+         }
+         return *this;
+      }
+   };
+
+   // convenience types
+   using vector3 = CVector3f;
+   using color = CColor4f;
+
+   // camera
+   using camera = CCamera;
+
+   // materials
+   using surface = SSurfaceInfo;
+   using material = CMaterialContainer;
+   using checker = TMaterialContainer< CCheckerMaterialObject >;
+   using gradient = TMaterialContainer< CGradientMaterialObject >;
+
+   // objects
+   using object = CObjectContainer;
+   using bounds = SBoundingSphere;
+   using sphere = TObjectContainer<CRenderSphere>;
+   using plane = TObjectContainer<CRenderPlane>;
+   using cube = TObjectContainer<CRenderCube>;
+
+   // csg operations
+   using csg_union = TObjectContainer<CRenderUnion>;
+   using csg_intersection = TObjectContainer<CRenderIntersection>;
+   using csg_difference = TObjectContainer<CRenderDifference>;
+   using csg_smoothunion = TObjectContainer<CRenderSmoothUnion>;
+
+   using blend = TObjectContainer<CRenderBlend>;
+
+   // lights
+   using attenuation = SAttenuationInfo;
+   using ambientlight = TLightObjectContainer<CAmbientLightObject>;
+   using directionallight = TLightObjectContainer<CDirectionalLightObject>;
+   using pointlight = TLightObjectContainer<CPointLightObject>;
+   using spotlight = TLightObjectContainer<CSpotLightObject>;
+   
+
+   // convenience functions
+   CTransform4f translate( real32 const x, real32 const y, real32 const z ) { return CTransform4f::Translate( x, y, z ); }
+   CTransform4f translate( CVector3f const & translation ) { return CTransform4f::Translate( translation ); }
+   CTransform4f scale( real32 const x, real32 const y, real32 const z ) { return CTransform4f::Scale( x, y, z ); }
+   CTransform4f scale( CVector3f const& transformScale ) { return CTransform4f::Scale( transformScale ); }
+   CTransform4f scale( real32 const value ) { return CTransform4f::Scale( value, value, value ); }
+   CTransform4f rotatex( real32 const angle ) { return CTransform4f::RotateX( CRelAngle::FromDegrees( angle ) ); }
+   CTransform4f rotatey( real32 const angle ) { return CTransform4f::RotateY( CRelAngle::FromDegrees( angle ) ); }
+   CTransform4f rotatez( real32 const angle ) { return CTransform4f::RotateZ( CRelAngle::FromDegrees( angle ) ); }
+   CTransform4f rotate( real32 const x, real32 const y, real32 const z) 
+   { 
+      return
+         CTransform4f::RotateX( CRelAngle::FromDegrees( x ) ) *
+         CTransform4f::RotateY( CRelAngle::FromDegrees( y ) ) *
+         CTransform4f::RotateZ( CRelAngle::FromDegrees( z ) );
+   }
+
+   real32 length( CVector3f const& v ) { return v.Magnitude(); }
+   CVector3f normalize( CVector3f const& v ) { return v.AsNormalized(); }
+
+   real32 minf( real32 const lhs, real32 const rhs ) { return lhs < rhs ? lhs : rhs; }
+   real32 maxf( real32 const lhs, real32 const rhs ) { return lhs > rhs ? lhs : rhs; }
+   real32 round_mod( real32 const x, real32 const y ) { return x - y * roundf( x / y ); }
+   real32 mod( real32 const x, real32 const y ) { return x - y * floorf( x / y ); }
+   real32 clamp( real32 const minValue, real32 const value, real32 const maxValue ) { return NMath::clamp( minValue, value, maxValue ); }
+   CVector3f clamp( CVector3f const & minValue, CVector3f const value, CVector3f const & maxValue ) 
+   { return CVector3f( clamp( minValue.x, value.x, maxValue.x ), clamp( minValue.y, value.y, maxValue.y ), clamp( minValue.z, value.z, maxValue.z ) ); }
+
+   real32 dot( CVector3f const& lhs, CVector3f const& rhs ) { return CVector3f::Dot( lhs, rhs ); }
+   CVector3f cross( CVector3f const& lhs, CVector3f const& rhs ) { return CVector3f::Cross( lhs, rhs ); }
+
+   // a value that is found from the time of every frame, see CRenderScene::Animate
+   template<class TFunction>
+   TAnimatedValue<TFunction> animate( TFunction const& function ) { return TAnimatedValue<TFunction>( function ); }
+
+
+
+
+   void BuildScene( CRenderScene& scene, real32 const time )
+   {
+      UNREFERENCED_PARAMETER( time );
+      UNREFERENCED_PARAMETER( scene );
+
+      // the objects that are created by the scene come from its arena
+      tlpSceneArena = &scene.GetArena();
+
+#include "RenderScene.inl"
+
+      tlpSceneArena = nullptr;
+   }
+}
+
+//----------------------------------------------------------------------------------------
+//
+// Scene files describe the same scenes as RenderScene.inl without having to build
+// the program again. The renderer loads one with SetSceneFile and loads it again
+// whenever the file changes. Everything after a # is a comment.
+//
+// Every statement starts with a keyword, followed by its values and modifiers. A value
+// is a number, 0xRRGGBB for a color, or an expression in parentheses that can use
+// + - * /, sin cos abs sqrt floor, pi and time. Values that use time are animated,
+// see NScene::animate, so they are only allowed in transforms, blend factors and
+// light positions and transforms.
+//
+// camera position x y z lookat x y z [fov degrees] [vertical]
+//
+// ambientlight color r g b
+// directionallight direction x y z color r g b
+// pointlight position x y z color r g b [intensity scale] [attenuation constant linear exponential]
+// spotlight position x y z direction x y z angle degrees color r g b [intensity scale] [attenuation ...] [transforms]
+//
+// sphere radius | sphere x y z radius
+// plane x y z | plane x y z height
+// cube size | cube x y z
+// torus minorRadius majorRadius
+// union { objects }
+// intersection { objects }
+// difference { objects }
+// smoothunion k { objects }
+// blend factor { objects }
+//
+// The modifiers of an object:
+// translate x y z, scale s, scale x y z, rotate x y z, rotatex a, rotatey a, rotatez a
+//    the transforms are multiplied together in the order that they are written
+// color r g b, checker color color, gradient color color
+// albedo value, metallic value, dielectric value
+//
+//----------------------------------------------------------------------------------------
+
+namespace NSceneFile
+{
+   enum class ETokenType
+   {
+      Word,
+      Number,
+      Symbol,
+      End
+   };
+
+   struct SToken
+   {
+      ETokenType mType;
+      std::string mText;
+      real32 mNumber;
+      uint32_t mLine;
+   };
+
+   enum class EExpressionOp
+   {
+      Number,
+      Time,
+      Add,
+      Subtract,
+      Multiply,
+      Divide,
+      Negate,
+      Sin,
+      Cos,
+      Abs,
+      Sqrt,
+      Floor
+   };
+
+   // A value of a scene file. It is kept as a little stack program so that the
+   // values that use time can be found again every frame.
+   class CExpression
+   {
+   public:
+      void Add( EExpressionOp const op, real32 const number = 0.f )
+      {
+         mOps.push_back( SOp{ op, number } );
+         mUsesTime = mUsesTime || op == EExpressionOp::Time;
+      }
+
+      bool UsesTime() const
+      {
+         return mUsesTime;
+      }
+
+      real32 Evaluate( real32 const time ) const
+      {
+         real32 stack[skMaxStackDepth];
+         uint32_t top = 0;
+         for (SOp const& op : mOps)
+         {
+            switch (op.mOp)
+            {
+            case EExpressionOp::Number:
+               stack[top++] = op.mNumber;
+               break;
+            case EExpressionOp::Time:
+               stack[top++] = time;
+               break;
+            case EExpressionOp::Add:
+               --top;
+               stack[top - 1] = stack[top - 1] + stack[top];
+               break;
+            case EExpressionOp::Subtract:
+               --top;
+               stack[top - 1] = stack[top - 1] - stack[top];
+               break;
+            case EExpressionOp::Multiply:
+               --top;
+               stack[top - 1] = stack[top - 1] * stack[top];
+               break;
+            case EExpressionOp::Divide:
+               --top;
+               stack[top - 1] = stack[top - 1] / stack[top];
+               break;
+            case EExpressionOp::Negate:
+               stack[top - 1] = -stack[top - 1];
+               break;
+            case EExpressionOp::Sin:
+               stack[top - 1] = sinf( stack[top - 1] );
+               break;
+            case EExpressionOp::Cos:
+               stack[top - 1] = cosf( stack[top - 1] );
+               break;
+            case EExpressionOp::Abs:
+               stack[top - 1] = fabsf( stack[top - 1] );
+               break;
+            case EExpressionOp::Sqrt:
+               stack[top - 1] = sqrtf( stack[top - 1] );
+               break;
+            case EExpressionOp::Floor:
+               stack[top - 1] = floorf( stack[top - 1] );
+               break;
+            }
+         }
+         return top ? stack[0] : 0.f;
+      }
+
+      // the parser stops at expressions that are nested deeper than this
+      static uint32_t constexpr skMaxStackDepth = 32;
+
+   private:
+      struct SOp
+      {
+         EExpressionOp mOp;
+         real32 mNumber;
+      };
+
+      std::vector< SOp > mOps;
+      bool mUsesTime = false;
+   };
+
+   using TValues = std::vector< CExpression >;
+
+   enum class ETransform
+   {
+      Translate,
+      Scale,
+      Rotate,
+      RotateX,
+      RotateY,
+      RotateZ
+   };
+
+   struct STransform
+   {
+      ETransform mType;
+      TValues mValues;
+   };
+
+   using TTransforms = std::vector< STransform >;
+
+   bool UsesTime( TTransforms const& transforms )
+   {
+      for (STransform const& transform : transforms)
+      {
+         for (CExpression const& value : transform.mValues)
+         {
+            if (value.UsesTime())
+            {
+               return true;
+            }
+         }
+      }
+      return false;
+   }
+
+   CTransform4f EvaluateTransforms( TTransforms const& transforms, real32 const time )
+   {
+      CTransform4f result = CTransform4f::Identity();
+      bool first = true;
+      for (STransform const& transform : transforms)
+      {
+         real32 values[3] = { 0.f, 0.f, 0.f };
+         for (size_t index = 0; index < transform.mValues.size(); ++index)
+         {
+            values[index] = transform.mValues[index].Evaluate( time );
+         }
+
+         CTransform4f matrix = CTransform4f::Identity();
+         switch (transform.mType)
+         {
+         case ETransform::Translate:
+            matrix = NScene::translate( values[0], values[1], values[2] );
+            break;
+         case ETransform::Scale:
+            matrix = transform.mValues.size() == 1 ? NScene::scale( values[0] ) : NScene::scale( values[0], values[1], values[2] );
+            break;
+         case ETransform::Rotate:
+            matrix = NScene::rotate( values[0], values[1], values[2] );
+            break;
+         case ETransform::RotateX:
+            matrix = NScene::rotatex( values[0] );
+            break;
+         case ETransform::RotateY:
+            matrix = NScene::rotatey( values[0] );
+            break;
+         case ETransform::RotateZ:
+            matrix = NScene::rotatez( values[0] );
+            break;
+         }
+
+         result = first ? matrix : result * matrix;
+         first = false;
+      }
+      return result;
+   }
+
+   // splits the text into words, numbers and single character symbols
+   bool Tokenize( std::string const& text, std::vector< SToken >& tokens, std::string& error )
+   {
+      uint32_t line = 1;
+      size_t position = 0;
+      while (position < text.size())
+      {
+         char const c = text[position];
+         if (c == '\n')
+         {
+            ++line;
+            ++position;
+         }
+         else if (isspace( static_cast<unsigned char>(c) ))
+         {
+            ++position;
+         }
+         else if (c == '#')
+         {
+            while (position < text.size() && text[position] != '\n')
+            {
+               ++position;
+            }
+         }
+         else if (isalpha( static_cast<unsigned char>(c) ) || c == '_')
+         {
+            size_t const start = position;
+            while (position < text.size() && (isalnum( static_cast<unsigned char>(text[position]) ) || text[position] == '_'))
+            {
+               ++position;
+            }
+            tokens.push_back( SToken{ ETokenType::Word, text.substr( start, position - start ), 0.f, line } );
+         }
+         else if (isdigit( static_cast<unsigned char>(c) ) || c == '.')
+         {
+            char const* const pStart = text.c_str() + position;
+            char* pEnd = nullptr;
+            bool const hex = c == '0' && position + 1 < text.size() && (text[position + 1] == 'x' || text[position + 1] == 'X');
+            real32 const number = hex ? static_cast<real32>(strtoul( pStart, &pEnd, 16 )) : strtof( pStart, &pEnd );
+            if (pEnd == pStart)
+            {
+               error = "line " + std::to_string( line ) + ": bad number";
+               return false;
+            }
+            position += static_cast<size_t>(pEnd - pStart);
+            tokens.push_back( SToken{ ETokenType::Number, std::string( pStart, static_cast<size_t>(pEnd - pStart) ), number, line } );
+         }
+         else if (strchr( "(){}+-*/", c ) != nullptr)
+         {
+            tokens.push_back( SToken{ ETokenType::Symbol, std::string( 1, c ), 0.f, line } );
+            ++position;
+         }
+         else
+         {
+            error = "line " + std::to_string( line ) + ": unexpected character '" + std::string( 1, c ) + "'";
+            return false;
+         }
+      }
+
+      // errors at the end of the file are shown at the last token
+      tokens.push_back( SToken{ ETokenType::End, "end of file", 0.f, tokens.empty() ? 1 : tokens.back().mLine } );
+      return true;
+   }
+
+   // Builds the objects, lights and camera of a scene file into a scene. It stops
+   // at the first error, the scene is left half built then.
+   class CParser
+   {
+   public:
+      explicit CParser( std::vector< SToken > const& tokens )
+         : mTokens( tokens )
+      {
+      }
+
+      bool ParseScene( CRenderScene& scene )
+      {
+         while (Peek().mType != ETokenType::End)
+         {
+            if (!ParseStatement( scene ))
+            {
+               return false;
+            }
+         }
+         return true;
+      }
+
+      std::string const& GetError() const
+      {
+         return mError;
+      }
+
+   private:
+      SToken const& Peek() const
+      {
+         return mTokens[mPosition];
+      }
+
+      SToken const& Next()
+      {
+         SToken const& token = mTokens[mPosition];
+         if (token.mType != ETokenType::End)
+         {
+            ++mPosition;
+         }
+         return token;
+      }
+
+      bool IsSymbol( char const symbol ) const
+      {
+         return Peek().mType == ETokenType::Symbol && Peek().mText[0] == symbol;
+      }
+
+      bool IsWord( char const* const word ) const
+      {
+         return Peek().mType == ETokenType::Word && Peek().mText == word;
+      }
+
+      bool IsValue() const
+      {
+         return Peek().mType == ETokenType::Number || IsSymbol( '(' ) || IsSymbol( '-' );
+      }
+
+      bool Fail( std::string const& message )
+      {
+         mError = "line " + std::to_string( Peek().mLine ) + ": " + message;
+         return false;
+      }
+
+      bool Expect( char const symbol )
+      {
+         if (!IsSymbol( symbol ))
+         {
+            return Fail( std::string( "expected '" ) + symbol + "' instead of '" + Peek().mText + "'" );
+         }
+         Next();
+         return true;
+      }
+
+      //----------------------------------------------------------------------------
+      // values
+
+      bool ParseExpression( CExpression& expression, uint32_t const depth )
+      {
+         if (!ParseTerm( expression, depth ))
+         {
+            return false;
+         }
+         while (IsSymbol( '+' ) || IsSymbol( '-' ))
+         {
+            EExpressionOp const op = Next().mText[0] == '+' ? EExpressionOp::Add : EExpressionOp::Subtract;
+            if (!ParseTerm( expression, depth + 1 ))
+            {
+               return false;
+            }
+            expression.Add( op );
+         }
+         return true;
+      }
+
+      bool ParseTerm( CExpression& expression, uint32_t const depth )
+      {
+         if (!ParseFactor( expression, depth ))
+         {
+            return false;
+         }
+         while (IsSymbol( '*' ) || IsSymbol( '/' ))
+         {
+            EExpressionOp const op = Next().mText[0] == '*' ? EExpressionOp::Multiply : EExpressionOp::Divide;
+            if (!ParseFactor( expression, depth + 1 ))
+            {
+               return false;
+            }
+            expression.Add( op );
+         }
+         return true;
+      }
+
+      bool ParseFactor( CExpression& expression, uint32_t const depth )
+      {
+         if (depth >= CExpression::skMaxStackDepth)
+         {
+            return Fail( "the expression is too complicated" );
+         }
+
+         SToken const& token = Peek();
+         if (token.mType == ETokenType::Number)
+         {
+            Next();
+            expression.Add( EExpressionOp::Number, token.mNumber );
+            return true;
+         }
+         if (IsSymbol( '-' ))
+         {
+            Next();
+            if (!ParseFactor( expression, depth + 1 ))
+            {
+               return false;
+            }
+            expression.Add( EExpressionOp::Negate );
+            return true;
+         }
+         if (IsSymbol( '(' ))
+         {
+            Next();
+            return ParseExpression( expression, depth + 1 ) && Expect( ')' );
+         }
+         if (token.mType == ETokenType::Word)
+         {
+            if (token.mText == "time")
+            {
+               Next();
+               expression.Add( EExpressionOp::Time );
+               return true;
+            }
+            if (token.mText == "pi")
+            {
+               Next();
+               expression.Add( EExpressionOp::Number, NMath::gkPi32 );
+               return true;
+            }
+
+            struct SFunction
+            {
+               char const* mName;
+               EExpressionOp mOp;
+            };
+            static SFunction const skFunctions[] =
+            {
+               { "sin", EExpressionOp::Sin },
+               { "cos", EExpressionOp::Cos },
+               { "abs", EExpressionOp::Abs },
+               { "sqrt", EExpressionOp::Sqrt },
+               { "floor", EExpressionOp::Floor },
+            };
+            for (SFunction const& function : skFunctions)
+            {
+               if (token.mText == function.mName)
+               {
+                  Next();
+                  if (!Expect( '(' ) || !ParseExpression( expression, depth + 1 ) || !Expect( ')' ))
+                  {
+                     return false;
+                  }
+                  expression.Add( function.mOp );
+                  return true;
+               }
+            }
+         }
+         return Fail( "expected a value instead of '" + token.mText + "'" );
+      }
+
+      // a number, a negative number, or an expression in parentheses
+      bool ParseValue( CExpression& value )
+      {
+         if (IsSymbol( '-' ))
+         {
+            Next();
+            if (!ParseValue( value ))
+            {
+               return false;
+            }
+            value.Add( EExpressionOp::Negate );
+            return true;
+         }
+         if (IsSymbol( '(' ))
+         {
+            Next();
+            return ParseExpression( value, 0 ) && Expect( ')' );
+         }
+         if (Peek().mType == ETokenType::Number)
+         {
+            value.Add( EExpressionOp::Number, Next().mNumber );
+            return true;
+         }
+         return Fail( "expected a value instead of '" + Peek().mText + "'" );
+      }
+
+      // reads all of the values up to the next word or symbol, there has to be
+      // one of the counts of them
+      bool ParseValues( char const* const name, std::initializer_list< size_t > const counts, TValues& values )
+      {
+         values.clear();
+         while (IsValue())
+         {
+            values.push_back( CExpression() );
+            if (!ParseValue( values.back() ))
+            {
+               return false;
+            }
+         }
+
+         if (std::find( counts.begin(), counts.end(), values.size() ) == counts.end())
+         {
+            std::string expected;
+            for (size_t const count : counts)
+            {
+               expected += (expected.empty() ? "" : " or ") + std::to_string( count );
+            }
+            return Fail( std::string( name ) + " takes " + expected + " values, not " + std::to_string( values.size() ) );
+         }
+         return true;
+      }
+
+      // the values of everything except for the animated ones
+      bool GetConstant( CExpression const& value, real32& number )
+      {
+         if (value.UsesTime())
+         {
+            return Fail( "time can only be used in transforms, blend factors and light positions" );
+         }
+         number = value.Evaluate( 0.f );
+         return true;
+      }
+
+      bool GetVector( TValues const& values, size_t const first, CVector3f& vector )
+      {
+         real32 x = 0.f;
+         real32 y = 0.f;
+         real32 z = 0.f;
+         if (!GetConstant( values[first], x ) || !GetConstant( values[first + 1], y ) || !GetConstant( values[first + 2], z ))
+         {
+            return false;
+         }
+         vector = CVector3f( x, y, z );
+         return true;
+      }
+
+      // a color is either three values or one 0xRRGGBB value
+      bool GetColor( TValues const& values, size_t const first, size_t const count, CColor4f& color )
+      {
+         if (count == 1)
+         {
+            real32 code = 0.f;
+            if (!GetConstant( values[first], code ))
+            {
+               return false;
+            }
+            color = CColor4f( static_cast<uint32_t>(code) );
+            return true;
+         }
+
+         CVector3f vectorColor = CVector3f::Zero();
+         if (!GetVector( values, first, vectorColor ))
+         {
+            return false;
+         }
+         color = CColor4f( vectorColor.GetX(), vectorColor.GetY(), vectorColor.GetZ() );
+         return true;
+      }
+
+      //----------------------------------------------------------------------------
+      // statements
+
+      bool ParseStatement( CRenderScene& scene )
+      {
+         if (IsWord( "camera" ))
+         {
+            return ParseCamera( scene );
+         }
+         if (IsWord( "ambientlight" ) || IsWord( "directionallight" ) || IsWord( "pointlight" ) || IsWord( "spotlight" ))
+         {
+            return ParseLight( scene );
+         }
+
+         TObjectContainers objects;
+         if (!ParseObject( objects ))
+         {
+            return false;
+         }
+         scene += objects.back();
+         return true;
+      }
+
+      // the properties of cameras and lights, each one is a word followed by its values
+      using TProperties = std::map< std::string, TValues >;
+
+      bool ParseProperties( std::initializer_list< std::pair< char const*, size_t > > const names, TProperties& properties, TTransforms* const pTransforms )
+      {
+         for (;;)
+         {
+            if (pTransforms != nullptr && IsTransform())
+            {
+               if (!ParseTransform( *pTransforms ))
+               {
+                  return false;
+               }
+               continue;
+            }
+
+            auto const name = std::find_if( names.begin(), names.end(), [this]( std::pair< char const*, size_t > const& entry ) { return IsWord( entry.first ); } );
+            if (name == names.end())
+            {
+               return true;
+            }
+
+            Next();
+            if (!ParseValues( name->first, { name->second }, properties[name->first] ))
+            {
+               return false;
+            }
+         }
+      }
+
+      bool Require( TProperties const& properties, std::initializer_list< char const* > const names, char const* const statement )
+      {
+         for (char const* const name : names)
+         {
+            if (properties.find( name ) == properties.end())
+            {
+               return Fail( std::string( statement ) + " needs a " + name );
+            }
+         }
+         return true;
+      }
+
+      bool ParseCamera( CRenderScene& scene )
+      {
+         Next();
+         TProperties properties;
+         if (!ParseProperties( { { "position", 3 }, { "lookat", 3 }, { "fov", 1 }, { "vertical", 0 } }, properties, nullptr ) ||
+            !Require( properties, { "position", "lookat" }, "camera" ))
+         {
+            return false;
+         }
+
+         CVector3f position = CVector3f::Zero();
+         CVector3f lookAt = CVector3f::Zero();
+         real32 fov = 45.f;
+         if (!GetVector( properties["position"], 0, position ) || !GetVector( properties["lookat"], 0, lookAt ) ||
+            (properties.count( "fov" ) && !GetConstant( properties["fov"][0], fov )))
+         {
+            return false;
+         }
+
+         scene << NScene::camera( position, lookAt, fov, properties.count( "vertical" ) != 0 );
+         return true;
+      }
+
+      bool ParseLight( CRenderScene& scene )
+      {
+         std::string const type = Next().mText;
+         TProperties properties;
+         TTransforms transforms;
+         bool const shadowCasting = type == "pointlight" || type == "spotlight";
+         if (!ParseProperties( { { "position", 3 }, { "direction", 3 }, { "angle", 1 }, { "color", 3 }, { "intensity", 1 }, { "attenuation", 3 } },
+            properties, shadowCasting ? &transforms : nullptr ))
+         {
+            return false;
+         }
+
+         for (TProperties::value_type const& property : properties)
+         {
+            bool const allowed = property.first == "color" || property.first == "intensity" ||
+               (property.first == "position" && shadowCasting) ||
+               (property.first == "direction" && (type == "directionallight" || type == "spotlight")) ||
+               (property.first == "angle" && type == "spotlight") ||
+               (property.first == "attenuation" && shadowCasting);
+            if (!allowed)
+            {
+               return Fail( type + " doesn't have a " + property.first );
+            }
+         }
+
+         if (!Require( properties, { "color" }, type.c_str() ))
+         {
+            return false;
+         }
+
+         CColor4f color = CColor4f::White();
+         real32 intensity = 1.f;
+         if (!GetColor( properties["color"], 0, 3, color ) || (properties.count( "intensity" ) && !GetConstant( properties["intensity"][0], intensity )))
+         {
+            return false;
+         }
+         if (properties.count( "intensity" ))
+         {
+            color = color * intensity;
+         }
+
+         if (type == "ambientlight")
+         {
+            scene += NScene::ambientlight( color );
+            return true;
+         }
+
+         CVector3f direction = CVector3f::Zero();
+         if (type != "pointlight" && (!Require( properties, { "direction" }, type.c_str() ) || !GetVector( properties["direction"], 0, direction )))
+         {
+            return false;
+         }
+
+         if (type == "directionallight")
+         {
+            scene += NScene::directionallight( direction, color );
+            return true;
+         }
+
+         if (!Require( properties, { "position" }, type.c_str() ))
+         {
+            return false;
+         }
+
+         // the light starts at the position of time 0 and is animated when it uses time
+         TValues const& position = properties["position"];
+         CVector3f const startPosition( position[0].Evaluate( 0.f ), position[1].Evaluate( 0.f ), position[2].Evaluate( 0.f ) );
+
+         NScene::attenuation attenuation;
+         if (properties.count( "attenuation" ) &&
+            (!GetConstant( properties["attenuation"][0], attenuation.constant ) || !GetConstant( properties["attenuation"][1], attenuation.linear ) ||
+             !GetConstant( properties["attenuation"][2], attenuation.exponential )))
+         {
+            return false;
+         }
+
+         if (type == "pointlight")
+         {
+            NScene::pointlight light( startPosition, color );
+            return FinishLight( scene, light, position, attenuation, transforms );
+         }
+
+         real32 angle = 0.f;
+         if (!Require( properties, { "angle" }, "spotlight" ) || !GetConstant( properties["angle"][0], angle ))
+         {
+            return false;
+         }
+         NScene::spotlight light( startPosition, direction, angle, color );
+         return FinishLight( scene, light, position, attenuation, transforms );
+      }
+
+      template<class TLight>
+      bool FinishLight( CRenderScene& scene, TLight& light, TValues const& position, NScene::attenuation const& attenuation, TTransforms const& transforms )
+      {
+         if (position[0].UsesTime() || position[1].UsesTime() || position[2].UsesTime())
+         {
+            light << NScene::animate( [position]( real32 const time ) { return CVector3f( position[0].Evaluate( time ), position[1].Evaluate( time ), position[2].Evaluate( time ) ); } );
+         }
+
+         if (!transforms.empty())
+         {
+            light << EvaluateTransforms( transforms, 0.f );
+            if (UsesTime( transforms ))
+            {
+               light << NScene::animate( [transforms]( real32 const time ) { return EvaluateTransforms( transforms, time ); } );
+            }
+         }
+
+         scene += light << attenuation;
+         return true;
+      }
+
+      //----------------------------------------------------------------------------
+      // objects
+
+      bool IsTransform() const
+      {
+         return IsWord( "translate" ) || IsWord( "scale" ) || IsWord( "rotate" ) || IsWord( "rotatex" ) || IsWord( "rotatey" ) || IsWord( "rotatez" );
+      }
+
+      bool ParseTransform( TTransforms& transforms )
+      {
+         std::string const name = Next().mText;
+         STransform transform{ ETransform::Translate, {} };
+         if (name == "scale")
+         {
+            transform.mType = ETransform::Scale;
+         }
+         else if (name == "rotate")
+         {
+            transform.mType = ETransform::Rotate;
+         }
+         else if (name != "translate")
+         {
+            transform.mType = name == "rotatex" ? ETransform::RotateX : (name == "rotatey" ? ETransform::RotateY : ETransform::RotateZ);
+         }
+
+         size_t const count = name == "translate" || name == "rotate" ? 3 : 1;
+         if (!(transform.mType == ETransform::Scale ? ParseValues( "scale", { 1, 3 }, transform.mValues ) : ParseValues( name.c_str(), { count }, transform.mValues )))
+         {
+            return false;
+         }
+         transforms.push_back( transform );
+         return true;
+      }
+
+      bool ParseChildren( TObjectContainers& children )
+      {
+         if (!Expect( '{' ))
+         {
+            return false;
+         }
+         while (!IsSymbol( '}' ))
+         {
+            if (Peek().mType == ETokenType::End)
+            {
+               return Fail( "expected '}' before the end of the file" );
+            }
+            if (!ParseObject( children ))
+            {
+               return false;
+            }
+         }
+         Next();
+         return true;
+      }
+
+      // the blend factor of smoothunion and blend, it is animated when it uses time
+      bool ParseBlendFactor( char const* const name, CExpression& blendFactor )
+      {
+         TValues values;
+         if (!ParseValues( name, { 1 }, values ))
+         {
+            return false;
+         }
+         blendFactor = values[0];
+         return true;
+      }
+
+      // adds the object and its children to objects
+      bool ParseObject( TObjectContainers& objects )
+      {
+         if (Peek().mType != ETokenType::Word)
+         {
+            return Fail( "expected an object instead of '" + Peek().mText + "'" );
+         }
+
+         std::string const type = Next().mText;
+         TValues values;
+         TObjectContainers children;
+         CExpression blendFactor;
+
+         if (type == "sphere")
+         {
+            real32 radius = 0.f;
+            CVector3f center = CVector3f::Zero();
+            if (!ParseValues( "sphere", { 1, 4 }, values ) ||
+               (values.size() == 4 && !GetVector( values, 0, center )) || !GetConstant( values.back(), radius ))
+            {
+               return false;
+            }
+            objects.push_back( values.size() == 4 ? NScene::sphere( center, radius ) : NScene::sphere( radius ) );
+         }
+         else if (type == "plane")
+         {
+            CVector3f normal = CVector3f::Zero();
+            real32 height = 0.f;
+            if (!ParseValues( "plane", { 3, 4 }, values ) || !GetVector( values, 0, normal ) ||
+               (values.size() == 4 && !GetConstant( values[3], height )))
+            {
+               return false;
+            }
+            objects.push_back( values.size() == 4 ? NScene::plane( normal, height ) : NScene::plane( normal ) );
+         }
+         else if (type == "cube")
+         {
+            CVector3f size = CVector3f::Zero();
+            real32 edge = 0.f;
+            if (!ParseValues( "cube", { 1, 3 }, values ) ||
+               (values.size() == 3 ? !GetVector( values, 0, size ) : !GetConstant( values[0], edge )))
+            {
+               return false;
+            }
+            objects.push_back( values.size() == 3 ? NScene::cube( size ) : NScene::cube( edge ) );
+         }
+         else if (type == "torus")
+         {
+            real32 minorRadius = 0.f;
+            real32 majorRadius = 0.f;
+            if (!ParseValues( "torus", { 2 }, values ) || !GetConstant( values[0], minorRadius ) || !GetConstant( values[1], majorRadius ))
+            {
+               return false;
+            }
+            // the same distance as the torus of RenderScene.inl
+            auto const torus = [minorRadius, majorRadius]( CVector3f pos )
+            {
+               return NScene::length( CVector3f( NScene::length( CVector3f( pos.x, 0.f, pos.z ) ) - majorRadius, pos.y, 0.f ) ) - minorRadius;
+            };
+            objects.push_back( NScene::custom( torus, NScene::bounds( majorRadius + minorRadius ) ) );
+         }
+         else if (type == "union" || type == "intersection" || type == "difference")
+         {
+            if (!ParseChildren( children ))
+            {
+               return false;
+            }
+            if (type == "union")
+            {
+               objects.push_back( NScene::csg_union( children ) );
+            }
+            else if (type == "intersection")
+            {
+               objects.push_back( NScene::csg_intersection( children ) );
+            }
+            else
+            {
+               objects.push_back( NScene::csg_difference( children ) );
+            }
+         }
+         else if (type == "smoothunion" || type == "blend")
+         {
+            if (!ParseBlendFactor( type.c_str(), blendFactor ) || !ParseChildren( children ))
+            {
+               return false;
+            }
+            real32 const k = blendFactor.Evaluate( 0.f );
+            if (type == "smoothunion")
+            {
+               objects.push_back( NScene::csg_smoothunion( children, k ) );
+            }
+            else
+            {
+               objects.push_back( NScene::blend( children, k ) );
+            }
+            if (blendFactor.UsesTime())
+            {
+               objects.back() << NScene::animate( [blendFactor]( real32 const time ) { return blendFactor.Evaluate( time ); } );
+            }
+         }
+         else
+         {
+            // point the error at the name of the object
+            --mPosition;
+            return Fail( "unknown object '" + type + "'" );
+         }
+
+         return ParseModifiers( objects.back() );
+      }
+
+      bool ParseModifiers( CObjectContainer& object )
+      {
+         TTransforms transforms;
+         SSurfaceInfo surface;
+         bool hasSurface = false;
+         bool animated = false;
+
+         for (;;)
+         {
+            TValues values;
+            if (IsTransform())
+            {
+               if (!ParseTransform( transforms ))
+               {
+                  return false;
+               }
+               for (CExpression const& value : transforms.back().mValues)
+               {
+                  animated = animated || value.UsesTime();
+               }
+            }
+            else if (IsWord( "color" ))
+            {
+               Next();
+               CColor4f color = CColor4f::White();
+               if (!ParseValues( "color", { 1, 3 }, values ) || !GetColor( values, 0, values.size(), color ))
+               {
+                  return false;
+               }
+               object << color;
+            }
+            else if (IsWord( "checker" ) || IsWord( "gradient" ))
+            {
+               std::string const name = Next().mText;
+               CColor4f color0 = CColor4f::White();
+               CColor4f color1 = CColor4f::White();
+               if (!ParseValues( name.c_str(), { 2, 6 }, values ))
+               {
+                  return false;
+               }
+               size_t const count = values.size() / 2;
+               if (!GetColor( values, 0, count, color0 ) || !GetColor( values, count, count, color1 ))
+               {
+                  return false;
+               }
+               if (name == "checker")
+               {
+                  object << NScene::checker( color0, color1 );
+               }
+               else
+               {
+                  object << NScene::gradient( color0, color1 );
+               }
+            }
+            else if (IsWord( "albedo" ) || IsWord( "metallic" ) || IsWord( "dielectric" ))
+            {
+               std::string const name = Next().mText;
+               real32& field = name == "albedo" ? surface.albedo : (name == "metallic" ? surface.metallic : surface.dielectric);
+               if (!ParseValues( name.c_str(), { 1 }, values ) || !GetConstant( values[0], field ))
+               {
+                  return false;
+               }
+               hasSurface = true;
+            }
+            else
+            {
+               break;
+            }
+         }
+
+         if (hasSurface)
+         {
+            object << surface;
+         }
+
+         if (animated)
+         {
+            object << NScene::animate( [transforms]( real32 const time ) { return EvaluateTransforms( transforms, time ); } );
+         }
+         else if (!transforms.empty())
+         {
+            object << EvaluateTransforms( transforms, 0.f );
+         }
+         return true;
+      }
+
+      std::vector< SToken > const& mTokens;
+      size_t mPosition = 0;
+      std::string mError;
+   };
+
+   bool ReadFile( std::string const& fileName, std::string& text, std::string& error )
+   {
+      std::ifstream file( fileName, std::ios::binary );
+      if (!file)
+      {
+         error = "can't open " + fileName;
+         return false;
+      }
+      text.assign( std::istreambuf_iterator<char>( file ), std::istreambuf_iterator<char>() );
+      return true;
+   }
+
+   // builds the text of a scene file into the scene, see the top of this section
+   bool BuildScene( std::string const& text, CRenderScene& scene, std::string& error )
+   {
+      std::vector< SToken > tokens;
+      if (!Tokenize( text, tokens, error ))
+      {
+         return false;
+      }
+
+      // the objects that are created by the scene come from its arena
+      tlpSceneArena = &scene.GetArena();
+      CParser parser( tokens );
+      bool const result = parser.ParseScene( scene );
+      tlpSceneArena = nullptr;
+
+      error = parser.GetError();
+      return result;
+   }
+}
+
+//----------------------------------------------------------------------------------------
+//
+// A compiled scene is a scene that has been compiled and written to a file. Loading
+// one maps the file into memory and evaluates the program straight from it, nothing
+// is parsed or compiled, so even scenes with many thousands of objects start to
+// render right away. The headless renderer writes them with -compile, and they are
+// loaded the same way as scene files, see CRenderer::SetSceneFile.
+//
+// The file starts with SHeader, which has the camera and where each table is. The
+// tables are arrays of the values that the renderer uses, with the same layout, so a
+// file can only be read by a build with the same layout. The element sizes in the
+// header are checked for that. Padding is always written as zeros, so the same scene
+// always compiles to the same file.
+//
+//   objects        the records of the objects, each one is followed by its children
+//   materials      the records of the materials of the objects
+//   lights         the records of the lights
+//   instructions   the instructions of the program, see CSdfProgram
+//   transforms     the world to local transforms of the primitives of the program
+//   ranges         the instructions of each top level object
+//   bounds         the bounds of each top level object
+//
+// The objects are still created from their records, with the memory of the scene,
+// since the colors and normals of the surfaces come from them. A compiled scene is
+// the scene at the time it was compiled. The animations are code, so they aren't
+// kept, and custom objects and materials can't be compiled for the same reason.
+//
+//----------------------------------------------------------------------------------------
+
+namespace NCompiledScene
+{
+   enum class ESection : uint32_t
+   {
+      Objects,
+      Materials,
+      Lights,
+      Instructions,
+      Transforms,
+      Ranges,
+      Bounds,
+      Count,
+   };
+
+   struct SSection
+   {
+      uint64_t mOffset;
+      uint32_t mCount;
+      uint32_t mElementSize;
+   };
+
+   // the camera is kept as the values that it is made from, see CCamera::SetSceneSize
+   struct SCamera
+   {
+      real32 mPosition[3];
+      real32 mLookAt[3];
+      real32 mFOV;
+      uint32_t mVerticalFOV;
+   };
+
+   struct SHeader
+   {
+      char mMagic[8];
+      uint32_t mVersion;
+      uint32_t mSectionCount;
+      SSection mSections[static_cast<uint32_t>(ESection::Count)];
+      SCamera mCamera;
+   };
+
+   static_assert( std::is_trivially_copyable_v< SHeader > && std::is_trivially_copyable_v< SCompiledObject > && std::is_trivially_copyable_v< SCompiledMaterial > &&
+      std::is_trivially_copyable_v< SCompiledLight > && std::is_trivially_copyable_v< SSdfInstruction > && std::is_trivially_copyable_v< SBoundingSphere >,
+      "the values of a compiled scene are used straight from the file" );
+
+   char constexpr skMagic[8] = { 'R', 'M', 'S', 'C', 'E', 'N', 'E', '\0' };
+   uint32_t constexpr skVersion = 2;
+
+   // every table starts on a cache line
+   uint64_t constexpr skTableAlignment = 64;
+
+   // compiled scenes are told apart from scene files by how they start
+   bool IsCompiledScene( std::string const& fileName )
+   {
+      std::ifstream file( fileName, std::ios::binary );
+      char magic[sizeof( skMagic )] = {};
+      return file.read( magic, sizeof( magic ) ) && memcmp( magic, skMagic, sizeof( skMagic ) ) == 0;
+   }
+
+   // Records are written into zeroed bytes one value at a time. Copying whole records
+   // would also copy whatever their padding and the unused fourth lanes of their
+   // vectors hold, and the same scene wouldn't always compile to the same file.
+   class CRecordWriter
+   {
+   public:
+      template<class TRecord>
+      explicit CRecordWriter( std::vector< char >& bytes, TRecord const& record )
+         : mpRecord( reinterpret_cast<char const*>(&record) )
+      {
+         bytes.resize( bytes.size() + sizeof( TRecord ) );
+         mpBytes = bytes.data() + bytes.size() - sizeof( TRecord );
+      }
+
+      template<class TValue>
+      CRecordWriter& operator<<( TValue const& value )
+      {
+         memcpy( mpBytes + GetOffset( value ), &value, sizeof( value ) );
+         return *this;
+      }
+
+      CRecordWriter& operator<<( CVector3f const& value )
+      {
+         real32 const values[] = { value.mX, value.mY, value.mZ };
+         memcpy( mpBytes + GetOffset( value ), values, sizeof( values ) );
+         return *this;
+      }
+
+   private:
+      template<class TValue>
+      size_t GetOffset( TValue const& value ) const
+      {
+         return static_cast<size_t>(reinterpret_cast<char const*>(&value) - mpRecord);
+      }
+
+      char const* mpRecord;
+      char* mpBytes;
+   };
+
+   void WriteRecord( std::vector< char >& bytes, SCompiledObject const& record )
+   {
+      CRecordWriter( bytes, record ) << record.mTransform << record.mParams << record.mSurfaceInfo << record.mType << record.mChildCount << record.mMaterial;
+   }
+
+   void WriteRecord( std::vector< char >& bytes, SCompiledMaterial const& record )
+   {
+      CRecordWriter( bytes, record ) << record.mTransform << record.mColor0 << record.mColor1 << record.mType;
+   }
+
+   void WriteRecord( std::vector< char >& bytes, SCompiledLight const& record )
+   {
+      CRecordWriter( bytes, record ) << record.mTransform << record.mPosition << record.mDirection << record.mColor << record.mAttenuation << record.mCosAngle << record.mType;
+   }
+
+   // the objects of instructions are only used by custom objects, which aren't compiled
+   void WriteRecord( std::vector< char >& bytes, SSdfInstruction const& record )
+   {
+      CRecordWriter( bytes, record ) << record.mOp << record.mCount << record.mTransform << record.mParams;
+   }
+
+   void WriteRecord( std::vector< char >& bytes, CTransform4f const& record )
+   {
+      CRecordWriter( bytes, record ) << record;
+   }
+
+   void WriteRecord( std::vector< char >& bytes, CSdfProgram::SObjectRange const& record )
+   {
+      CRecordWriter( bytes, record ) << record.mBegin << record.mEnd;
+   }
+
+   void WriteRecord( std::vector< char >& bytes, SBoundingSphere const& record )
+   {
+      CRecordWriter( bytes, record ) << record.mCenter << record.mRadius;
+   }
+
+   struct STable
+   {
+      std::vector< char > mBytes;
+      size_t mCount;
+      size_t mElementSize;
+   };
+
+   template<class TRecord>
+   STable const MakeTable( TRecord const* const pRecords, size_t const count )
+   {
+      STable table{ {}, count, sizeof( TRecord ) };
+      table.mBytes.reserve( count * sizeof( TRecord ) );
+      for (size_t index = 0; index < count; ++index)
+      {
+         WriteRecord( table.mBytes, pRecords[index] );
+      }
+      return table;
+   }
+
+   // Writes a scene that has been compiled, the file is written next to the old one
+   // and then moved over it. A renderer that has the old one mapped keeps using it
+   // until it loads the new one.
+   bool Write( CRenderScene const& scene, std::string const& fileName, std::string& error )
+   {
+      CSdfProgram const* const pProgram = scene.GetProgram();
+      if (pProgram == nullptr)
+      {
+         error = "the scene has not been compiled or is nested too deeply";
+         return false;
+      }
+
+      CCompiledSceneWriter writer;
+      for (CRenderObject::TPtr const& pObject : scene.GetObjects())
+      {
+         if (!pObject->WriteCompiled( writer ))
+         {
+            error = "custom objects and materials can't be compiled";
+            return false;
+         }
+      }
+
+      std::vector< SCompiledLight > lights;
+      for (CLightObject::TConstPtr const& pLight : scene.GetLights())
+      {
+         SCompiledLight record{ CTransform4f::Identity(), CVector3f::Zero(), CVector3f::Zero(), CColor4f::Black(), SAttenuationInfo(), 1.f, ECompiledType::AmbientLight };
+         pLight->WriteCompiled( record );
+         lights.push_back( record );
+      }
+
+      CSdfProgram::STables const program = pProgram->GetTables();
+      STable const tables[] = {
+         MakeTable( writer.GetObjects().data(), writer.GetObjects().size() ),
+         MakeTable( writer.GetMaterials().data(), writer.GetMaterials().size() ),
+         MakeTable( lights.data(), lights.size() ),
+         MakeTable( program.mpInstructions, program.mInstructionCount ),
+         MakeTable( program.mpTransforms, program.mTransformCount ),
+         MakeTable( program.mpObjects, program.mObjectCount ),
+         MakeTable( scene.GetBounds().data(), scene.GetBounds().size() ) };
+      static_assert( std::size( tables ) == static_cast<size_t>(ESection::Count), "every section needs a table" );
+
+      CCamera const& camera = scene.GetCamera();
+      CVector3f const position = camera.GetCameraTransform().GetTranslation();
+      CVector3f const lookAt = position + camera.GetCameraTransform().GetBackward();
+
+      SHeader header{};
+      std::copy( std::begin( skMagic ), std::end( skMagic ), header.mMagic );
+      header.mVersion = skVersion;
+      header.mSectionCount = static_cast<uint32_t>(ESection::Count);
+      header.mCamera = SCamera{ { position.mX, position.mY, position.mZ }, { lookAt.mX, lookAt.mY, lookAt.mZ }, camera.GetCameraFOV(), camera.IsVerticalFOV() ? 1u : 0u };
+
+      uint64_t offset = sizeof( SHeader );
+      for (uint32_t section = 0; section < std::size( tables ); ++section)
+      {
+         offset = (offset + skTableAlignment - 1) & ~(skTableAlignment - 1);
+         header.mSections[section] = SSection{ offset, static_cast<uint32_t>(tables[section].mCount), static_cast<uint32_t>(tables[section].mElementSize) };
+         offset += tables[section].mCount * tables[section].mElementSize;
+      }
+
+      std::string const newFileName = fileName + ".new";
+      {
+         std::ofstream file( newFileName, std::ios::binary );
+         file.write( reinterpret_cast<char const*>(&header), sizeof( header ) );
+
+         uint64_t position = sizeof( SHeader );
+         for (uint32_t section = 0; section < std::size( tables ); ++section)
+         {
+            char const padding[skTableAlignment] = {};
+            file.write( padding, static_cast<std::streamsize>(header.mSections[section].mOffset - position) );
+            file.write( tables[section].mBytes.data(), static_cast<std::streamsize>(tables[section].mBytes.size()) );
+            position = header.mSections[section].mOffset + tables[section].mCount * tables[section].mElementSize;
+         }
+
+         if (!file)
+         {
+            error = "can't write " + newFileName;
+            return false;
+         }
+      }
+
+      std::error_code errorCode;
+      std::filesystem::rename( newFileName, fileName, errorCode );
+      if (errorCode)
+      {
+         error = "can't replace " + fileName;
+         return false;
+      }
+      return true;
+   }
+
+   //-----------------------------------------------------------------------------
+
+   // the values of a table in the file, or nullptr when the table doesn't fit in
+   // the file or was written with a different layout
+   template<class T>
+   T const* GetTable( CMappedFile const& file, SHeader const& header, ESection const section, uint32_t& count )
+   {
+      SSection const& table = header.mSections[static_cast<uint32_t>(section)];
+      count = table.mCount;
+      if (table.mElementSize != sizeof( T ) || table.mOffset % alignof( T ) != 0 || table.mOffset > file.GetSize() ||
+         (file.GetSize() - table.mOffset) / sizeof( T ) < table.mCount)
+      {
+         return nullptr;
+      }
+      return reinterpret_cast<T const*>(file.GetData() + table.mOffset);
+   }
+
+   // Every object has all of its children in the table, only the types that are
+   // created below are used and the materials are in their table. Also counts the
+   // top level objects.
+   bool CheckObjects( SCompiledObject const* const pObjects, uint32_t const count, uint32_t const materialCount, uint32_t& topLevelCount )
+   {
+      // how many children the objects that are still being read are missing
+      std::vector< uint32_t > missingChildren;
+      for (uint32_t index = 0; index < count; ++index)
+      {
+         SCompiledObject const& record = pObjects[index];
+         if (missingChildren.empty())
+         {
+            ++topLevelCount;
+         }
+         else
+         {
+            --missingChildren.back();
+         }
+
+         bool const hasChildren = record.mType >= ECompiledType::Union && record.mType <= ECompiledType::Blend;
+         if (record.mType > ECompiledType::Blend || (!hasChildren && record.mChildCount != 0) ||
+            (record.mMaterial != SCompiledObject::skNoMaterial && record.mMaterial >= materialCount))
+         {
+            return false;
+         }
+
+         missingChildren.push_back( record.mChildCount );
+         while (!missingChildren.empty() && missingChildren.back() == 0)
+         {
+            missingChildren.pop_back();
+         }
+      }
+      return missingChildren.empty();
+   }
+
+   CMaterialObject::TPtr CreateMaterial( SCompiledMaterial const& record )
+   {
+      CMaterialObject::TPtr pMaterial;
+      switch (record.mType)
+      {
+      case ECompiledType::Checker:
+         pMaterial = MakeSceneObject< CCheckerMaterialObject >( record.mColor0, record.mColor1 );
+         break;
+      case ECompiledType::Gradient:
+         pMaterial = MakeSceneObject< CGradientMaterialObject >( record.mColor0, record.mColor1 );
+         break;
+      default:
+         pMaterial = MakeSceneObject< CColorMaterialObject >( record.mColor0 );
+         break;
+      }
+      pMaterial->SetTransform( record.mTransform );
+      return pMaterial;
+   }
+
+   // the children are the objects that have been created from the records after this one
+   CRenderObject::TPtr CreateObject( SCompiledObject const& record, TObjectContainers const& children, std::vector< CMaterialObject::TPtr > const& materials )
+   {
+      real32 const* const params = record.mParams;
+      CRenderObject::TPtr pObject;
+      switch (record.mType)
+      {
+      case ECompiledType::Sphere:
+         pObject = MakeSceneObject< CRenderSphere >( CVector3f( params[0], params[1], params[2] ), params[3] );
+         break;
+      case ECompiledType::Plane:
+         pObject = MakeSceneObject< CRenderPlane >( CVector3f( params[0], params[1], params[2] ), params[3] );
+         break;
+      case ECompiledType::Cube:
+         pObject = MakeSceneObject< CRenderCube >( CVector3f( params[0], params[1], params[2] ) );
+         break;
+      case ECompiledType::Intersection:
+         pObject = MakeSceneObject< CRenderIntersection >( children );
+         break;
+      case ECompiledType::Difference:
+         pObject = MakeSceneObject< CRenderDifference >( children );
+         break;
+      case ECompiledType::SmoothUnion:
+         pObject = MakeSceneObject< CRenderSmoothUnion >( children, params[0] );
+         break;
+      case ECompiledType::Blend:
+         pObject = MakeSceneObject< CRenderBlend >( children, params[0] );
+         break;
+      default:
+         pObject = MakeSceneObject< CRenderUnion >( children );
+         break;
+      }
+
+      pObject->SetTransform( record.mTransform );
+      pObject->SetSurfaceInfo( record.mSurfaceInfo );
+      if (record.mMaterial != SCompiledObject::skNoMaterial)
+      {
+         pObject->SetMaterial( materials[record.mMaterial] );
+      }
+      return pObject;
+   }
+
+   CLightObject::TPtr CreateLight( SCompiledLight const& record )
+   {
+      switch (record.mType)
+      {
+      case ECompiledType::DirectionalLight:
+         return MakeSceneObject< CDirectionalLightObject >( record );
+      case ECompiledType::PointLight:
+         return MakeSceneObject< CPointLightObject >( record );
+      case ECompiledType::SpotLight:
+         return MakeSceneObject< CSpotLightObject >( record );
+      default:
+         return MakeSceneObject< CAmbientLightObject >( record );
+      }
+   }
+
+   // Maps a compiled scene and replaces the scene with it. Everything in the file is
+   // checked first, a file that can't be loaded leaves the scene the way it was.
+   // When it loads but the memory of the old scene couldn't be used again, error
+   // says so.
+   bool Load( std::string const& fileName, CRenderScene& scene, std::string& error )
+   {
+      std::unique_ptr< CMappedFile > pFile = std::make_unique< CMappedFile >();
+      if (!pFile->Open( fileName ))
+      {
+         error = "can't open " + fileName;
+         return false;
+      }
+
+      SHeader const* const pHeader = reinterpret_cast<SHeader const*>(pFile->GetData());
+      if (pFile->GetSize() < sizeof( SHeader ) || memcmp( pHeader->mMagic, skMagic, sizeof( skMagic ) ) != 0 ||
+         pHeader->mVersion != skVersion || pHeader->mSectionCount != static_cast<uint32_t>(ESection::Count))
+      {
+         error = "not a compiled scene of this version";
+         return false;
+      }
+
+      uint32_t objectCount = 0;
+      uint32_t materialCount = 0;
+      uint32_t lightCount = 0;
+      uint32_t boundsCount = 0;
+      CSdfProgram::STables tables{};
+      SCompiledObject const* const pObjects = GetTable< SCompiledObject >( *pFile, *pHeader, ESection::Objects, objectCount );
+      SCompiledMaterial const* const pMaterials = GetTable< SCompiledMaterial >( *pFile, *pHeader, ESection::Materials, materialCount );
+      SCompiledLight const* const pLights = GetTable< SCompiledLight >( *pFile, *pHeader, ESection::Lights, lightCount );
+      tables.mpInstructions = GetTable< SSdfInstruction >( *pFile, *pHeader, ESection::Instructions, tables.mInstructionCount );
+      tables.mpTransforms = GetTable< CTransform4f >( *pFile, *pHeader, ESection::Transforms, tables.mTransformCount );
+      tables.mpObjects = GetTable< CSdfProgram::SObjectRange >( *pFile, *pHeader, ESection::Ranges, tables.mObjectCount );
+      SBoundingSphere const* const pBounds = GetTable< SBoundingSphere >( *pFile, *pHeader, ESection::Bounds, boundsCount );
+      if (pObjects == nullptr || pMaterials == nullptr || pLights == nullptr || tables.mpInstructions == nullptr ||
+         tables.mpTransforms == nullptr || tables.mpObjects == nullptr || pBounds == nullptr)
+      {
+         error = "the tables don't fit in the file or were written by a different build";
+         return false;
+      }
+
+      CSdfProgram program;
+      if (!program.Attach( tables ))
+      {
+         error = "the program can't be evaluated";
+         return false;
+      }
+
+      uint32_t topLevelCount = 0;
+      bool const validMaterials = std::all_of( pMaterials, pMaterials + materialCount, []( SCompiledMaterial const& record )
+         { return record.mType >= ECompiledType::Color && record.mType <= ECompiledType::Gradient; } );
+      bool const validLights = std::all_of( pLights, pLights + lightCount, []( SCompiledLight const& record )
+         { return record.mType >= ECompiledType::AmbientLight && record.mType <= ECompiledType::SpotLight; } );
+      if (!validMaterials || !validLights || !CheckObjects( pObjects, objectCount, materialCount, topLevelCount ) ||
+         topLevelCount != tables.mObjectCount || (boundsCount != 0 && boundsCount != topLevelCount))
+      {
+         error = "the records don't match the program";
+         return false;
+      }
+
+      if (!scene.Reset())
+      {
+         error = "the memory of the last scene is still held, so it can't be used again";
+      }
+      SCamera const& camera = pHeader->mCamera;
+      scene << CCamera( CVector3f( camera.mPosition[0], camera.mPosition[1], camera.mPosition[2] ), CVector3f( camera.mLookAt[0], camera.mLookAt[1], camera.mLookAt[2] ), camera.mFOV, camera.mVerticalFOV != 0 );
+
+      // the objects that are created come from the arena of the scene
+      tlpSceneArena = &scene.GetArena();
+
+      std::vector< CMaterialObject::TPtr > materials;
+      materials.reserve( materialCount );
+      for (uint32_t index = 0; index < materialCount; ++index)
+      {
+         materials.push_back( CreateMaterial( pMaterials[index] ) );
+      }
+
+      // An object is created once all of its children have been, until then it
+      // waits on the stack. The children that have been created are kept in order
+      // after the ones of the objects under them on the stack.
+      struct SParent
+      {
+         SCompiledObject const* mpRecord;
+         size_t mFirstChild;
+      };
+      std::vector< SParent > parents;
+      TObjectContainers children;
+      for (uint32_t index = 0; index < objectCount; ++index)
+      {
+         parents.push_back( SParent{ &pObjects[index], children.size() } );
+         while (!parents.empty() && children.size() - parents.back().mFirstChild == parents.back().mpRecord->mChildCount)
+         {
+            SParent const parent = parents.back();
+            parents.pop_back();
+
+            TObjectContainers const objectChildren( children.begin() + parent.mFirstChild, children.end() );
+            children.erase( children.begin() + parent.mFirstChild, children.end() );
+            CObjectContainer const object( CreateObject( *parent.mpRecord, objectChildren, materials ) );
+            if (parents.empty())
+            {
+               scene += object;
+            }
+            else
+            {
+               children.push_back( object );
+            }
+         }
+      }
+
+      for (uint32_t index = 0; index < lightCount; ++index)
+      {
+         scene += CLightObjectContainer( CreateLight( pLights[index] ) );
+      }
+
+      tlpSceneArena = nullptr;
+
+      scene.UseCompiled( std::move( pFile ), program, pBounds, boundsCount );
+      return true;
+   }
+}
+
+//===================================================================================
+// This class coordinates the rendering
+
+// Counts the work areas of a frame that haven't been finished, threads can
+// sleep on it until the frame is complete
+class CFrameLatch
+{
+public:
+   using TPtr = std::shared_ptr< CFrameLatch >;
+
+   void Add( uint32_t const count )
+   {
+      mRemaining += count;
+   }
+
+   // returns true for the call that finished the latch
+   bool CountDown( uint32_t const count )
+   {
+      if (count != 0 && mRemaining.fetch_sub( count ) == count)
+      {
+         // taking the lock makes sure a thread that is about to wait sees the new count
+         {
+            std::lock_guard<std::mutex> lock( mMutex );
+         }
+         mDone.notify_all();
+         return true;
+      }
+      return false;
+   }
+
+   bool IsDone() const
+   {
+      return mRemaining == 0;
+   }
+
+   void Wait()
+   {
+      std::unique_lock<std::mutex> lock( mMutex );
+      mDone.wait( lock, [this]() { return IsDone(); } );
+   }
+
+   // returns false if the frame didn't finish in time
+   bool WaitFor( std::chrono::milliseconds const timeout )
+   {
+      std::unique_lock<std::mutex> lock( mMutex );
+      return mDone.wait_for( lock, timeout, [this]() { return IsDone(); } );
+   }
+
+private:
+   std::atomic<uint32_t> mRemaining{ 0 };
+   std::mutex mMutex;
+   std::condition_variable mDone;
+};
+
+// Given out for every frame that gets started, stays valid after the renderer
+// has moved on to the next frame
+class CFrameHandle
+{
+public:
+   CFrameHandle() = default;
+   explicit CFrameHandle( CFrameLatch::TPtr const& frameLatch )
+      : mFrameLatch( frameLatch )
+   {
+   }
+
+   bool IsDone() const
+   {
+      return mFrameLatch == nullptr || mFrameLatch->IsDone();
+   }
+
+   void Wait() const
+   {
+      if (mFrameLatch != nullptr)
+      {
+         mFrameLatch->Wait();
+      }
+   }
+
+   bool WaitFor( std::chrono::milliseconds const timeout ) const
+   {
+      return mFrameLatch == nullptr || mFrameLatch->WaitFor( timeout );
+   }
+
+private:
+   CFrameLatch::TPtr mFrameLatch;
+};
+
+// the depths of the last frame are moved to this frame first, then the cones are
+// marched, and then the pixels are rendered in passes of smaller and smaller blocks
+enum class EPassType
+{
+   Reproject,
+   Cone,
+   Pixels
+};
+
+// One refinement pass of a frame, every pixel that is a multiple of the step size
+// is rendered and fills a block of step size pixels. The cone pass marches the
+// cones of the blocks instead.
+struct SRenderPass
+{
+   uint32_t mStepSize{ 1 };
+   EPassType mType{ EPassType::Pixels };
+   // counts the passes of the frame that haven't finished
+   CFrameLatch::TPtr mFrameLatch;
+   // counts the work areas of this pass that haven't finished
+   CFrameLatch::TPtr mPassLatch;
+};
+
+struct SWorkArea
+{
+   SWorkArea() = default;
+   explicit SWorkArea( uint32_t const minx, uint32_t const miny, uint32_t const maxx, uint32_t const maxy, SRenderPass const& pass )
+      : mMinX( minx ), mMinY( miny ), mMaxX( maxx ), mMaxY( maxy ), mPass( pass )
+   { 
+   }
+
+   uint32_t mMinX{ 0 };
+   uint32_t mMinY{ 0 };
+   uint32_t mMaxX{ 0 };
+   uint32_t mMaxY{ 0 };
+
+   SRenderPass mPass;
+};
+
+//-------------------------------------------------------------------------
+// Every worker thread owns one of these. The owner takes work areas from the
+// front and idle threads steal from the back, so the lock is rarely contended.
+
+class alignas(64) CWorkQueue
+{
+public:
+   void Push( SWorkArea const& workArea )
+   {
+      std::lock_guard<std::mutex> lock( mMutex );
+      mWorkAreas.push_back( workArea );
+   }
+
+   bool Pop( SWorkArea& workArea )
+   {
+      std::lock_guard<std::mutex> lock( mMutex );
+      if (mWorkAreas.empty())
+      {
+         return false;
+      }
+      workArea = mWorkAreas.front();
+      mWorkAreas.pop_front();
+      return true;
+   }
+
+   bool Steal( SWorkArea& workArea )
+   {
+      std::lock_guard<std::mutex> lock( mMutex );
+      if (mWorkAreas.empty())
+      {
+         return false;
+      }
+      workArea = mWorkAreas.back();
+      mWorkAreas.pop_back();
+      return true;
+   }
+
+   std::deque< SWorkArea > TakeAll()
+   {
+      std::lock_guard<std::mutex> lock( mMutex );
+      std::deque< SWorkArea > workAreas;
+      workAreas.swap( mWorkAreas );
+      return workAreas;
+   }
+
+private:
+   std::mutex mMutex;
+   std::deque< SWorkArea > mWorkAreas;
+};
+
+// march steps taken for every pixel, only filled in when step recording is enabled
+struct SStepBuffers
+{
+   std::vector< uint32_t > mPrimary;
+   std::vector< uint32_t > mShadow;
+   std::vector< uint32_t > mReflection;
+};
+
+class CRenderer
+{
+public:
+
+   explicit CRenderer()
+   {
+      uint32_t const numProcessors = std::thread::hardware_concurrency();
+
+      printf( "starting up %d job threads\n", numProcessors );
+
+      mThreadStats.resize( numProcessors );
+
+      for (uint32_t i = 0; i < numProcessors; ++i)
+      {
+         mWorkQueues.push_back( std::unique_ptr< CWorkQueue >( new CWorkQueue ) );
+      }
+
+      for (uint32_t i = 0; i < numProcessors; ++i)
+      {
+         // worker threads
+         mThreads.push_back( std::unique_ptr< std::thread >( new std::thread( [this, threadIndex = i]()
+         {
+#if COLLECT_RENDER_STATS()
+            tlpRenderStats = &mThreadStats[threadIndex];
+#else
+            UNREFERENCED_PARAMETER( threadIndex );
+#endif
+
+            while (mShutdown == false)
+            {
+               SWorkArea workArea;
+
+               if (NextWorkArea( threadIndex, workArea ))
+               {
+                  RenderWorkArea( threadIndex, workArea );
+                  FinishWorkArea( workArea.mPass );
+               }
+               else
+               {
+                  // no more jobs, just go to sleep until something is queued. While this
+                  // thread is hungry the busy threads will split up their work areas.
+                  ++mHungryThreads;
+                  {
+                     std::unique_lock<std::mutex> lock( mSleepControlMutex );
+                     mSleepControl.wait( lock, [this]() { return mShutdown || mQueuedWorkAreas > 0; } );
+                  }
+                  --mHungryThreads;
+               }
+            }
+         } ) ) );
+      }
+   }
+
+   ~CRenderer()
+   {
+      mShutdown = true;
+      WakeThreads();
+
+      for (auto& threadObj : mThreads)
+      {
+         if (threadObj->joinable())
+         {
+            threadObj->join();
+         }
+      }
+   }
+
+
+   void Update( real32 const deltaTime )
+   {
+      if (IsDone())
+      {
+         SetTime( mTime + deltaTime );
+      }
+   }
+
+   // moves the scene to the given time, only call this when IsDone() is true. The
+   // scene is built the first time, after that only its animated values change
+   // unless the scene file has been changed.
+   void SetTime( real32 const time )
+   {
+      mTime = time;
+      if (!mSceneFileName.empty() && GetSceneFileTime() != mSceneFileTime)
+      {
+         LoadSceneFile();
+      }
+      else if (!mSceneBuilt)
+      {
+         NScene::BuildScene( *mpScene, mTime );
+         FinishScene();
+      }
+      else
+      {
+         mpScene->Animate( mTime );
+      }
+   }
+
+   // Builds the scene from a scene file instead of RenderScene.inl, see NSceneFile,
+   // or maps a compiled scene, see NCompiledScene. The file is loaded again whenever
+   // it changes. Only call this when IsDone() is true, returns false when the file
+   // can't be loaded.
+   bool SetSceneFile( std::string const& fileName )
+   {
+      mSceneFileName = fileName;
+      return LoadSceneFile();
+   }
+
+   // Writes the scene as it is at the current time to a compiled scene file. Only
+   // call this when IsDone() is true.
+   bool WriteCompiledScene( std::string const& fileName )
+   {
+      std::string error;
+      if (!NCompiledScene::Write( *mpScene, fileName, error ))
+      {
+         printf( "%s: %s\n", fileName.c_str(), error.c_str() );
+         return false;
+      }
+      printf( "compiled %s\n", fileName.c_str() );
+      return true;
+   }
+
+   bool IsDone() const
+   {
+      return mFrameLatch == nullptr || mFrameLatch->IsDone();
+   }
+
+   // sleeps until the current frame is finished
+   void Wait()
+   {
+      if (mFrameLatch != nullptr)
+      {
+         mFrameLatch->Wait();
+      }
+   }
+
+   void Cancel()
+   {
+      // throw away the work areas that haven't been started. A pass that is being
+      // queued is either taken here or sees the flag, see QueuePass
+      std::vector< SWorkArea > workAreas;
+      {
+         std::lock_guard<std::mutex> lock( mQueuePassMutex );
+         mCancelFrame = true;
+         for (std::unique_ptr< CWorkQueue > const& workQueue : mWorkQueues)
+         {
+            std::deque< SWorkArea > const queuedWorkAreas = workQueue->TakeAll();
+            mQueuedWorkAreas -= static_cast<uint32_t>(queuedWorkAreas.size());
+            workAreas.insert( workAreas.end(), queuedWorkAreas.begin(), queuedWorkAreas.end() );
+         }
+      }
+
+      // this can finish a pass, which queues nothing now that the frame is canceled
+      for (SWorkArea const& workArea : workAreas)
+      {
+         FinishWorkArea( workArea.mPass );
+      }
+
+      // wait for the work areas that are being rendered
+      Wait();
+#if USE_TEMPORAL_REPROJECTION()
+      std::fill( mGuessTimes.begin(), mGuessTimes.end(), skLargeNumber );
+#endif
+   }
+
+   void ResizeStepBuffers()
+   {
+      size_t const size = mRecordSteps ? mBufferWidth * mBufferHeight : 0;
+      mStepBuffers.mPrimary.assign( size, 0 );
+      mStepBuffers.mShadow.assign( size, 0 );
+      mStepBuffers.mReflection.assign( size, 0 );
+   }
+
+   void ResizeBuffer( uint32_t const width, uint32_t const height )
+   {
+      if (!IsDone())
+      {
+         Cancel();
+      }
+
+      if ( width != mBufferWidth || height != mBufferHeight )
+      {
+         mBuffer = std::unique_ptr< CColor4f >( reinterpret_cast<CColor4f*>(new uint8_t[sizeof( CColor4f ) * width * height]) );
+         mBufferWidth = width;
+         mBufferHeight = height;
+
+         for (uint32_t x = 0; x < width; x++ )
+         {
+            for (uint32_t y = 0; y < height; y++ )
+            {
+               SetPixelColor( x, y, CColor4f( 0.5f, 0.6f, 0.7f ) );
+            }
+         }
+
+         ResizeStepBuffers();
+         mConeStarts.assign( static_cast<size_t>(GetConeBlockCount( width )) * GetConeBlockCount( height ), skMinLength );
+#if USE_TEMPORAL_REPROJECTION()
+         mDepth.assign( static_cast<size_t>(width) * height, skLargeNumber );
+         mGuessTimes.assign( static_cast<size_t>(width) * height, skLargeNumber );
+#endif
+      }
+      mpScene->SetSceneSize( width, height );
+   }
+
+   // starts rendering a new frame if the last one is done, returns the handle of
+   // the frame that is being rendered
+   CFrameHandle RenderScene()
+   {
+      if (IsDone())
+      {
+         mCancelFrame = false;
+         mFrameLatch = std::make_shared< CFrameLatch >();
+         mpScene->BuildTiles( mBufferWidth, mBufferHeight, USE_TILE_CULLING(), USE_TILE_PRUNING() && USE_COMPILED_SDF() );
+#if USE_TEMPORAL_REPROJECTION()
+         QueuePass( 1, mFrameLatch, EPassType::Reproject );
+#else
+         QueueFirstPass( mFrameLatch );
+#endif
+      }
+
+      return CFrameHandle( mFrameLatch );
+   }
+
+   CColor4f const* const GetBuffer() const
+   {
+      return mBuffer.get();
+   }
+
+   uint32_t GetBufferWidth() const
+   {
+      return mBufferWidth;
+   }
+
+   uint32_t GetBufferHeight() const
+   {
+      return mBufferHeight;
+   }
+
+   // the stats are only stable while IsDone() is true
+   std::vector< SRenderStats > const& GetThreadStats() const
+   {
+      return mThreadStats;
+   }
+
+   void ResetStats()
+   {
+      for (SRenderStats& stats : mThreadStats)
+      {
+         stats = SRenderStats();
+      }
+   }
+
+   // record the march steps of every pixel into the step buffers, this
+   // needs COLLECT_RENDER_STATS() and can only be changed when IsDone() is true
+   void SetRecordSteps( bool const recordSteps )
+   {
+      mRecordSteps = recordSteps;
+      ResizeStepBuffers();
+   }
+
+   // see CRelaxedStepper, can only be changed when IsDone() is true
+   void SetRelaxation( real32 const relaxation )
+   {
+      mpScene->SetRelaxation( relaxation );
+   }
+
+   SStepBuffers const& GetStepBuffers() const
+   {
+      return mStepBuffers;
+   }
+
+   void SetPixelColor( uint32_t const x, uint32_t const y, CColor4f const & color )
+   {
+      if (x < mBufferWidth && y < mBufferHeight)
+      {
+         mBuffer.get()[y * mBufferWidth + x] = color;
+      }
+   }
+
+   void SetPixelSteps( uint32_t const x, uint32_t const y, uint32_t const blockSize, SRenderStats const& statsAfter, SRenderStats const& statsBefore )
+   {
+      uint32_t const primarySteps = static_cast<uint32_t>(statsAfter.mPrimarySteps - statsBefore.mPrimarySteps);
+      uint32_t const shadowSteps = static_cast<uint32_t>(statsAfter.mShadowSteps - statsBefore.mShadowSteps);
+      uint32_t const reflectionSteps = static_cast<uint32_t>(statsAfter.mReflectionSteps - statsBefore.mReflectionSteps);
+
+      for (uint32_t j = y; j < NMath::min_val( y + blockSize, mBufferHeight ); ++j)
+      {
+         for (uint32_t i = x; i < NMath::min_val( x + blockSize, mBufferWidth ); ++i)
+         {
+            uint32_t const index = j * mBufferWidth + i;
+            mStepBuffers.mPrimary[index] = primarySteps;
+            mStepBuffers.mShadow[index] = shadowSteps;
+            mStepBuffers.mReflection[index] = reflectionSteps;
+         }
+      }
+   }
+
+private:
+
+   // the first pass that renders the frame, after the depths have been reprojected
+   void QueueFirstPass( CFrameLatch::TPtr const& frameLatch )
+   {
+#if USE_CONE_PREPASS()
+      QueuePass( skConeBlockSize, frameLatch, EPassType::Cone );
+#else
+      QueuePass( skInitialStepSize, frameLatch );
+#endif
+   }
+
+   void FinishScene()
+   {
+      mpScene->Animate( mTime );
+      mpScene->Compile();
+      mpScene->SetSceneSize( mBufferWidth, mBufferHeight );
+      mSceneBuilt = true;
+   }
+
+   std::filesystem::file_time_type GetSceneFileTime() const
+   {
+      std::error_code errorCode;
+      std::filesystem::file_time_type const fileTime = std::filesystem::last_write_time( mSceneFileName, errorCode );
+      return errorCode ? std::filesystem::file_time_type::min() : fileTime;
+   }
+
+   // A file with errors leaves the scene the way it was. The file is built into a
+   // scene of its own, which takes the place of the old one when it has no errors.
+   // A compiled scene is checked before it replaces the scene and is used as it is.
+   bool LoadSceneFile()
+   {
+      mSceneFileTime = GetSceneFileTime();
+
+      std::string text;
+      std::string error;
+      std::unique_ptr< CRenderScene > pScene = std::make_unique< CRenderScene >();
+      bool const compiled = NCompiledScene::IsCompiledScene( mSceneFileName );
+      bool const loaded = compiled ? NCompiledScene::Load( mSceneFileName, *mpScene, error ) :
+         NSceneFile::ReadFile( mSceneFileName, text, error ) && NSceneFile::BuildScene( text, *pScene, error );
+      if (!loaded)
+      {
+         printf( "%s: %s\n", mSceneFileName.c_str(), error.c_str() );
+         if (mSceneBuilt)
+         {
+            mpScene->Animate( mTime );
+         }
+         return false;
+      }
+
+      if (compiled)
+      {
+         mpScene->SetSceneSize( mBufferWidth, mBufferHeight );
+         mSceneBuilt = true;
+         if (!error.empty())
+         {
+            printf( "%s: %s\n", mSceneFileName.c_str(), error.c_str() );
+         }
+      }
+      else
+      {
+         pScene->SetRelaxation( mpScene->GetRelaxation() );
+         mpScene = std::move( pScene );
+         FinishScene();
+      }
+      printf( "loaded %s\n", mSceneFileName.c_str() );
+      return true;
+   }
+
+   // queues the work areas of a pass, they are spread out over all of the threads
+   void QueuePass( uint32_t const stepSize, CFrameLatch::TPtr const& frameLatch, EPassType const type = EPassType::Pixels )
+   {
+      SRenderPass pass;
+      pass.mStepSize = stepSize;
+      pass.mType = type;
+      pass.mFrameLatch = frameLatch;
+      pass.mPassLatch = std::make_shared< CFrameLatch >();
+
+      // create a whole bunch of render work areas
+      std::vector< SWorkArea > workAreas;
+
+#if 1
+      uint32_t const jobCount = std::thread::hardware_concurrency() * skJobCoreMultiplier;
+
+      // break everything up into workable squares
+      uint32_t const edgeJobCount = static_cast<uint32_t>(NMath::max_val( sqrtf( static_cast<real32>(jobCount) ), 1.f ));
+      
+      uint32_t const hStepSize = NMath::max_val( 1u, mBufferWidth / edgeJobCount );
+      uint32_t const vStepSize = NMath::max_val( 1u, mBufferHeight / edgeJobCount );
+
+      for (uint32_t y = 0; y < mBufferHeight; y += vStepSize)
+      {
+         for (uint32_t x = 0; x < mBufferWidth; x += hStepSize)
+         {
+            workAreas.push_back( SWorkArea( x, y, NMath::min_val( mBufferWidth, x + hStepSize ), NMath::min_val( mBufferHeight, y + vStepSize ), pass ) );
+         }
+      }
+#else
+      workAreas.push_back( SWorkArea( mBufferWidth/2-2, mBufferHeight/2, mBufferWidth/2+2, mBufferHeight, pass ) );
+#endif
+
+      uint32_t const workAreaCount = static_cast<uint32_t>(workAreas.size());
+      if (workAreaCount == 0)
+      {
+         return;
+      }
+
+      // every thread starts out with its own band of the screen. The count goes
+      // up first so it can't go below zero when a work area is taken right away
+      {
+         // a worker can finish a pass just as the frame is canceled, the new pass
+         // must not be queued after Cancel emptied the queues
+         std::lock_guard<std::mutex> lock( mQueuePassMutex );
+         if (mCancelFrame)
+         {
+            return;
+         }
+
+         frameLatch->Add( 1 );
+         pass.mPassLatch->Add( workAreaCount );
+         mQueuedWorkAreas += workAreaCount;
+         for (uint32_t i = 0; i < workAreaCount; ++i)
+         {
+            mWorkQueues[static_cast<size_t>(i) * mWorkQueues.size() / workAreaCount]->Push( workAreas[i] );
+         }
+      }
+
+      WakeThreads();
+   }
+
+   void FinishWorkArea( SRenderPass const& pass )
+   {
+      if (pass.mPassLatch->CountDown( 1 ))
+      {
+         // The next pass can only start once this one is finished, otherwise its
+         // smaller blocks could get painted over by the bigger blocks of this pass
+         if (pass.mType == EPassType::Reproject)
+         {
+            // the depths that are rendered from now on are for the camera of this frame
+            mDepthCamera = mpScene->GetCamera();
+            if (!mCancelFrame)
+            {
+               QueueFirstPass( pass.mFrameLatch );
+            }
+         }
+         else if (pass.mType == EPassType::Cone && !mCancelFrame)
+         {
+            QueuePass( skInitialStepSize, pass.mFrameLatch );
+         }
+         else if (pass.mStepSize > 1 && !mCancelFrame)
+         {
+            QueuePass( pass.mStepSize / 2, pass.mFrameLatch );
+         }
+         pass.mFrameLatch->CountDown( 1 );
+      }
+   }
+
+   // take work from this thread's queue first, then steal from the other threads
+   bool NextWorkArea( uint32_t const threadIndex, SWorkArea& workArea )
+   {
+      uint32_t const queueCount = static_cast<uint32_t>(mWorkQueues.size());
+
+      bool found = mWorkQueues[threadIndex]->Pop( workArea );
+      for (uint32_t i = 1; i < queueCount && !found; ++i)
+      {
+         found = mWorkQueues[(threadIndex + i) % queueCount]->Steal( workArea );
+      }
+
+      if (found)
+      {
+         --mQueuedWorkAreas;
+      }
+      return found;
+   }
+
+   void RenderWorkArea( uint32_t const threadIndex, SWorkArea& workArea )
+   {
+      uint32_t const stepSize = workArea.mPass.mStepSize;
+
+      if (workArea.mPass.mType == EPassType::Reproject)
+      {
+         ReprojectDepth( threadIndex, workArea );
+         return;
+      }
+
+      if (workArea.mPass.mType == EPassType::Cone)
+      {
+         MarchCones( threadIndex, workArea );
+         return;
+      }
+
+      // the pixels that are a multiple of twice the step size were rendered by an earlier pass
+      uint32_t const skipMask = stepSize < skInitialStepSize ? stepSize * 2 - 1 : 0;
+
+      for (uint32_t y = AlignToStep( workArea.mMinY, stepSize ); y < workArea.mMaxY; y += stepSize)
+      {
+         if (mHungryThreads > 0)
+         {
+            SplitWorkArea( threadIndex, workArea, y, stepSize );
+         }
+
+         SRayPacket packet;
+         packet.mY = y;
+
+         for (uint32_t x = AlignToStep( workArea.mMinX, stepSize ); x < workArea.mMaxX; x += stepSize)
+         {
+            if (skipMask != 0 && (x & skipMask) == 0 && (y & skipMask) == 0)
+            {
+               continue;
+            }
+
+            // the pixels of a packet share the objects of their tile
+            if (packet.mCount > 0 && x / skTileSize != packet.mX[0] / skTileSize)
+            {
+               RenderPacket( threadIndex, packet, stepSize );
+               packet.mCount = 0;
+            }
+
+            packet.mX[packet.mCount++] = x;
+            if (packet.mCount == SPointPacket::skWidth)
+            {
+               RenderPacket( threadIndex, packet, stepSize );
+               packet.mCount = 0;
+            }
+         }
+
+         if (packet.mCount > 0)
+         {
+            RenderPacket( threadIndex, packet, stepSize );
+         }
+      }
+   }
+
+   // Moves the depths of the last frame in the work area to the pixels that they
+   // are in for the camera of this frame, the closest one is kept when several land
+   // on a pixel. The pixels can be in any work area, so the guesses are written with
+   // atomics. A guess is used up when its pixel is rendered, and the depths of this
+   // frame are written over the old ones.
+   void ReprojectDepth( uint32_t const threadIndex, SWorkArea& workArea )
+   {
+      CCamera const& camera = mpScene->GetCamera();
+      CVector3f const cameraPosition = camera.GetCameraTransform().GetTranslation();
+
+      for (uint32_t y = workArea.mMinY; y < workArea.mMaxY; ++y)
+      {
+         if (mHungryThreads > 0)
+         {
+            SplitWorkArea( threadIndex, workArea, y, 1 );
+         }
+
+         for (uint32_t x = workArea.mMinX; x < workArea.mMaxX; ++x)
+         {
+            real32& depth = mDepth[y * mBufferWidth + x];
+            if (depth >= skMaxLength)
+            {
+               continue;
+            }
+
+            CVector3f const point = mDepthCamera.GetRayForPosition( x, y ).GetPositionAlongRay( depth );
+            depth = skLargeNumber;
+
+            real32 pixelX = 0.f;
+            real32 pixelY = 0.f;
+            if (camera.GetPositionForPoint( point, pixelX, pixelY ) && pixelX > -0.5f && pixelY > -0.5f)
+            {
+               uint32_t const newX = static_cast<uint32_t>(pixelX + 0.5f);
+               uint32_t const newY = static_cast<uint32_t>(pixelY + 0.5f);
+               if (newX < mBufferWidth && newY < mBufferHeight)
+               {
+                  real32 const newTime = (point - cameraPosition).Magnitude() * (1.f - skReprojectionMargin);
+                  std::atomic_ref< real32 > guessTime( mGuessTimes[newY * mBufferWidth + newX] );
+                  real32 oldTime = guessTime.load( std::memory_order_relaxed );
+                  while (newTime < oldTime && !guessTime.compare_exchange_weak( oldTime, newTime, std::memory_order_relaxed ))
+                  {
+                  }
+               }
+            }
+         }
+      }
+   }
+
+   // marches the cones of the blocks that start in the work area
+   void MarchCones( uint32_t const threadIndex, SWorkArea& workArea )
+   {
+      for (uint32_t y = AlignToStep( workArea.mMinY, skConeBlockSize ); y < workArea.mMaxY; y += skConeBlockSize)
+      {
+         if (mHungryThreads > 0)
+         {
+            SplitWorkArea( threadIndex, workArea, y, skConeBlockSize );
+         }
+
+         for (uint32_t x = AlignToStep( workArea.mMinX, skConeBlockSize ); x < workArea.mMaxX; x += skConeBlockSize)
+         {
+            mConeStarts[GetConeIndex( x, y )] = mpScene->MarchCone( x, y, skConeBlockSize );
+         }
+      }
+   }
+
+   static uint32_t GetConeBlockCount( uint32_t const pixels )
+   {
+      return (pixels + skConeBlockSize - 1) / skConeBlockSize;
+   }
+
+   uint32_t GetConeIndex( uint32_t const x, uint32_t const y ) const
+   {
+      return (y / skConeBlockSize) * GetConeBlockCount( mBufferWidth ) + x / skConeBlockSize;
+   }
+
+   real32 GetStartTime( uint32_t const x, uint32_t const y ) const
+   {
+#if USE_CONE_PREPASS()
+      return mConeStarts[GetConeIndex( x, y )];
+#else
+      UNREFERENCED_PARAMETER( x );
+      UNREFERENCED_PARAMETER( y );
+      return skMinLength;
+#endif
+   }
+
+   // the guess can only be used once, see ValidateStartTime
+   real32 TakeGuessTime( uint32_t const x, uint32_t const y )
+   {
+#if USE_TEMPORAL_REPROJECTION()
+      real32 const guessTime = mGuessTimes[y * mBufferWidth + x];
+      mGuessTimes[y * mBufferWidth + x] = skLargeNumber;
+      return guessTime;
+#else
+      UNREFERENCED_PARAMETER( x );
+      UNREFERENCED_PARAMETER( y );
+      return skLargeNumber;
+#endif
+   }
+
+   // renders the pixels of a packet, each one fills a block of stepSize pixels
+   void RenderPacket( uint32_t const threadIndex, SRayPacket& packet, uint32_t const stepSize )
+   {
+#if USE_RAY_PACKETS()
+      for (uint32_t lane = 0; lane < packet.mCount; ++lane)
+      {
+         packet.mTime[lane] = GetStartTime( packet.mX[lane], packet.mY );
+#if USE_TEMPORAL_REPROJECTION()
+         packet.mGuessTime[lane] = TakeGuessTime( packet.mX[lane], packet.mY );
+#endif
+      }
+      mpScene->MarchRayPacket( packet );
+#endif
+
+      for (uint32_t lane = 0; lane < packet.mCount; ++lane)
+      {
+         uint32_t const x = packet.mX[lane];
+         uint32_t const y = packet.mY;
+
+#if COLLECT_RENDER_STATS()
+         SRenderStats const statsBefore = mThreadStats[threadIndex];
+#endif
+#if USE_RAY_PACKETS()
+         CColor4f const color = mpScene->DoPacketIntersection( packet, lane );
+         real32 const hitTime = packet.mHit[lane] ? packet.mTime[lane] : skLargeNumber;
+#else
+         real32 hitTime;
+         CColor4f const color = mpScene->DoIntersection( x, y, GetStartTime( x, y ), TakeGuessTime( x, y ), hitTime );
+#endif
+#if USE_TEMPORAL_REPROJECTION()
+         mDepth[y * mBufferWidth + x] = hitTime;
+#else
+         UNREFERENCED_PARAMETER( hitTime );
+#endif
+
+         for (uint32_t i = 0; i < stepSize; ++i)
+         {
+            for (uint32_t j = 0; j < stepSize; ++j)
+            {
+               SetPixelColor( x + i, y + j, color );
+            }
+         }
+
+#if COLLECT_RENDER_STATS()
+         if (mRecordSteps)
+         {
+            SetPixelSteps( x, y, stepSize, mThreadStats[threadIndex], statsBefore );
+         }
+#endif
+      }
+   }
+
+   // Another thread ran out of work, give it the bottom half of the rows that
+   // haven't been rendered yet. This keeps the expensive areas at the end of a
+   // frame from being stuck on a single thread.
+   void SplitWorkArea( uint32_t const threadIndex, SWorkArea& workArea, uint32_t const currentY, uint32_t const stepSize )
+   {
+      uint32_t const remainingRows = (workArea.mMaxY - currentY + stepSize - 1) / stepSize;
+      if (remainingRows < skMinSplitRows * 2)
+      {
+         return;
+      }
+
+      uint32_t const splitY = currentY + (remainingRows / 2) * stepSize;
+
+      workArea.mPass.mPassLatch->Add( 1 );
+      ++mQueuedWorkAreas;
+      mWorkQueues[threadIndex]->Push( SWorkArea( workArea.mMinX, splitY, workArea.mMaxX, workArea.mMaxY, workArea.mPass ) );
+      workArea.mMaxY = splitY;
+
+      WakeThreads();
+   }
+
+   static uint32_t AlignToStep( uint32_t const value, uint32_t const stepSize )
+   {
+      return (value + stepSize - 1) / stepSize * stepSize;
+   }
+
+   void WakeThreads()
+   {
+      // taking the lock makes sure a thread that is about to sleep sees the new state
+      {
+         std::lock_guard<std::mutex> lock( mSleepControlMutex );
+      }
+      mSleepControl.notify_all();
+   }
+
+   uint32_t mBufferWidth{ 0 };
+   uint32_t mBufferHeight{ 0 };
+   real32 mTime{ 0.f };
+   std::unique_ptr< CColor4f > mBuffer;
+   // a pointer so that a scene loaded from a file can take its place
+   std::unique_ptr< CRenderScene > mpScene{ std::make_unique< CRenderScene >() };
+   bool mSceneBuilt{ false };
+   std::string mSceneFileName;
+   std::filesystem::file_time_type mSceneFileTime;
+
+   // thread control
+   std::vector< std::unique_ptr< CWorkQueue > > mWorkQueues;
+   std::vector< std::unique_ptr< std::thread > > mThreads;
+   std::vector< SRenderStats > mThreadStats;
+   SStepBuffers mStepBuffers;
+   bool mRecordSteps{ false };
+   // where the primary rays of each block start, filled in by the cone pass
+   std::vector< real32 > mConeStarts;
+   // where the primary ray of each pixel hit a surface, mDepthCamera is the
+   // camera that the depths were rendered with
+   std::vector< real32 > mDepth;
+   CCamera mDepthCamera{ CCamera::DefaultCamera() };
+   // the depths of the last frame moved to the pixels of this frame, the ones
+   // that a canceled frame didn't use up are thrown away
+   std::vector< real32 > mGuessTimes;
+
+   // the frame that is being rendered
+   CFrameLatch::TPtr mFrameLatch;
+   std::atomic<bool> mCancelFrame{ false };
+   // held while mCancelFrame is set and the queues are emptied, and while a pass is queued
+   std::mutex mQueuePassMutex;
+   // work areas sitting in the queues
+   std::atomic<uint32_t> mQueuedWorkAreas{ 0 };
+   std::atomic<uint32_t> mHungryThreads{ 0 };
+   std::atomic<bool> mShutdown = false;
+   std::condition_variable mSleepControl;
+   std::mutex mSleepControlMutex;
+};
+
+#if HEADLESS_RENDER()
+
+//-----------------------------------------------------------------------------
+// Command line rendering, every frame is rendered as fast as possible and
+// written out as a binary ppm file
+
+namespace
+{
+   // the benchmark always renders the same frames so runs can be compared
+   uint32_t constexpr skBenchmarkWidth = 640;
+   uint32_t constexpr skBenchmarkHeight = 480;
+   real32 constexpr skBenchmarkStartTime = 0.f;
+   real32 constexpr skBenchmarkTimeStep = 0.1f;
+
+   // step counts at or above this are drawn with the hottest heatmap color
+   uint32_t constexpr skHeatmapMaxSteps = skMaxMarchSteps;
+
+   // how many step counts share one row of the step histogram
+   uint32_t constexpr skHistogramBucketSize = 8;
+
+   // The tests render a unit sphere with each of these transforms and check that
+   // every pixel that its rays go through is drawn. They are for the parts of the
+   // renderer that skip work, like the bounds and the screen tiles, which must
+   // never cut off a visible surface. Rotating and then scaling non-uniformly
+   // stretches the sphere along a diagonal, past the scale of any one axis.
+   char const* const skTestTransforms[] =
+   {
+      "",
+      "scale 6 0.5 1 rotatez 45",
+      "scale 3 1 1 rotatez 45",
+      "scale 1 4 1 rotatex 60 translate 2 0 0",
+   };
+   uint32_t constexpr skTestWidth = 200;
+   uint32_t constexpr skTestHeight = 150;
+   char const* const skTestCamera = "camera position 0 0 -25 lookat 0 0 0\n";
+
+   // rays that pass this close to the edge of the sphere may miss it, measured as
+   // the squared distance from the center of the unit sphere
+   real32 constexpr skTestEdge = 0.95f;
+
+   // A scene with every kind of primitive and csg object for the tests of the
+   // distances. The torus is a custom object and is added on its own, since
+   // some tests need a scene that can be compiled to a file.
+   char const* const skTestScene =
+      "camera position 0 15 15 lookat 0 0 0\n"
+      "plane 0 1 0 translate 0 -5 0 color 0.5 0.5 0.5\n"
+      "difference { sphere 3 cube 2 translate 1 0 1 } translate -6 0 0\n"
+      "smoothunion 0.5 { cube 3 translate 1.25 0 0 sphere 1.5 translate -1.25 0 0 sphere 1 translate 0 2 0 } rotatey 30 translate 6 0 0\n"
+      "blend 1.3 { cube 3 union { sphere 2 cube 1 translate 3 0 0 } cube 1 } scale 1 2 1\n"
+      "intersection { sphere 2 cube 1.5 rotatex 45 } translate 0 0 6\n"
+      "union { sphere 1 translate 0 0 -6 cube 1 scale 2 1 1 rotatez 20 translate 2 0 -6 }\n"
+      "smoothunion 2 { sphere 1 translate -1.75 0 0 sphere 1 translate 1.75 0 0 sphere 1 translate 0 0 1.75 } translate 0 3 -3\n"
+      "difference { union { cube 3 sphere 1 translate 0 1.5 0 } sphere 1.5 translate 1.5 0 0 } translate 0 6 0\n";
+   char const* const skTestCustomObject = "torus 1 2 translate 0 4 0\n";
+
+   // the distances are compared at this many points in a box of this half size
+   // around the test scene
+   uint32_t constexpr skTestPointCount = 4096;
+   real32 constexpr skTestExtent = 12.f;
+
+   // distances that are computed in a different order may be this far apart,
+   // relative to the size of the distance
+   real32 constexpr skTestTolerance = 1e-4f;
+
+   // scene files with a mistake in them and the line that it has to be reported on
+   struct SBadScene
+   {
+      char const* mpText;
+      uint32_t mLine;
+   };
+   SBadScene const skTestBadScenes[] =
+   {
+      { "sphere 1\ncube\n", 2 },
+      { "sphere 1\ncone 2\n", 2 },
+      { "union\n{\n   sphere 1\n", 3 },
+      { "}\n", 1 },
+      { "sphere 1 color 1 1\n", 1 },
+      { "sphere 1 translate 0 0\n", 1 },
+      { "sphere (1 + time)\n", 1 },
+      { "\nsphere 1 $\n", 2 },
+      { "sphere 1\nsphere .\n", 2 },
+      { "camera position 0 0\n", 1 },
+      { "pointlight color 1 1 1\n", 1 },
    };
 
-   // convenience types
-   using vector3 = CVector3f;
-   using color = CColor4f;
+   // the compiled scenes of the tests are written to these files in the temporary directory
+   char const* const skTestCompiledFile = "raymarcher_test.rmscene";
+   char const* const skTestDamagedFile = "raymarcher_test_damaged.rmscene";
 
-   // camera
-   using camera = CCamera;
+   // this many regions are pruned on their own, they are boxes of up to this size,
+   // and the program of each one is checked with this slack at this many points in it
+   uint32_t constexpr skTestRegionCount = 16384;
+   real32 constexpr skTestRegionSize = 2.f;
+   real32 constexpr skTestRegionSlack = 0.25f;
+   uint32_t constexpr skTestRegionPoints = 16;
 
-   // materials
-   using surface = SSurfaceInfo;
-   using material = CMaterialContainer;
-   using checker = TMaterialContainer< CCheckerMaterialObject >;
-   using gradient = TMaterialContainer< CGradientMaterialObject >;
-   using custom_material = TMaterialContainer< CCustomMaterialObject >;
+   struct SHeadlessOptions
+   {
+      uint32_t mWidth{ skDefaultWidth };
+      uint32_t mHeight{ skDefaultHeight };
+      uint32_t mFrameCount{ 1 };
+      real32 mStartTime{ 0.f };
+      real32 mTimeStep{ 0.1f };
+      std::string mOutputPrefix{ "frame" };
+      std::string mHeatmapPrefix;
+      std::string mSceneFileName;
+      std::string mCompiledFileName;
+      real32 mRelaxation{ skDefaultRelaxation };
+      bool mBenchmark{ false };
+   };
 
-   // objects
-   using object = CObjectContainer;
-   using sphere = TObjectContainer<CRenderSphere>;
-   using plane = TObjectContainer<CRenderPlane>;
-   using cube = TObjectContainer<CRenderCube>;
-   using custom = TObjectContainer<CRenderCustom>;
+   void print_usage()
+   {
+      printf( "usage: RayMarcher [-width pixels] [-height pixels] [-frames count] [-time start] [-step delta] [-output prefix] [-heatmap prefix] [-relaxation factor] [-scene file]\n" );
+      printf( "       RayMarcher -compile file [-time start] [-scene file]\n" );
+      printf( "       RayMarcher -benchmark frames [-relaxation factor]\n" );
+      printf( "       RayMarcher -test\n" );
+   }
 
-   // csg operations
-   using csg_union = TObjectContainer<CRenderUnion>;
-   using csg_intersection = TObjectContainer<CRenderIntersection>;
-   using csg_difference = TObjectContainer<CRenderDifference>;
-   using csg_smoothunion = TObjectContainer<CRenderSmoothUnion>;
+   // reads a whole number of the option, a sign or anything after the digits is a mistake
+   bool parse_count( char const* const option, char const* const value, uint32_t& count )
+   {
+      char* pEnd = nullptr;
+      unsigned long long const number = isdigit( static_cast<unsigned char>(value[0]) ) ? strtoull( value, &pEnd, 10 ) : 0;
+      if (pEnd == nullptr || *pEnd != '\0' || number > UINT32_MAX)
+      {
+         printf( "%s needs a whole number from 0 to %u, not '%s'\n", option, UINT32_MAX, value );
+         return false;
+      }
+      count = static_cast<uint32_t>(number);
+      return true;
+   }
 
-   using blend = TObjectContainer<CRenderBlend>;
+   bool parse_real( char const* const option, char const* const value, real32& real )
+   {
+      char* pEnd = nullptr;
+      real32 const number = strtof( value, &pEnd );
+      if (pEnd == value || *pEnd != '\0' || !std::isfinite( number ))
+      {
+         printf( "%s needs a number, not '%s'\n", option, value );
+         return false;
+      }
+      real = number;
+      return true;
+   }
 
-   // lights
-   using attenuation = SAttenuationInfo;
-   using ambientlight = TLightObjectContainer<CAmbientLightObject>;
-   using directionallight = TLightObjectContainer<CDirectionalLightObject>;
-   using pointlight = TLightObjectContainer<CPointLightObject>;
-   using spotlight = TLightObjectContainer<CSpotLightObject>;
-   
+   bool parse_options( int const argc, char* argv[], SHeadlessOptions& options )
+   {
+      for (int i = 1; i < argc; i += 2)
+      {
+         char const* const option = argv[i];
+         if (i + 1 >= argc)
+         {
+            print_usage();
+            return false;
+         }
+         char const* const value = argv[i + 1];
+
+         if (strcmp( option, "-width" ) == 0)
+         {
+            if (!parse_count( option, value, options.mWidth ))
+            {
+               print_usage();
+               return false;
+            }
+         }
+         else if (strcmp( option, "-height" ) == 0)
+         {
+            if (!parse_count( option, value, options.mHeight ))
+            {
+               print_usage();
+               return false;
+            }
+         }
+         else if (strcmp( option, "-frames" ) == 0)
+         {
+            if (!parse_count( option, value, options.mFrameCount ))
+            {
+               print_usage();
+               return false;
+            }
+         }
+         else if (strcmp( option, "-time" ) == 0)
+         {
+            if (!parse_real( option, value, options.mStartTime ))
+            {
+               print_usage();
+               return false;
+            }
+         }
+         else if (strcmp( option, "-step" ) == 0)
+         {
+            if (!parse_real( option, value, options.mTimeStep ))
+            {
+               print_usage();
+               return false;
+            }
+         }
+         else if (strcmp( option, "-output" ) == 0)
+         {
+            options.mOutputPrefix = value;
+         }
+         else if (strcmp( option, "-heatmap" ) == 0)
+         {
+            options.mHeatmapPrefix = value;
+         }
+         else if (strcmp( option, "-scene" ) == 0)
+         {
+            options.mSceneFileName = value;
+         }
+         else if (strcmp( option, "-compile" ) == 0)
+         {
+            options.mCompiledFileName = value;
+         }
+         else if (strcmp( option, "-relaxation" ) == 0)
+         {
+            if (!parse_real( option, value, options.mRelaxation ))
+            {
+               print_usage();
+               return false;
+            }
+         }
+         else if (strcmp( option, "-benchmark" ) == 0)
+         {
+            options.mBenchmark = true;
+            if (!parse_count( option, value, options.mFrameCount ))
+            {
+               print_usage();
+               return false;
+            }
+         }
+         else
+         {
+            printf( "unknown option %s\n", option );
+            print_usage();
+            return false;
+         }
+      }
+
+      if (options.mWidth == 0 || options.mHeight == 0)
+      {
+         printf( "-width and -height can't be 0\n" );
+         print_usage();
+         return false;
+      }
+      if (!(options.mRelaxation >= 1.f && options.mRelaxation < 2.f))
+      {
+         printf( "-relaxation has to be at least 1 and less than 2\n" );
+         print_usage();
+         return false;
+      }
+      return true;
+   }
+
+   uint8_t color_to_byte( real32 const value )
+   {
+      return static_cast<uint8_t>(NMath::max_val( 0.f, NMath::min_val( 1.f, value ) ) * 255.0);
+   }
+
+   bool write_image( std::string const& fileName, CColor4f const* const buffer, uint32_t const width, uint32_t const height )
+   {
+      std::ofstream file( fileName, std::ios::binary );
+      if (!file)
+      {
+         return false;
+      }
+
+      file << "P6\n" << width << " " << height << "\n255\n";
+
+      std::vector< uint8_t > row( width * 3 );
+      for (uint32_t y = 0; y < height; ++y)
+      {
+         for (uint32_t x = 0; x < width; ++x)
+         {
+            CColor4f const& color = buffer[y * width + x];
+            row[x * 3 + 0] = color_to_byte( color.GetRed() );
+            row[x * 3 + 1] = color_to_byte( color.GetGreen() );
+            row[x * 3 + 2] = color_to_byte( color.GetBlue() );
+         }
+         file.write( reinterpret_cast<char const*>(row.data()), static_cast<std::streamsize>(row.size()) );
+      }
+
+      return file.good();
+   }
+
+   CColor4f const heat_color( uint32_t const steps )
+   {
+      static CColor4f const skRamp[] =
+      {
+         CColor4f( 0.f, 0.f, 0.f ),
+         CColor4f( 0.f, 0.f, 1.f ),
+         CColor4f( 0.f, 1.f, 0.f ),
+         CColor4f( 1.f, 1.f, 0.f ),
+         CColor4f( 1.f, 0.f, 0.f ),
+      };
+      uint32_t constexpr skLastColor = sizeof( skRamp ) / sizeof( skRamp[0] ) - 1;
+
+      real32 const position = NMath::min_val( 1.f, steps / static_cast<real32>(skHeatmapMaxSteps) ) * skLastColor;
+      uint32_t const index = NMath::min_val( static_cast<uint32_t>(position), skLastColor - 1 );
+      return CColor4f::Lerp( skRamp[index], skRamp[index + 1], position - index );
+   }
+
+   bool write_heatmap( std::string const& fileName, std::vector< uint32_t > const& steps, uint32_t const width, uint32_t const height )
+   {
+      std::vector< CColor4f > colors;
+      colors.reserve( steps.size() );
+      for (uint32_t const pixelSteps : steps)
+      {
+         colors.push_back( heat_color( pixelSteps ) );
+      }
+      return write_image( fileName, colors.data(), width, height );
+   }
+
+   // one row for every bucket of step counts with the number of pixels that fell into it,
+   // the last row holds everything at or above skHeatmapMaxSteps
+   bool write_histogram( std::string const& fileName, SStepBuffers const& stepBuffers )
+   {
+      std::ofstream file( fileName );
+      if (!file)
+      {
+         return false;
+      }
+
+      uint32_t constexpr skBucketCount = skHeatmapMaxSteps / skHistogramBucketSize + 1;
+
+      auto const fill_buckets = []( std::vector< uint32_t > const& steps )
+      {
+         std::vector< uint32_t > buckets( skBucketCount, 0 );
+         for (uint32_t const pixelSteps : steps)
+         {
+            ++buckets[NMath::min_val( pixelSteps / skHistogramBucketSize, skBucketCount - 1 )];
+         }
+         return buckets;
+      };
+
+      std::vector< uint32_t > const primary = fill_buckets( stepBuffers.mPrimary );
+      std::vector< uint32_t > const shadow = fill_buckets( stepBuffers.mShadow );
+      std::vector< uint32_t > const reflection = fill_buckets( stepBuffers.mReflection );
+
+      file << "steps,primary,shadow,reflection\n";
+      for (uint32_t i = 0; i < skBucketCount; ++i)
+      {
+         file << i * skHistogramBucketSize << "," << primary[i] << "," << shadow[i] << "," << reflection[i] << "\n";
+      }
+
+      return file.good();
+   }
+
+   bool write_step_instrumentation( std::string const& prefix, uint32_t const frame, CRenderer const& renderer )
+   {
+      SStepBuffers const& stepBuffers = renderer.GetStepBuffers();
+      uint32_t const width = renderer.GetBufferWidth();
+      uint32_t const height = renderer.GetBufferHeight();
+
+      char frameName[32];
+      snprintf( frameName, sizeof( frameName ), "_%04u", frame );
 
-   // convenience functions
-   CTransform4f translate( real32 const x, real32 const y, real32 const z ) { return CTransform4f::Translate( x, y, z ); }
-   CTransform4f translate( CVector3f const & translation ) { return CTransform4f::Translate( translation ); }
-   CTransform4f scale( real32 const x, real32 const y, real32 const z ) { return CTransform4f::Scale( x, y, z ); }
-   CTransform4f scale( CVector3f const& transformScale ) { return CTransform4f::Scale( transformScale ); }
-   CTransform4f scale( real32 const value ) { return CTransform4f::Scale( value, value, value ); }
-   CTransform4f rotatex( real32 const angle ) { return CTransform4f::RotateX( CRelAngle::FromDegrees( angle ) ); }
-   CTransform4f rotatey( real32 const angle ) { return CTransform4f::RotateY( CRelAngle::FromDegrees( angle ) ); }
-   CTransform4f rotatez( real32 const angle ) { return CTransform4f::RotateZ( CRelAngle::FromDegrees( angle ) ); }
-   CTransform4f rotate( real32 const x, real32 const y, real32 const z) 
-   { 
       return
-         CTransform4f::RotateX( CRelAngle::FromDegrees( x ) ) *
-         CTransform4f::RotateY( CRelAngle::FromDegrees( y ) ) *
-         CTransform4f::RotateZ( CRelAngle::FromDegrees( z ) );
+         write_heatmap( prefix + "_primary" + frameName + ".ppm", stepBuffers.mPrimary, width, height ) &&
+         write_heatmap( prefix + "_shadow" + frameName + ".ppm", stepBuffers.mShadow, width, height ) &&
+         write_heatmap( prefix + "_reflection" + frameName + ".ppm", stepBuffers.mReflection, width, height ) &&
+         write_histogram( prefix + frameName + ".csv", stepBuffers );
    }
 
-   real32 length( CVector3f const& v ) { return v.Magnitude(); }
-   CVector3f normalize( CVector3f const& v ) { return v.AsNormalized(); }
+   // returns the time it took to build and render the frame in milliseconds
+   double render_frame( CRenderer& renderer, real32 const time )
+   {
+      auto const startTime = std::chrono::steady_clock::now();
 
-   real32 minf( real32 const lhs, real32 const rhs ) { return lhs < rhs ? lhs : rhs; }
-   real32 maxf( real32 const lhs, real32 const rhs ) { return lhs > rhs ? lhs : rhs; }
-   real32 round_mod( real32 const x, real32 const y ) { return x - y * roundf( x / y ); }
-   real32 mod( real32 const x, real32 const y ) { return x - y * floorf( x / y ); }
-   real32 clamp( real32 const minValue, real32 const value, real32 const maxValue ) { return NMath::clamp( minValue, value, maxValue ); }
-   CVector3f clamp( CVector3f const & minValue, CVector3f const value, CVector3f const & maxValue ) 
-   { return CVector3f( clamp( minValue.x, value.x, maxValue.x ), clamp( minValue.y, value.y, maxValue.y ), clamp( minValue.z, value.z, maxValue.z ) ); }
+      renderer.SetTime( time );
+      renderer.RenderScene().Wait();
+
+      std::chrono::duration<double, std::milli> const renderTime = std::chrono::steady_clock::now() - startTime;
+      return renderTime.count();
+   }
+
+   void print_stats( char const* const label, SRenderStats const& stats, double const milliseconds )
+   {
+      double const perSecond = 1000.0 / NMath::max_val( milliseconds, 0.001 );
+      printf( "%-10s %10.1f %12.0f %12.0f %12.0f %14.0f\n",
+              label,
+              milliseconds,
+              static_cast<double>(stats.mPrimaryRays) * perSecond,
+              static_cast<double>(stats.mShadowRays) * perSecond,
+              static_cast<double>(stats.mReflectionRays) * perSecond,
+              static_cast<double>(stats.mDistanceEvaluations) * perSecond );
+   }
+
+   // the march steps of the benchmark frames without relaxation
+   SRenderStats count_plain_steps( uint32_t const frameCount )
+   {
+      CRenderer renderer;
+      renderer.ResizeBuffer( skBenchmarkWidth, skBenchmarkHeight );
+      renderer.SetRelaxation( 1.f );
+
+      SRenderStats total;
+      for (uint32_t frame = 0; frame < frameCount; ++frame)
+      {
+         renderer.ResetStats();
+         render_frame( renderer, skBenchmarkStartTime + skBenchmarkTimeStep * static_cast<real32>(frame) );
+         for (SRenderStats const& stats : renderer.GetThreadStats())
+         {
+            total += stats;
+         }
+      }
+      return total;
+   }
+
+   void print_saved_steps( char const* const label, uint64_t const steps, uint64_t const plainSteps )
+   {
+      double const saved = static_cast<double>(plainSteps) - static_cast<double>(steps);
+      printf( "%-10s %12llu %12llu %11.1f%%\n", label,
+              static_cast<unsigned long long>(plainSteps),
+              static_cast<unsigned long long>(steps),
+              plainSteps != 0 ? saved * 100.0 / static_cast<double>(plainSteps) : 0.0 );
+   }
+
+   int run_benchmark( uint32_t const frameCount, real32 const relaxation )
+   {
+#if !COLLECT_RENDER_STATS()
+      printf( "COLLECT_RENDER_STATS() is disabled, only frame times are valid\n" );
+#endif
+
+      CRenderer renderer;
+      renderer.ResizeBuffer( skBenchmarkWidth, skBenchmarkHeight );
+      renderer.SetRelaxation( relaxation );
+
+      printf( "benchmark %ux%u, %u frames\n", skBenchmarkWidth, skBenchmarkHeight, frameCount );
+      printf( "%-10s %10s %12s %12s %12s %14s\n", "", "ms", "primary/s", "shadow/s", "reflection/s", "distance/s" );
+
+      std::vector< SRenderStats > threadTotals( renderer.GetThreadStats().size() );
+      double totalTime = 0.0;
+
+      for (uint32_t frame = 0; frame < frameCount; ++frame)
+      {
+         renderer.ResetStats();
+
+         double const frameTime = render_frame( renderer, skBenchmarkStartTime + skBenchmarkTimeStep * static_cast<real32>(frame) );
+         totalTime += frameTime;
+
+         SRenderStats frameStats;
+         for (size_t i = 0; i < threadTotals.size(); ++i)
+         {
+            frameStats += renderer.GetThreadStats()[i];
+            threadTotals[i] += renderer.GetThreadStats()[i];
+         }
+
+         char label[32];
+         snprintf( label, sizeof( label ), "frame %u", frame );
+         print_stats( label, frameStats, frameTime );
+      }
+
+      // the rates of each thread are measured against the wall time of all frames
+      SRenderStats total;
+      for (size_t i = 0; i < threadTotals.size(); ++i)
+      {
+         char label[32];
+         snprintf( label, sizeof( label ), "thread %u", static_cast<uint32_t>(i) );
+         print_stats( label, threadTotals[i], totalTime );
+         total += threadTotals[i];
+      }
+      print_stats( "total", total, totalTime );
 
-   real32 dot( CVector3f const& lhs, CVector3f const& rhs ) { return CVector3f::Dot( lhs, rhs ); }
-   CVector3f cross( CVector3f const& lhs, CVector3f const& rhs ) { return CVector3f::Cross( lhs, rhs ); }
+#if COLLECT_RENDER_STATS()
+      if (relaxation > 1.f)
+      {
+         // the same frames again with plain sphere tracing to see what the relaxation saved
+         SRenderStats const plain = count_plain_steps( frameCount );
 
+         printf( "\nrelaxation %.2f, %llu fallbacks\n", relaxation, static_cast<unsigned long long>(total.mRelaxationFallbacks) );
+         printf( "%-10s %12s %12s %12s\n", "steps", "plain", "relaxed", "saved" );
+         print_saved_steps( "primary", total.mPrimarySteps, plain.mPrimarySteps );
+         print_saved_steps( "reflection", total.mReflectionSteps, plain.mReflectionSteps );
+      }
 
+#if USE_TEMPORAL_REPROJECTION()
+      printf( "\nreprojection: %llu rays started at the last depth, %llu guesses failed\n",
+         static_cast<unsigned long long>(total.mReprojectedRays), static_cast<unsigned long long>(total.mReprojectionFailures) );
+#endif
+#endif
 
+      return 0;
+   }
 
-   void BuildScene( CRenderScene& scene, real32 const time )
+   // renders the sphere with the transform, returns how many of the pixels that
+   // it covers were missed or -1 when the scene couldn't be built
+   int32_t count_missed_pixels( char const* const transform )
    {
-      UNREFERENCED_PARAMETER( time );
-      UNREFERENCED_PARAMETER( scene );
+      CRenderScene scene;
+      std::string error;
+      if (!NSceneFile::BuildScene( std::string( skTestCamera ) + "sphere 1 " + transform + "\n", scene, error ))
+      {
+         printf( "%s\n", error.c_str() );
+         return -1;
+      }
+      scene.Animate( 0.f );
+      scene.Compile();
+      scene.SetSceneSize( skTestWidth, skTestHeight );
+      scene.BuildTiles( skTestWidth, skTestHeight, USE_TILE_CULLING(), USE_TILE_PRUNING() && USE_COMPILED_SDF() );
+
+      // the rays are moved into the space of the sphere to find where they hit it exactly
+      CTransform4f const& worldToLocal = scene.GetObjects().front()->GetWorldToLocal();
+      int32_t missed = 0;
+      for (uint32_t y = 0; y < skTestHeight; ++y)
+      {
+         for (uint32_t x = 0; x < skTestWidth; ++x)
+         {
+            CInfiniteRay const ray = scene.GetCamera().GetRayForPosition( x, y );
+            CVector3f const origin = worldToLocal * ray.GetPosition();
+            CVector3f const direction = worldToLocal * ray.GetPositionAlongRay( 1.f ) - origin;
+            real32 const along = CVector3f::Dot( origin, direction ) / direction.MagnitudeSquared();
+            bool const covered = along < 0.f && (origin - direction * along).MagnitudeSquared() < skTestEdge;
+
+            real32 hitTime;
+            scene.DoIntersection( x, y, skMinLength, skLargeNumber, hitTime );
+            if (covered && hitTime >= skLargeNumber)
+            {
+               ++missed;
+            }
+         }
+      }
+      return missed;
+   }
 
-#include "RenderScene.inl"
+   // the same points every time, so that a failure can be repeated, in the unit cube
+   CVector3f get_unit_test_point( uint32_t const index )
+   {
+      auto const fraction = [index]( uint32_t const multiplier ) { return static_cast<real32>((index * multiplier) >> 8) / static_cast<real32>(1u << 24); };
+      return CVector3f( fraction( 2654435761u ), fraction( 2246822519u ), fraction( 3266489917u ) );
    }
-}
 
-//===================================================================================
-// This class coordinates the rendering
+   // the same for the box around the test scene
+   CVector3f get_test_point( uint32_t const index )
+   {
+      return get_unit_test_point( index ) * (2.f * skTestExtent) - CVector3f( skTestExtent, skTestExtent, skTestExtent );
+   }
 
-struct SWorkArea
-{
-   SWorkArea(SWorkArea const&) =delete;
-   SWorkArea( SWorkArea && ) = delete;
-   explicit SWorkArea( uint32_t const minx, uint32_t const miny, uint32_t const maxx, uint32_t const maxy )
-      : mMinX( minx ), mMinY( miny ), mMaxX( maxx ), mMaxY( maxy )
-   { 
+   bool is_test_distance( real32 const distance, real32 const expected )
+   {
+      return NMath::AbsF( distance - expected ) <= skTestTolerance * (1.f + NMath::AbsF( expected ));
+   }
+
+   // builds and compiles a scene for the tests, returns false when it couldn't be
+   bool build_test_scene( std::string const& text, CRenderScene& scene )
+   {
+      std::string error;
+      if (!NSceneFile::BuildScene( text, scene, error ))
+      {
+         printf( "%s\n", error.c_str() );
+         return false;
+      }
+      scene.Animate( 0.f );
+      scene.Compile();
+      if (scene.GetProgram() == nullptr)
+      {
+         printf( "the test scene can't be compiled\n" );
+         return false;
+      }
+      return true;
    }
 
-   uint32_t mMinX;
-   uint32_t mMinY;
-   uint32_t mMaxX;
-   uint32_t mMaxY;
+   // Compares the distances of the compiled program with the ones of the object
+   // tree, returns how many were different or -1 when the scene couldn't be built
+   int32_t count_program_errors()
+   {
+      CRenderScene scene;
+      if (!build_test_scene( std::string( skTestScene ) + skTestCustomObject, scene ))
+      {
+         return -1;
+      }
 
-   std::atomic<bool> mJobDone{ false };
-};
+      CSdfProgram const& program = *scene.GetProgram();
+      int32_t errors = 0;
+      for (uint32_t index = 0; index < skTestPointCount; ++index)
+      {
+         CVector3f const point = get_test_point( index );
+         for (uint32_t object = 0; object < scene.GetObjects().size(); ++object)
+         {
+            if (!is_test_distance( program.Evaluate( object, point ), scene.GetObjects()[object]->GetTransformedDistanceToPoint( point ) ))
+            {
+               ++errors;
+            }
+         }
+      }
+      return errors;
+   }
 
-class CRenderer
-{
-public:
+   // the packet evaluation of one instruction set, see CSdfProgram::EvaluatePacket
+   using TEvaluatePacket = void (*)( SSdfInstruction const*, SSdfInstruction const*, CTransform4f const*, SPointPacket const&, uint32_t, real32* );
 
-   explicit CRenderer()
+   // Compares the distances of packets of points with the ones of the object tree.
+   // Every other packet leaves some of the points out, their distances must stay
+   // the same. Returns how many were different or -1 when the scene couldn't be built.
+   int32_t count_packet_errors( TEvaluatePacket const evaluatePacket )
    {
-      uint32_t const numProcessors = std::thread::hardware_concurrency();
-
-      printf( "starting up %d job threads\n", numProcessors );
+      CRenderScene scene;
+      if (!build_test_scene( std::string( skTestScene ) + skTestCustomObject, scene ))
+      {
+         return -1;
+      }
 
-      for (uint32_t i = 0; i < numProcessors; ++i)
+      CSdfProgram::STables const tables = scene.GetProgram()->GetTables();
+      int32_t errors = 0;
+      for (uint32_t first = 0; first < skTestPointCount; first += SPointPacket::skWidth)
       {
-         // worker threads
-         mThreads.push_back( std::unique_ptr< std::thread >( new std::thread( [&]()
+         SPointPacket points;
+         for (uint32_t lane = 0; lane < SPointPacket::skWidth; ++lane)
          {
-            while (mShutdown == false)
-            {
-               SWorkArea * pWorkArea = NextWorkArea();
+            CVector3f const point = get_test_point( first + lane );
+            points.mX[lane] = point.mX;
+            points.mY[lane] = point.mY;
+            points.mZ[lane] = point.mZ;
+         }
 
-               if (pWorkArea!=nullptr)
+         uint32_t const activeMask = (first / SPointPacket::skWidth) % 2 == 0 ? 0xffu : 0x5au;
+         for (uint32_t object = 0; object < scene.GetObjects().size(); ++object)
+         {
+            alignas(32) real32 distances[SPointPacket::skWidth];
+            std::fill( std::begin( distances ), std::end( distances ), skLargeNumber );
+            CSdfProgram::SObjectRange const& range = tables.mpObjects[object];
+            evaluatePacket( tables.mpInstructions + range.mBegin, tables.mpInstructions + range.mEnd, tables.mpTransforms, points, activeMask, distances );
+
+            for (uint32_t lane = 0; lane < SPointPacket::skWidth; ++lane)
+            {
+               CVector3f const point( points.mX[lane], points.mY[lane], points.mZ[lane] );
+               real32 const expected = (activeMask & (1u << lane)) ? scene.GetObjects()[object]->GetTransformedDistanceToPoint( point ) : skLargeNumber;
+               if (!is_test_distance( distances[lane], expected ))
                {
-                  SWorkArea& workArea = *pWorkArea;
-                  
-                  // do work
-                  int32_t const stepSize = skInitialStepSize;
+                  ++errors;
+               }
+            }
+         }
+      }
+      return errors;
+   }
 
-                  for (uint32_t y = workArea.mMinY; y < workArea.mMaxY; y += stepSize)
-                  {
-                     for (uint32_t x = workArea.mMinX; x < workArea.mMaxX; x += stepSize)
-                     {
-                        CColor4f const color = mScene.DoIntersection( x, y );
-
-                        for (uint32_t i = 0; i < stepSize; ++i)
-                        {
-                           for (uint32_t j = 0; j < stepSize; ++j)
-                           {
-                              SetPixelColor( x + i, y + j, color );
-                           }
-                        }
-                     }
-                  }
+   // Checks the pruned programs of the tiles against the full program along the
+   // rays of every pixel. CopyPruned may only change a distance where it is more
+   // than the hit distance, so both are the same up to it, and the objects that
+   // were left out of a tile are never closer than it. Each object is traced on
+   // its own with steps of at least half the hit distance, which puts points
+   // close to all of its surfaces along the ray. Returns how many distances were
+   // wrong or -1 when the scene couldn't be built.
+   int32_t count_pruning_errors()
+   {
+      CRenderScene scene;
+      if (!build_test_scene( std::string( skTestScene ) + skTestCustomObject, scene ))
+      {
+         return -1;
+      }
+      scene.SetSceneSize( skTestWidth, skTestHeight );
 
-                  workArea.mJobDone = true;
-               }
-               else
+      // without culling every object is in the list of every tile, so only the pruning leaves them out
+      scene.BuildTiles( skTestWidth, skTestHeight, false, true );
+
+      CSdfProgram const& program = *scene.GetProgram();
+      real32 const hitDistance = scene.GetHitDistance( skMaxLength );
+      int32_t errors = 0;
+      for (uint32_t y = 0; y < skTestHeight; ++y)
+      {
+         for (uint32_t x = 0; x < skTestWidth; ++x)
+         {
+            SSceneTile const& tile = *scene.GetTile( x, y );
+            CInfiniteRay const ray = scene.GetCamera().GetRayForPosition( x, y );
+
+            // the tile has the objects that were kept in the same order as the scene
+            uint32_t prunedObject = 0;
+            for (uint32_t object = 0; object < program.GetObjectCount(); ++object)
+            {
+               bool const kept = prunedObject < tile.mObjects.size() && tile.mObjects[prunedObject] == object;
+               for (real32 time = 0.f; time < skMaxLength;)
                {
-                  // no more jobs, just go to sleep
-                  if (!mShutdown)
+                  CVector3f const point = ray.GetPositionAlongRay( time );
+                  real32 const distance = program.Evaluate( object, point );
+                  real32 const prunedDistance = kept ? tile.mProgram.Evaluate( prunedObject, point ) : skLargeNumber;
+                  if (!is_test_distance( NMath::min_val( prunedDistance, hitDistance ), NMath::min_val( distance, hitDistance ) ))
                   {
-                     std::unique_lock<std::mutex> lock( mSleepControlMutex );
-                     mSleepControl.wait( lock );
+                     ++errors;
                   }
+                  time += NMath::max_val( NMath::AbsF( distance ), hitDistance * 0.5f );
                }
+               prunedObject += kept ? 1 : 0;
             }
-         } ) ) );
+         }
       }
+      return errors;
    }
 
-   ~CRenderer()
+   // The same check as count_pruning_errors for small boxes around the test scene,
+   // which can be close to a single surface, unlike the rays of a tile.
+   int32_t count_region_pruning_errors()
    {
-      mShutdown = true;
-      mSleepControl.notify_all();
+      CRenderScene scene;
+      if (!build_test_scene( std::string( skTestScene ) + skTestCustomObject, scene ))
+      {
+         return -1;
+      }
 
-      for (auto& threadObj : mThreads)
+      CSdfProgram const& program = *scene.GetProgram();
+      int32_t errors = 0;
+      for (uint32_t region = 0; region < skTestRegionCount; ++region)
       {
-         if (threadObj->joinable())
+         // the size comes from another point of the sequence
+         CVector3f const boxMin = get_test_point( region );
+         CVector3f const boxSize = get_unit_test_point( region + skTestRegionCount ) * skTestRegionSize;
+         std::vector< CVector3f > corners( CSdfProgram::skRegionCorners, boxMin );
+         for (uint32_t corner = 0; corner < CSdfProgram::skRegionCorners; ++corner)
          {
-            threadObj->join();
+            corners[corner] = boxMin + boxSize * CVector3f( (corner & 1) ? 1.f : 0.f, (corner & 2) ? 1.f : 0.f, (corner & 4) ? 1.f : 0.f );
+         }
+
+         for (uint32_t object = 0; object < program.GetObjectCount(); ++object)
+         {
+            CSdfProgram pruned;
+            bool const kept = program.CopyPruned( object, corners.data(), 1, skTestRegionSlack, pruned );
+            for (uint32_t index = 0; index < skTestRegionPoints; ++index)
+            {
+               CVector3f const point = boxMin + boxSize * get_unit_test_point( region * skTestRegionPoints + index );
+               real32 const distance = NMath::min_val( program.Evaluate( object, point ), skTestRegionSlack );
+               real32 const prunedDistance = kept ? NMath::min_val( pruned.Evaluate( 0, point ), skTestRegionSlack ) : skTestRegionSlack;
+               if (!is_test_distance( prunedDistance, distance ))
+               {
+                  ++errors;
+               }
+            }
          }
       }
+      return errors;
    }
 
-
-   void Update( real32 const deltaTime )
+   // Builds the test scene into the same scene again after it has been reset. The
+   // objects have to be put where the first ones were, unless an object of the scene
+   // is still being held on to, then its memory must not be used again. Returns how
+   // many checks failed or -1 when the scene couldn't be built.
+   int32_t count_arena_errors()
    {
-      if (IsDone())
+      CRenderScene scene;
+      if (!build_test_scene( skTestScene, scene ))
+      {
+         return -1;
+      }
+      CRenderObject const* const pFirstObject = scene.GetObjects().front().get();
+
+      int32_t errors = 0;
+      if (!scene.Reset())
+      {
+         printf( "the scene wasn't reset with nothing held\n" );
+         ++errors;
+      }
+      if (!build_test_scene( skTestScene, scene ))
+      {
+         return -1;
+      }
+      if (scene.GetObjects().front().get() != pFirstObject)
       {
-         mTime += deltaTime;
-         mScene.Reset();
-         NScene::BuildScene( mScene, mTime );
-         mScene.SetSceneSize( mBufferWidth, mBufferHeight );
+         printf( "the memory of the scene wasn't used again\n" );
+         ++errors;
       }
+
+      CRenderObject::TPtr const pHeldObject = scene.GetObjects().front();
+      real32 const heldDistance = pHeldObject->GetDistanceToPoint( CVector3f::Zero() );
+      if (scene.Reset())
+      {
+         printf( "the scene was reset while an object was still held\n" );
+         ++errors;
+      }
+      if (!build_test_scene( skTestScene, scene ))
+      {
+         return -1;
+      }
+      if (scene.GetObjects().front().get() == pHeldObject.get() || pHeldObject->GetDistanceToPoint( CVector3f::Zero() ) != heldDistance)
+      {
+         printf( "the memory of an object that is still held was used again\n" );
+         ++errors;
+      }
+      return errors;
    }
 
-   bool IsDone() const
+   // Builds the scene files with mistakes, every one has to fail with the line of the
+   // mistake at the start of the error. Returns how many didn't.
+   int32_t count_scene_file_errors()
    {
-      for (std::shared_ptr<SWorkArea> const& workArea : mWorkAreas)
+      int32_t errors = 0;
+      for (uint32_t index = 0; index < std::size( skTestBadScenes ); ++index)
       {
-         if (!workArea->mJobDone)
+         CRenderScene scene;
+         std::string error;
+         std::string const line = "line " + std::to_string( skTestBadScenes[index].mLine ) + ": ";
+         if (NSceneFile::BuildScene( skTestBadScenes[index].mpText, scene, error ) || error.compare( 0, line.size(), line ) != 0)
          {
-            return false;
+            printf( "bad scene %u: '%s'\n", index, error.c_str() );
+            ++errors;
          }
       }
-      return true;
+      return errors;
    }
 
-   void Cancel()
+   // the bytes of a compiled scene with the value of type T at the offset changed
+   template<class T, class TChange>
+   std::string change_compiled_value( std::string bytes, uint64_t const offset, TChange const& change )
+   {
+      T value;
+      memcpy( &value, bytes.data() + offset, sizeof( T ) );
+      change( value );
+      memcpy( bytes.data() + offset, &value, sizeof( T ) );
+      return bytes;
+   }
+
+   // the number of the test points that a program has different distances at than
+   // the program of the scene
+   int32_t count_compiled_distance_errors( CRenderScene const& scene, CSdfProgram const& program )
    {
-      // just declare remaining jobs done
+      CSdfProgram const& sceneProgram = *scene.GetProgram();
+      if (program.GetObjectCount() != sceneProgram.GetObjectCount())
       {
-         std::lock_guard<std::mutex> lock( mJobMutex );
-         while (mCurrentWorkArea < mWorkAreas.size())
-         {
-            mWorkAreas[mCurrentWorkArea++]->mJobDone = true;;
-         }
+         return 1;
       }
 
-      // wait for all jobs to finish
-      while (!IsDone())
+      int32_t errors = 0;
+      for (uint32_t index = 0; index < skTestPointCount; ++index)
       {
-         std::this_thread::yield();
+         CVector3f const point = get_test_point( index );
+         for (uint32_t object = 0; object < program.GetObjectCount(); ++object)
+         {
+            if (!is_test_distance( program.Evaluate( object, point ), sceneProgram.Evaluate( object, point ) ))
+            {
+               ++errors;
+            }
+         }
       }
+      return errors;
    }
 
-   void ResizeBuffer( uint32_t const width, uint32_t const height )
+   // Writes the test scene to a compiled file and loads it, then tries to load damaged
+   // copies of the file into the same scene. Each one has to be rejected and leave the
+   // scene the way it was. Returns how many checks failed or -1 when the scene couldn't
+   // be written.
+   int32_t count_compiled_scene_errors()
    {
-      if (!IsDone())
+      CRenderScene scene;
+      if (!build_test_scene( skTestScene, scene ))
       {
-         Cancel();
+         return -1;
       }
 
-      if ( width != mBufferWidth || height != mBufferHeight )
+      std::filesystem::path const directory = std::filesystem::temp_directory_path();
+      std::string const fileName = (directory / skTestCompiledFile).string();
+      std::string const damagedFileName = (directory / skTestDamagedFile).string();
+      std::string error;
+      std::string bytes;
+      CRenderScene loaded;
+      if (!NCompiledScene::Write( scene, fileName, error ) || !NSceneFile::ReadFile( fileName, bytes, error ) ||
+         !NCompiledScene::Load( fileName, loaded, error ) || loaded.GetProgram() == nullptr)
       {
-         mBuffer = std::unique_ptr< CColor4f >( reinterpret_cast<CColor4f*>(new uint8_t[sizeof( CColor4f ) * width * height]) );
-         mBufferWidth = width;
-         mBufferHeight = height;
+         printf( "%s\n", error.c_str() );
+         return -1;
+      }
 
-         for (uint32_t x = 0; x < width; x++ )
+      int32_t errors = count_compiled_distance_errors( scene, *loaded.GetProgram() );
+
+      using NCompiledScene::ESection;
+      using NCompiledScene::SHeader;
+      SHeader header;
+      memcpy( &header, bytes.data(), sizeof( SHeader ) );
+      auto const changeSection = [&bytes]( ESection const section, auto const& change )
+      {
+         return change_compiled_value< SHeader >( bytes, 0, [section, &change]( SHeader& value ) { change( value.mSections[static_cast<uint32_t>(section)] ); } );
+      };
+      uint64_t const firstInstruction = header.mSections[static_cast<uint32_t>(ESection::Instructions)].mOffset;
+      uint32_t const transformCount = header.mSections[static_cast<uint32_t>(ESection::Transforms)].mCount;
+
+      struct SDamage
+      {
+         char const* mpName;
+         std::string mBytes;
+      };
+      SDamage const damages[] =
+      {
+         { "a short header", bytes.substr( 0, sizeof( SHeader ) / 2 ) },
+         { "a short last table", bytes.substr( 0, bytes.size() - 1 ) },
+         { "another magic", change_compiled_value< SHeader >( bytes, 0, []( SHeader& value ) { value.mMagic[0] = 'X'; } ) },
+         { "another version", change_compiled_value< SHeader >( bytes, 0, []( SHeader& value ) { ++value.mVersion; } ) },
+         { "another instruction size", changeSection( ESection::Instructions, []( NCompiledScene::SSection& value ) { value.mElementSize += 4; } ) },
+         { "a table past the end", changeSection( ESection::Bounds, [&bytes]( NCompiledScene::SSection& value ) { value.mOffset = bytes.size() + NCompiledScene::skTableAlignment; } ) },
+         { "a misaligned table", changeSection( ESection::Transforms, []( NCompiledScene::SSection& value ) { value.mOffset += 4; } ) },
+         { "an object too few", changeSection( ESection::Objects, []( NCompiledScene::SSection& value ) { --value.mCount; } ) },
+         { "a range too few", changeSection( ESection::Ranges, []( NCompiledScene::SSection& value ) { --value.mCount; } ) },
+         { "an unknown instruction", change_compiled_value< SSdfInstruction >( bytes, firstInstruction, []( SSdfInstruction& value ) { value.mOp = static_cast<ESdfOp>(0xff); } ) },
+         { "a transform out of range", change_compiled_value< SSdfInstruction >( bytes, firstInstruction, [transformCount]( SSdfInstruction& value ) { value.mTransform = transformCount; } ) },
+      };
+
+      CSdfProgram const* const pProgram = loaded.GetProgram();
+      CRenderObject const* const pFirstObject = loaded.GetObjects().front().get();
+      size_t const objectCount = loaded.GetObjects().size();
+      size_t const lightCount = loaded.GetLights().size();
+      CVector3f const cameraPosition = loaded.GetCamera().GetCameraTransform().GetTranslation();
+      for (SDamage const& damage : damages)
+      {
          {
-            for (uint32_t y = 0; y < height; y++ )
-            {
-               SetPixelColor( x, y, CColor4f( 0.5f, 0.6f, 0.7f ) );
-            }
+            std::ofstream file( damagedFileName, std::ios::binary );
+            file.write( damage.mBytes.data(), static_cast<std::streamsize>(damage.mBytes.size()) );
+         }
+
+         error.clear();
+         bool const rejected = !NCompiledScene::Load( damagedFileName, loaded, error ) && !error.empty();
+         bool const unchanged = loaded.GetProgram() == pProgram && loaded.GetObjects().size() == objectCount && loaded.GetObjects().front().get() == pFirstObject &&
+            loaded.GetLights().size() == lightCount && (loaded.GetCamera().GetCameraTransform().GetTranslation() - cameraPosition).MagnitudeSquared() == 0.f &&
+            count_compiled_distance_errors( scene, *pProgram ) == 0;
+         if (!rejected || !unchanged)
+         {
+            // the other files can't be checked against a scene that has changed
+            printf( "a file with %s was %s\n", damage.mpName, rejected ? "rejected but the scene changed" : "loaded" );
+            ++errors;
+            break;
          }
       }
-      mScene.SetSceneSize( width, height );
+
+      // a file can't be removed on windows while it is mapped
+      loaded.Reset();
+      std::error_code errorCode;
+      std::filesystem::remove( fileName, errorCode );
+      std::filesystem::remove( damagedFileName, errorCode );
+      return errors;
    }
 
-   void RenderScene()
+   // prints the result of a test, returns false when it failed
+   bool report_test( char const* const name, int32_t const errors, char const* const what )
    {
-      if (IsDone())
+      printf( "%-40s %s", name, errors == 0 ? "ok\n" : "FAILED" );
+      if (errors != 0)
+      {
+         printf( ", %d %s\n", errors, what );
+      }
+      return errors == 0;
+   }
+
+   int run_tests()
+   {
+      int result = 0;
+      for (char const* const transform : skTestTransforms)
       {
-         // create a whole bunch of render work areas
+         if (!report_test( transform[0] ? transform : "no transform", count_missed_pixels( transform ), "pixels missed" ))
          {
-            std::lock_guard<std::mutex> lock( mJobMutex );
+            result = 1;
+         }
+      }
 
-            mWorkAreas.clear();
-            mCurrentWorkArea = 0;
+      if (!report_test( "compiled program", count_program_errors(), "distances differ from the objects" ))
+      {
+         result = 1;
+      }
 
-#if 1
-            uint32_t const jobCount = std::thread::hardware_concurrency() * skJobCoreMultiplier;
+      if (!report_test( "sse packets", count_packet_errors( &NSdfSse::EvaluatePacket ), "distances differ from the objects" ))
+      {
+         result = 1;
+      }
 
-            // break everything up into workable squares
-            uint32_t const edgeJobCount = static_cast<uint32_t>(NMath::max_val( sqrtf( static_cast<real32>(jobCount) ), 1.f ));
-            
-            uint32_t const hStepSize = NMath::max_val( 1u, mBufferWidth / edgeJobCount );
-            uint32_t const vStepSize = NMath::max_val( 1u, mBufferHeight / edgeJobCount );
+      if (NMath::HasAvx2() && !report_test( "avx2 packets", count_packet_errors( &NSdfAvx2::EvaluatePacket ), "distances differ from the objects" ))
+      {
+         result = 1;
+      }
 
-            for (uint32_t y = 0; y < mBufferHeight; y += vStepSize)
-            {
-               for (uint32_t x = 0; x < mBufferWidth; x += hStepSize)
-               {
-                  mWorkAreas.push_back( std::make_shared< SWorkArea >( x, y, NMath::min_val( mBufferWidth, x + hStepSize ), NMath::min_val( mBufferHeight, y + vStepSize ) ) );
-               }
-            }
-#else
-            mWorkAreas.push_back( std::make_shared< SWorkArea >( mBufferWidth/2-2, mBufferHeight/2, mBufferWidth/2+2, mBufferHeight ) ) ;
-#endif
-         }
-         mSleepControl.notify_all();
+      if (!report_test( "pruned tiles", count_pruning_errors(), "distances differ within the hit distance" ))
+      {
+         result = 1;
+      }
+
+      if (!report_test( "pruned regions", count_region_pruning_errors(), "distances differ within the slack" ))
+      {
+         result = 1;
+      }
+
+      if (!report_test( "scene arena", count_arena_errors(), "checks failed" ))
+      {
+         result = 1;
+      }
+
+      if (!report_test( "scene file errors", count_scene_file_errors(), "scenes weren't reported on their line" ))
+      {
+         result = 1;
       }
+
+      if (!report_test( "compiled scene files", count_compiled_scene_errors(), "checks failed" ))
+      {
+         result = 1;
+      }
+      return result;
+   }
+}
+
+int main( int argc, char* argv[] )
+{
+   if (argc == 2 && strcmp( argv[1], "-test" ) == 0)
+   {
+      return run_tests();
    }
 
-   CColor4f const* const GetBuffer() const
+   SHeadlessOptions options;
+   if (!parse_options( argc, argv, options ))
    {
-      return mBuffer.get();
+      return 1;
    }
 
-   uint32_t GetBufferWidth() const
+   if (options.mBenchmark)
    {
-      return mBufferWidth;
+      return run_benchmark( options.mFrameCount, options.mRelaxation );
    }
 
-   uint32_t GetBufferHeight() const
+   CRenderer renderer;
+   renderer.ResizeBuffer( options.mWidth, options.mHeight );
+   renderer.SetRelaxation( options.mRelaxation );
+
+   if (!options.mSceneFileName.empty() && !renderer.SetSceneFile( options.mSceneFileName ))
    {
-      return mBufferHeight;
+      return 1;
    }
 
-   void SetPixelColor( uint32_t const x, uint32_t const y, CColor4f const & color )
+   if (!options.mCompiledFileName.empty())
    {
-      if (x < mBufferWidth && y < mBufferHeight)
-      {
-         mBuffer.get()[y * mBufferWidth + x] = color;
-      }
+      renderer.SetTime( options.mStartTime );
+      return renderer.WriteCompiledScene( options.mCompiledFileName ) ? 0 : 1;
    }
 
-   SWorkArea * NextWorkArea()
+   bool const recordSteps = !options.mHeatmapPrefix.empty();
+#if COLLECT_RENDER_STATS()
+   renderer.SetRecordSteps( recordSteps );
+#else
+   if (recordSteps)
+   {
+      printf( "COLLECT_RENDER_STATS() is disabled, no heatmaps will be written\n" );
+   }
+#endif
+
+   for (uint32_t frame = 0; frame < options.mFrameCount; ++frame)
    {
-      std::lock_guard<std::mutex> lock( mJobMutex );
+      double const renderTime = render_frame( renderer, options.mStartTime + options.mTimeStep * static_cast<real32>(frame) );
+
+      char fileName[1024];
+      snprintf( fileName, sizeof( fileName ), "%s_%04u.ppm", options.mOutputPrefix.c_str(), frame );
 
-      if ( !mWorkAreas.empty() )
+      if (!write_image( fileName, renderer.GetBuffer(), renderer.GetBufferWidth(), renderer.GetBufferHeight() ))
       {
-         if (mCurrentWorkArea < mWorkAreas.size())
-         {
-            return mWorkAreas[mCurrentWorkArea++].get();
-         }
+         printf( "failed to write %s\n", fileName );
+         return 1;
       }
 
-      return nullptr;
-   }
-
-private:
+      printf( "frame %u rendered in %.1f ms: %s\n", frame, renderTime, fileName );
 
-   uint32_t mBufferWidth{ 0 };
-   uint32_t mBufferHeight{ 0 };
-   real32 mTime{ 0.f };
-   std::unique_ptr< CColor4f > mBuffer;
-   CRenderScene mScene;
+#if COLLECT_RENDER_STATS()
+      if (recordSteps && !write_step_instrumentation( options.mHeatmapPrefix, frame, renderer ))
+      {
+         printf( "failed to write the heatmaps for frame %u\n", frame );
+         return 1;
+      }
+#endif
+   }
 
-   // thread control
-   std::mutex mJobMutex;
-   std::vector< std::shared_ptr< SWorkArea > > mWorkAreas;
-   std::vector< std::unique_ptr< std::thread > > mThreads;
+   return 0;
+}
 
-   std::atomic<uint32_t> mCurrentWorkArea;
-   std::atomic<bool> mShutdown = false;
-   std::condition_variable mSleepControl;
-   std::mutex mSleepControlMutex;
-};
+#else
 
 //-----------------------------------------------------------------------------
 // All of the windows handling stuff
@@ -1741,6 +8605,9 @@ namespace
    TCHAR const * const skClassName = _T("RayMarcher");
    TCHAR const * const skWindowTitle = _T("RayMarcher");
 
+   // the scene file from the command line, the scene of RenderScene.inl is used without one
+   std::string gSceneFileName;
+
    void fatal_exit( char const* const message )
    {
       TCHAR szBuf[80];
@@ -1770,8 +8637,15 @@ namespace
       switch (message)
       {
       case WM_CREATE:
-         ::SetWindowLongPtr( hWnd, GWLP_USERDATA, reinterpret_cast<LONG_PTR>(new CRenderer) );
-         ::SetTimer( hWnd, 1, skTimerMilliseconds, NULL );
+         {
+            CRenderer* const pNewRenderer = new CRenderer;
+            if (!gSceneFileName.empty())
+            {
+               pNewRenderer->SetSceneFile( gSceneFileName );
+            }
+            ::SetWindowLongPtr( hWnd, GWLP_USERDATA, reinterpret_cast<LONG_PTR>(pNewRenderer) );
+            ::SetTimer( hWnd, 1, skTimerMilliseconds, NULL );
+         }
          break;
       case WM_DESTROY:
          // quit the entire application
@@ -1813,11 +8687,6 @@ namespace
          {
             pRenderer->Cancel();
 
-            while (!pRenderer->IsDone())
-            {
-               std::this_thread::yield();
-            }
-
             uint32_t const bufferWidth = static_cast<uint32_t>( (LOWORD( lParam ) + 3) & ~3 );
             uint32_t const bufferHeight = static_cast<uint32_t>( HIWORD( lParam ) );
 
@@ -2023,6 +8892,25 @@ int APIENTRY WinMain(
    freopen_s(&oldStdErr, "CONOUT$", "wt", stderr);
 #endif
 
+   // lpCmdLine is the whole command line with its quotes, __argv has it split up.
+   // The scene file is given with -scene like the command line renderer, or on its
+   // own when a file is dropped on the program.
+   for (int i = 1; i < __argc; ++i)
+   {
+      if (strcmp(__argv[i], "-scene") == 0 && i + 1 < __argc)
+      {
+         gSceneFileName = __argv[++i];
+      }
+      else if (__argv[i][0] != '-' && gSceneFileName.empty())
+      {
+         gSceneFileName = __argv[i];
+      }
+      else
+      {
+         printf("ignoring %s, use -scene followed by a scene file\n", __argv[i]);
+      }
+   }
+
    register_class(hInstance);
 
    init_instance(hInstance, nCmdShow);
@@ -2038,3 +8926,5 @@ int APIENTRY WinMain(
 
    return 0;
 }
+
+#endif
@@ -23,13 +23,21 @@
 // cube( size )
 //
 // custom( function ) // a custom object takes a lambda as a parameter
+// custom( function, bounds( center, radius ) ) // the surface has to be inside of the bounds
 //
 // This custom object creates a sphere with a radius of 3 at the position < 0, 4, 10 >:
-// scene += custom( []( vector3 pos ) { return pos.Magnitude() - 3.f;  } ) << translate( 0.f, 4.f, 10.f );
+// scene += custom( []( vector3 pos ) { return pos.Magnitude() - 3.f;  }, bounds( 3.f ) ) << translate( 0.f, 4.f, 10.f );
+//
+// The scene is only built once, so the values that change over time are animated
+// instead of using time directly. The function is called with the time of every frame:
+// object << animate( []( real32 time ) { return translate( 0.f, sinf( time ), 0.f ); } );  // the transform
+// object << animate( []( real32 time ) { return sinf( time ); } );  // the blend factor of blend and csg_smoothunion
+// light << animate( []( real32 time ) { return vector3( 0.f, sinf( time ), 0.f ); } );  // the position
+// light << animate( []( real32 time ) { return rotatez( sinf( time ) ); } );  // the transform of a point or spot light
 //
 //----------------------------------------------------------------------------------------
 
-#define torus(minorRadius, majorRadius) custom( []( vector3 pos ) { return length( vector3( length(vector3( pos.x, 0.f, pos.z ) ) -  majorRadius, pos.y, 0.f ) ) - minorRadius;  } )
+#define torus(minorRadius, majorRadius) custom( []( vector3 pos ) { return length( vector3( length(vector3( pos.x, 0.f, pos.z ) ) -  majorRadius, pos.y, 0.f ) ) - minorRadius;  }, bounds( (majorRadius) + (minorRadius) ) )
 
 color const steel_blue( 0x4682b4 );
 color const spring_green( 0x00ff7f );
@@ -47,10 +55,11 @@ scene += directionallight( vector3( 0.f, -1.f, 0.f ), color( 0.1f, 0.1f, 0.2f )
 
 // choose between point and spot light
 #if 1
-scene += pointlight(vector3(0.f, 5.f + sinf(time * 3.f), 0.f), color(0.9f, 0.9f, 0.8f) * 10.f) << attenuation{ .linear = 0.7f, .exponential = 0.3f };
+scene += pointlight(vector3(0.f, 5.f, 0.f), color(0.9f, 0.9f, 0.8f) * 10.f) << attenuation{ .linear = 0.7f, .exponential = 0.3f }
+<< animate([](real32 time) { return vector3(0.f, 5.f + sinf(time * 3.f), 0.f); });
 #else
 scene += spotlight( vector3(0.f, 20.f, 0.f ), vector3(0.f, -1.f, 0.f ), 10.f, color( 1.f, 1.f, 1.f ) ) << attenuation{ .constant = 0.8f, .linear = 0.2f, .exponential = 0.f }
-<< rotatez(sinf(time*3.f) * 10.f);
+<< animate([](real32 time) { return rotatez(sinf(time * 3.f) * 10.f); });
 #endif
 
 
@@ -73,4 +82,4 @@ scene += blend(
       torus( 1.f,2.f ) << color( 0.1f,0.7f,0.1f ),
       cube( 3.f ),
       sphere( 3.f ) << color( 0.5f,0.1f,0.1f )
-   }, 1.f + sinf( time * 3.f - (3.1415926f/2.f) ) ) << surface{ .dielectric = 0.3f };
+   }, 1.f ) << animate( []( real32 time ) { return 1.f + sinf( time * 3.f - (3.1415926f/2.f) ); } ) << surface{ .dielectric = 0.3f };
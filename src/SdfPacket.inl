@@ -0,0 +1,167 @@
+//-----------------------------------------------------------------------------
+// Packet version of CSdfProgram::Evaluate
+//
+// This file is included once for every instruction set that the distances
+// can be evaluated with. The namespace that includes it defines CLanes, which
+// holds CLanes::skWidth floats in a single register. The operations are done
+// in the same order as the scalar code so both give the same distances.
+//-----------------------------------------------------------------------------
+
+inline CLanes TransformLanes( real32 const a, real32 const b, real32 const c, real32 const d, CLanes const& x, CLanes const& y, CLanes const& z )
+{
+   return (CLanes( a ) * x + CLanes( b ) * y) + (CLanes( c ) * z + CLanes( d ));
+}
+
+inline CLanes LengthLanes( CLanes const& x, CLanes const& y, CLanes const& z )
+{
+   return Sqrt( (x * x + y * y) + z * z );
+}
+
+inline CLanes EvaluatePrimitive( SSdfInstruction const& instruction, CTransform4f const& transform,
+   CLanes const& pointX, CLanes const& pointY, CLanes const& pointZ, uint32_t const laneMask )
+{
+   CLanes const x = TransformLanes( transform.m00, transform.m01, transform.m02, transform.m03, pointX, pointY, pointZ );
+   CLanes const y = TransformLanes( transform.m10, transform.m11, transform.m12, transform.m13, pointX, pointY, pointZ );
+   CLanes const z = TransformLanes( transform.m20, transform.m21, transform.m22, transform.m23, pointX, pointY, pointZ );
+
+   real32 const* const params = instruction.mParams;
+   switch (instruction.mOp)
+   {
+   case ESdfOp::Sphere:
+      return LengthLanes( x - CLanes( params[0] ), y - CLanes( params[1] ), z - CLanes( params[2] ) ) - CLanes( params[3] );
+
+   case ESdfOp::Plane:
+      return ((CLanes( params[0] ) * x + CLanes( params[1] ) * y) + CLanes( params[2] ) * z) - CLanes( params[3] );
+
+   case ESdfOp::Cube:
+      {
+         CLanes const zero( 0.f );
+         CLanes const qx = Abs( x ) - CLanes( params[0] );
+         CLanes const qy = Abs( y ) - CLanes( params[1] );
+         CLanes const qz = Abs( z ) - CLanes( params[2] );
+         // distance outside
+         CLanes const d = LengthLanes( Max( qx, zero ), Max( qy, zero ), Max( qz, zero ) );
+         // distance inside
+         CLanes const du = Max( Max( Min( qx, zero ), Min( qy, zero ) ), Min( qz, zero ) );
+         return d + du;
+      }
+
+   default:
+      {
+         // custom objects are given all of the points in one call
+         real32 localX[CLanes::skWidth];
+         real32 localY[CLanes::skWidth];
+         real32 localZ[CLanes::skWidth];
+         real32 distances[CLanes::skWidth];
+         x.Store( localX );
+         y.Store( localY );
+         z.Store( localZ );
+
+         instruction.mpObject->GetDistancesToPoints( localX, localY, localZ, CLanes::skWidth, laneMask, distances );
+         return CLanes::Load( distances );
+      }
+   }
+}
+
+void EvaluatePacket( SSdfInstruction const* const pBegin, SSdfInstruction const* const pEnd, CTransform4f const* const pTransforms,
+   SPointPacket const& points, uint32_t const activeMask, real32* const pMinDistances )
+{
+   for (uint32_t base = 0; base < SPointPacket::skWidth; base += CLanes::skWidth)
+   {
+      uint32_t const laneMask = (activeMask >> base) & ((1u << CLanes::skWidth) - 1);
+      if (laneMask == 0)
+      {
+         continue;
+      }
+
+      CLanes const pointX = CLanes::Load( points.mX + base );
+      CLanes const pointY = CLanes::Load( points.mY + base );
+      CLanes const pointZ = CLanes::Load( points.mZ + base );
+
+      CLanes stack[CSdfProgram::skMaxStackDepth];
+      uint32_t top = 0;
+
+      for (SSdfInstruction const* pInstruction = pBegin; pInstruction != pEnd; ++pInstruction)
+      {
+         SSdfInstruction const& instruction = *pInstruction;
+         switch (instruction.mOp)
+         {
+         case ESdfOp::Sphere:
+         case ESdfOp::Plane:
+         case ESdfOp::Cube:
+         case ESdfOp::Custom:
+            stack[top++] = EvaluatePrimitive( instruction, pTransforms[instruction.mTransform], pointX, pointY, pointZ, laneMask );
+            break;
+         case ESdfOp::Constant:
+            stack[top++] = CLanes( instruction.mParams[0] );
+            break;
+         case ESdfOp::Union:
+            {
+               top -= instruction.mCount;
+               CLanes minValue( skLargeNumber );
+               for (uint32_t child = 0; child < instruction.mCount; ++child)
+               {
+                  minValue = Min( minValue, stack[top + child] );
+               }
+               stack[top++] = minValue;
+            }
+            break;
+         case ESdfOp::Intersection:
+            {
+               top -= instruction.mCount;
+               CLanes maxValue( 0.f );
+               for (uint32_t child = 0; child < instruction.mCount; ++child)
+               {
+                  maxValue = Max( maxValue, stack[top + child] );
+               }
+               stack[top++] = maxValue;
+            }
+            break;
+         case ESdfOp::Difference:
+            {
+               top -= instruction.mCount;
+               CLanes maxValue( 0.f );
+               for (uint32_t child = 0; child < instruction.mCount; ++child)
+               {
+                  maxValue = Max( maxValue, child ? -stack[top + child] : stack[top + child] );
+               }
+               stack[top++] = maxValue;
+            }
+            break;
+         case ESdfOp::SmoothUnion:
+            {
+               top -= instruction.mCount;
+               CLanes const k( instruction.mParams[0] );
+               CLanes minValue = instruction.mCount ? stack[top] : CLanes( skLargeNumber );
+               for (uint32_t child = 1; child < instruction.mCount; ++child)
+               {
+                  // see CRenderSmoothUnion::SmoothUnion
+                  CLanes const d2 = stack[top + child];
+                  CLanes const h = Max( k - Abs( minValue - d2 ), CLanes( 0.f ) ) / k;
+                  minValue = Min( minValue, d2 ) - h * h * h * k * CLanes( 1.f / 6.f );
+               }
+               stack[top++] = minValue;
+            }
+            break;
+         case ESdfOp::Blend:
+            top -= 2;
+            stack[top] = stack[top] + (stack[top + 1] - stack[top]) * CLanes( instruction.mParams[0] );
+            ++top;
+            break;
+         }
+      }
+
+      CLanes const distance = top ? stack[0] : CLanes( skLargeNumber );
+      real32 minDistances[CLanes::skWidth];
+      Min( CLanes::Load( pMinDistances + base ), distance ).Store( minDistances );
+
+      // the points that aren't active keep their distances
+      for (uint32_t lane = 0; lane < CLanes::skWidth; ++lane)
+      {
+         if (laneMask & (1u << lane))
+         {
+            pMinDistances[base + lane] = minDistances[lane];
+         }
+      }
+   }
+}